@@ -0,0 +1,21 @@
+-- Builds the tables the pgbench scripts read from the loaded PGN
+
+CREATE TABLE bench_games AS
+  SELECT id, pgn, pgn::chessgame AS game FROM bench_pgn;
+ALTER TABLE bench_games ADD PRIMARY KEY (id);
+DROP TABLE bench_pgn;
+
+-- Positions taken from other games at various plies, most of them not in
+-- the game they are looked up in
+CREATE TABLE bench_positions AS
+  SELECT id, getBoard(game, id % 40) AS board FROM bench_games;
+ALTER TABLE bench_positions ADD PRIMARY KEY (id);
+
+-- Openings of 4 to 9 plies
+CREATE TABLE bench_openings AS
+  SELECT id, getFirstMoves(game, 4 + id % 6) AS opening FROM bench_games;
+ALTER TABLE bench_openings ADD PRIMARY KEY (id);
+
+CREATE INDEX bench_games_game_idx ON bench_games (game);
+
+VACUUM ANALYZE bench_games, bench_positions, bench_openings;
@@ -0,0 +1,55 @@
+/**
+  Generates random games for the benchmark suite, one per line in COPY text
+  format: id, tab, PGN. Same seed gives the same games.
+
+  usage: randomgames count [seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../smallchesslib.h"
+
+#define MIN_PLIES 10
+#define MAX_PLIES 120
+
+const char promotions[] = "qrbn";
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    fprintf(stderr,"usage: %s count [seed]\n",argv[0]);
+    return 1;
+  }
+
+  long count = atol(argv[1]);
+  uint16_t seed = argc > 2 ? (uint16_t) atoi(argv[2]) : 1;
+
+  SCL_randomBetterSeed(seed);
+
+  for (long id = 1; id <= count; ++id)
+  {
+    SCL_Game game;
+    SCL_gameInit(&game,0);
+
+    int plies = MIN_PLIES +
+      (SCL_randomBetter() * 256 + SCL_randomBetter()) %
+      (MAX_PLIES - MIN_PLIES + 1);
+
+    for (int i = 0; i < plies && game.state == SCL_GAME_STATE_PLAYING; ++i)
+    {
+      uint8_t squareFrom, squareTo;
+      char p;
+
+      SCL_boardRandomMove(game.board,SCL_randomBetter,&squareFrom,&squareTo,&p);
+      SCL_gameMakeMove(&game,squareFrom,squareTo,
+        promotions[SCL_randomBetter() % 4]);
+    }
+
+    printf("%ld\t",id);
+    SCL_printPGN(game.record,(SCL_PutCharFunction) putchar,0);
+    putchar('\n');
+  }
+
+  return 0;
+}
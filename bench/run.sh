@@ -0,0 +1,58 @@
+#!/bin/sh
+# runs the pgbench suite against a local server and prints throughput and
+# latency percentiles per operation, e.g.
+#
+#   ./run.sh                      # all scripts
+#   GAMES=100000 ./run.sh hasboard getboard
+#
+# the extension must be installed (make install), the server running and
+# reachable with the usual PG* environment variables
+
+DB=${DB:-chessgame_bench}
+GAMES=${GAMES:-10000}
+SEED=${SEED:-1}
+CLIENTS=${CLIENTS:-4}
+DURATION=${DURATION:-10}
+SETUP=${SETUP:-1}        # set to 0 to reuse the tables of a previous run
+
+cd "$(dirname "$0")" || exit 1
+set -e
+
+if [ "$SETUP" != 0 ]; then
+  cc -std=c99 -O2 -o randomgames randomgames.c
+  createdb "$DB" 2>/dev/null || true
+  psql -q -X -v ON_ERROR_STOP=1 -d "$DB" -f schema.sql
+  ./randomgames "$GAMES" "$SEED" |
+    psql -q -X -v ON_ERROR_STOP=1 -d "$DB" -c "\\copy bench_pgn FROM pstdin"
+  psql -q -X -v ON_ERROR_STOP=1 -d "$DB" -f prepare.sql
+fi
+
+if [ $# -eq 0 ]; then
+  set -- $(ls scripts | sed 's/\.sql$//')
+fi
+
+LOGDIR=$(mktemp -d)
+trap 'rm -rf "$LOGDIR"' EXIT
+
+printf "%-12s %10s %10s %10s %10s %10s\n" \
+  operation tps "p50 ms" "p95 ms" "p99 ms" "max ms"
+
+for op in "$@"; do
+  clients=$CLIENTS
+  [ "$op" = btree_build ] && clients=1
+
+  tps=$(pgbench -n -M simple -c "$clients" -j "$clients" -T "$DURATION" \
+      -D games="$GAMES" -l --log-prefix="$LOGDIR/$op" \
+      -f "scripts/$op.sql" "$DB" 2>/dev/null |
+    sed -n 's/^tps = \([0-9.]*\).*/\1/p' | head -1)
+
+  # third field of the transaction log is the latency in microseconds
+  cat "$LOGDIR/$op".* | awk '{ print $3 }' | sort -n | awk -v op="$op" \
+    -v tps="$tps" '
+    { v[NR] = $1 }
+    function pct(p) { i = int(NR * p + 0.5); if (i < 1) i = 1; return v[i] / 1000 }
+    END {
+      printf "%-12s %10.1f %10.3f %10.3f %10.3f %10.3f\n",
+        op, tps, pct(0.50), pct(0.95), pct(0.99), v[NR] / 1000
+    }'
+done
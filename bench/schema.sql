@@ -0,0 +1,10 @@
+-- Benchmark schema, loaded by run.sh. The PGN column is filled from
+-- randomgames before prepare.sql is run.
+CREATE EXTENSION IF NOT EXISTS chessgame;
+
+DROP TABLE IF EXISTS bench_pgn, bench_games, bench_positions, bench_openings;
+
+CREATE TABLE bench_pgn (
+  id   integer PRIMARY KEY,
+  pgn  text NOT NULL
+);
@@ -0,0 +1,4 @@
+-- btree build over the whole table, rolled back. Run with one client.
+BEGIN;
+CREATE INDEX ON bench_games (game);
+ROLLBACK;
@@ -0,0 +1,4 @@
+-- btree equality scan
+\set id random(1, :games)
+SELECT id FROM bench_games
+  WHERE game = (SELECT game FROM bench_games WHERE id = :id);
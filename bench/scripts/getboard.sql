@@ -0,0 +1,4 @@
+-- getBoard: replay a game up to a random ply
+\set id random(1, :games)
+\set ply random(0, 80)
+SELECT getBoard(game, :ply) FROM bench_games WHERE id = :id;
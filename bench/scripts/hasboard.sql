@@ -0,0 +1,6 @@
+-- hasBoard: search a game for a position, usually absent
+\set id random(1, :games)
+\set pos random(1, :games)
+SELECT hasBoard(g.game, p.board, 60)
+  FROM bench_games g, bench_positions p
+  WHERE g.id = :id AND p.id = :pos;
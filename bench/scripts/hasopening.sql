@@ -0,0 +1,6 @@
+-- hasOpening: btree range scan for the games starting with an opening.
+-- The opening is substituted as a literal so that the planner can turn it
+-- into index bounds, which needs -M simple (the default).
+\set id random(1, :games)
+SELECT opening FROM bench_openings WHERE id = :id \gset
+SELECT count(*) FROM bench_games WHERE hasOpening(game, ':opening');
@@ -0,0 +1,3 @@
+-- chessgame_in: parse a PGN
+\set id random(1, :games)
+SELECT pgn::chessgame FROM bench_games WHERE id = :id;
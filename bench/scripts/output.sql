@@ -0,0 +1,3 @@
+-- chessgame_out: print a game as PGN
+\set id random(1, :games)
+SELECT game::text FROM bench_games WHERE id = :id;
@@ -1,150 +1,1121 @@
--- complain if script is sourced in psql, rather than via CREATE EXTENSION
-\echo Use "CREATE EXTENSION chessgame" to load this file. \quit
-
-/******************************************************************************
-* Input/Output
-******************************************************************************/
-
-CREATE OR REPLACE FUNCTION chessgame_in(cstring)
-  RETURNS chessgame
-  AS 'MODULE_PATHNAME'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-CREATE OR REPLACE FUNCTION chessgame_out(chessgame)
-  RETURNS cstring
-  AS 'MODULE_PATHNAME'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-
---CREATE OR REPLACE FUNCTION chessgame_recv(internal)
-  --RETURNS chessgame
-  --AS 'MODULE_PATHNAME'
-  --LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-CREATE OR REPLACE FUNCTION getFirstMoves(chessgame,integer)
-  RETURNS chessgame
-  AS 'MODULE_PATHNAME', 'getFirstMoves'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-CREATE OR REPLACE FUNCTION getBoundedGame(chessgame)
-  RETURNS chessgame
-  AS 'MODULE_PATHNAME', 'getBoundedGame'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-CREATE OR REPLACE FUNCTION chessboard_in(cstring)
-  RETURNS chessboard
-  AS 'MODULE_PATHNAME'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-CREATE OR REPLACE FUNCTION chessboard_out(chessboard)
-  RETURNS cstring
-  AS 'MODULE_PATHNAME'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-
-CREATE TYPE chessgame (
-  internallength = 512,
-  input          = chessgame_in,
-  output         = chessgame_out
-  --receive        = chessgame_recv,
-  --send           = chessgame_send,
-  --alignment      = double
-);
-
-CREATE TYPE chessboard (
-  internallength = 69,
-  input          = chessboard_in,
-  output         = chessboard_out
-);
-
-
-
-
-/******************************************************************************/
-
-
-CREATE OR REPLACE FUNCTION hasBoard(chessgame,chessboard,integer)
-  RETURNS boolean
-  AS 'MODULE_PATHNAME', 'hasBoard'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-CREATE OR REPLACE FUNCTION getBoard(chessgame,integer)
-  RETURNS chessboard
-  AS 'MODULE_PATHNAME', 'getBoard'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-
-/******************************************************************************/
-                 --B-Tree
-/******************************************************************************/
-
-CREATE OR REPLACE FUNCTION chessgame_abs_eq(chessgame, chessgame)
-  RETURNS boolean
-  AS 'MODULE_PATHNAME'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-CREATE OR REPLACE FUNCTION chessgame_abs_lt(chessgame, chessgame)
-  RETURNS boolean
-  AS 'MODULE_PATHNAME'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-CREATE OR REPLACE FUNCTION chessgame_abs_le(chessgame, chessgame)
-  RETURNS boolean
-  AS 'MODULE_PATHNAME'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-CREATE OR REPLACE FUNCTION chessgame_abs_gt(chessgame, chessgame)
-  RETURNS boolean
-  AS 'MODULE_PATHNAME'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-CREATE OR REPLACE FUNCTION chessgame_abs_ge(chessgame, chessgame)
-  RETURNS boolean
-  AS 'MODULE_PATHNAME'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-CREATE OPERATOR = (
-  LEFTARG = chessgame, RIGHTARG = chessgame,
-  PROCEDURE = chessgame_abs_eq,
-  COMMUTATOR = =, NEGATOR = <>
-);
-CREATE OPERATOR < (
-  LEFTARG = chessgame, RIGHTARG = chessgame,
-  PROCEDURE = chessgame_abs_lt,
-  COMMUTATOR = >, NEGATOR = >=
-);
-CREATE OPERATOR <= (
-  LEFTARG = chessgame, RIGHTARG = chessgame,
-  PROCEDURE = chessgame_abs_le,
-  COMMUTATOR = >=, NEGATOR = >
-);
-CREATE OPERATOR >= (
-  LEFTARG = chessgame, RIGHTARG = chessgame,
-  PROCEDURE = chessgame_abs_ge,
-  COMMUTATOR = <=, NEGATOR = <
-);
-CREATE OPERATOR > (
-  LEFTARG = chessgame, RIGHTARG = chessgame,
-  PROCEDURE = chessgame_abs_gt,
-  COMMUTATOR = <, NEGATOR = <=
-);
-
-CREATE OR REPLACE FUNCTION chessgame_abs_cmp(chessgame, chessgame)
-  RETURNS integer
-  AS 'MODULE_PATHNAME'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
-
-CREATE OPERATOR CLASS chessgame_abs_ops
-DEFAULT FOR TYPE chessgame USING btree
-AS
-        OPERATOR        1       <  ,
-        OPERATOR        2       <= ,
-        OPERATOR        3       =  ,
-        OPERATOR        4       >= ,
-        OPERATOR        5       >  ,
-        FUNCTION        1       chessgame_abs_cmp(chessgame, chessgame);
-
-CREATE OR REPLACE FUNCTION hasOpening(chessgame1 chessgame,chessgame2 chessgame)
-  RETURNS boolean as $$
-    SELECT $1 >= $2 AND $1 < getBoundedGame($2);
-  $$ LANGUAGE SQL;
\ No newline at end of file
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION chessgame" to load this file. \quit
+
+/******************************************************************************
+* Input/Output
+******************************************************************************/
+
+CREATE OR REPLACE FUNCTION chessgame_in(cstring)
+  RETURNS chessgame
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Stable rather than immutable: the text depends on chessgame.output_format
+CREATE OR REPLACE FUNCTION chessgame_out(chessgame)
+  RETURNS cstring
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+
+-- Adds opening-prefix and position frequencies to the standard statistics
+CREATE OR REPLACE FUNCTION chessgame_typanalyze(internal)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C STRICT PARALLEL SAFE;
+
+--CREATE OR REPLACE FUNCTION chessgame_recv(internal)
+  --RETURNS chessgame
+  --AS 'MODULE_PATHNAME'
+  --LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Coordinate move text (e2e4 e7e5 g1f3), read and written without move
+-- generation. Input follows the board only to check that each move takes
+-- a piece of the side to move and that promotion suffixes are on pawns
+-- reaching the last rank; other illegal moves are not detected. chessgame
+-- input accepts it as well, and output produces it when
+-- chessgame.output_format is uci.
+CREATE OR REPLACE FUNCTION from_uci(text)
+  RETURNS chessgame
+  AS 'MODULE_PATHNAME', 'chessgame_from_uci'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION to_uci(chessgame)
+  RETURNS text
+  AS 'MODULE_PATHNAME', 'chessgame_to_uci_text'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION getFirstMoves(chessgame,integer)
+  RETURNS chessgame
+  AS 'MODULE_PATHNAME', 'getFirstMoves'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION getBoundedGame(chessgame)
+  RETURNS chessgame
+  AS 'MODULE_PATHNAME', 'getBoundedGame'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessboard_in(cstring)
+  RETURNS chessboard
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessboard_out(chessboard)
+  RETURNS cstring
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+
+CREATE TYPE chessgame (
+  internallength = VARIABLE,
+  input          = chessgame_in,
+  output         = chessgame_out,
+  analyze        = chessgame_typanalyze,
+  storage        = extended
+  --receive        = chessgame_recv,
+  --send           = chessgame_send,
+  --alignment      = double
+);
+
+CREATE TYPE chessboard (
+  internallength = 69,
+  input          = chessboard_in,
+  output         = chessboard_out
+);
+
+
+
+
+/******************************************************************************/
+
+
+CREATE OR REPLACE FUNCTION chessgame_has_position(chessgame, chessboard)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Estimated from the common positions gathered by ANALYZE
+CREATE OR REPLACE FUNCTION chessgame_position_sel(internal, oid, internal, integer)
+  RETURNS float8
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+-- Whether the game reaches the position at any ply
+CREATE OPERATOR ? (
+  LEFTARG = chessgame, RIGHTARG = chessboard,
+  PROCEDURE = chessgame_has_position,
+  RESTRICT = chessgame_position_sel, JOIN = contjoinsel
+);
+
+CREATE OR REPLACE FUNCTION hasBoard_upto(chessgame,chessboard,integer)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'hasBoard'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Inlined so that ? can use a BRIN or other position index
+CREATE OR REPLACE FUNCTION hasBoard(chessgame chessgame,chessboard chessboard,halfmoves integer)
+  RETURNS boolean as $$
+    SELECT $1 ? $2 AND hasBoard_upto($1, $2, $3);
+  $$ LANGUAGE SQL IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION getBoard(chessgame,integer)
+  RETURNS chessboard
+  AS 'MODULE_PATHNAME', 'getBoard'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Whether the game reaches any of the positions, start included. The game
+-- is replayed once however many positions are given.
+CREATE OR REPLACE FUNCTION hasAnyBoard(chessgame,chessboard[])
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'hasAnyBoard'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Every (array subscript, ply) at which one of the positions is reached
+CREATE OR REPLACE FUNCTION matchingBoards(game chessgame,
+    boards chessboard[], OUT board integer, OUT ply integer)
+  RETURNS SETOF record
+  AS 'MODULE_PATHNAME', 'matchingBoards'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+  ROWS 1;
+
+-- Whether the game contains the move pattern, e.g. 'Nf5@<20' (a knight
+-- lands on f5 before ply 20), 'b:O-O-O' or 'e2e4 ?7?5 Bb5'. Steps match
+-- plies in order with any plies in between; see chessgame.c for the syntax.
+CREATE OR REPLACE FUNCTION chessgame_matches(chessgame,text)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'chessgame_matches'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR ~ (
+  LEFTARG = chessgame, RIGHTARG = text,
+  PROCEDURE = chessgame_matches,
+  RESTRICT = contsel, JOIN = contjoinsel
+);
+
+-- Whether the coordinate moves (e.g. 'g1f3 b8c6 f1b5') are played one
+-- after the other anywhere in the game. Only their syntax is checked, so
+-- the sequence may start at any move and with either side.
+CREATE OR REPLACE FUNCTION chessgame_contains_moves(chessgame,text)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'chessgame_contains_moves'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR @@ (
+  LEFTARG = chessgame, RIGHTARG = text,
+  PROCEDURE = chessgame_contains_moves,
+  RESTRICT = contsel, JOIN = contjoinsel
+);
+
+CREATE OR REPLACE FUNCTION chessgame_ngram_extract_value(chessgame, internal, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_ngram_extract_query(text, internal, int2, internal, internal, internal, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_ngram_consistent(internal, int2, text, int4, internal, internal, internal, internal)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_ngram_triconsistent(internal, int2, text, int4, internal, internal, internal)
+  RETURNS "char"
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Indexes every run of 3 consecutive moves of each game
+CREATE OPERATOR CLASS chessgame_ngram_ops
+DEFAULT FOR TYPE chessgame USING gin
+AS
+        OPERATOR        1       @@ (chessgame, text),
+        FUNCTION        1       btint8cmp(int8, int8),
+        FUNCTION        2       chessgame_ngram_extract_value(chessgame, internal, internal),
+        FUNCTION        3       chessgame_ngram_extract_query(text, internal, int2, internal, internal, internal, internal),
+        FUNCTION        4       chessgame_ngram_consistent(internal, int2, text, int4, internal, internal, internal, internal),
+        FUNCTION        6       chessgame_ngram_triconsistent(internal, int2, text, int4, internal, internal, internal),
+        STORAGE         int8;
+
+-- Jaccard similarity of the sets of positions reached by two games
+CREATE OR REPLACE FUNCTION similarity(chessgame, chessgame)
+  RETURNS float8
+  AS 'MODULE_PATHNAME', 'chessgame_similarity'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_distance(chessgame, chessgame)
+  RETURNS float8
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR <-> (
+  LEFTARG = chessgame, RIGHTARG = chessgame,
+  PROCEDURE = chessgame_distance,
+  COMMUTATOR = <->
+);
+
+-- Support functions shared by the bitmap signature opclasses
+CREATE OR REPLACE FUNCTION chess_signature_union(internal, internal)
+  RETURNS bytea
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chess_signature_penalty(internal, internal, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chess_signature_picksplit(internal, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chess_signature_same(bytea, bytea, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_gist_consistent(internal, chessgame, int2, oid, internal)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'chess_signature_consistent'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_gist_compress(internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_gist_distance(internal, chessgame, int2, oid, internal)
+  RETURNS float8
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Signatures of the positions of each game, for ORDER BY game <-> :game
+CREATE OPERATOR CLASS chessgame_similarity_ops
+DEFAULT FOR TYPE chessgame USING gist
+AS
+        OPERATOR        15      <-> (chessgame, chessgame) FOR ORDER BY float_ops,
+        FUNCTION        1       chessgame_gist_consistent(internal, chessgame, int2, oid, internal),
+        FUNCTION        2       chess_signature_union(internal, internal),
+        FUNCTION        3       chessgame_gist_compress(internal),
+        FUNCTION        5       chess_signature_penalty(internal, internal, internal),
+        FUNCTION        6       chess_signature_picksplit(internal, internal),
+        FUNCTION        7       chess_signature_same(bytea, bytea, internal),
+        FUNCTION        8       chessgame_gist_distance(internal, chessgame, int2, oid, internal),
+        STORAGE         bytea;
+
+-- Differing squares, plus 1 when the side to move differs and 0.5 for each
+-- castling right only one of the positions has
+CREATE OR REPLACE FUNCTION chessboard_distance(chessboard, chessboard)
+  RETURNS float8
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR <-> (
+  LEFTARG = chessboard, RIGHTARG = chessboard,
+  PROCEDURE = chessboard_distance,
+  COMMUTATOR = <->
+);
+
+CREATE OR REPLACE FUNCTION chessboard_gist_consistent(internal, chessboard, int2, oid, internal)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'chess_signature_consistent'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessboard_gist_compress(internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessboard_gist_distance(internal, chessboard, int2, oid, internal)
+  RETURNS float8
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Square contents, side to move and castling rights of each position, for
+-- ORDER BY board <-> :board
+CREATE OPERATOR CLASS chessboard_distance_ops
+DEFAULT FOR TYPE chessboard USING gist
+AS
+        OPERATOR        15      <-> (chessboard, chessboard) FOR ORDER BY float_ops,
+        FUNCTION        1       chessboard_gist_consistent(internal, chessboard, int2, oid, internal),
+        FUNCTION        2       chess_signature_union(internal, internal),
+        FUNCTION        3       chessboard_gist_compress(internal),
+        FUNCTION        5       chess_signature_penalty(internal, internal, internal),
+        FUNCTION        6       chess_signature_picksplit(internal, internal),
+        FUNCTION        7       chess_signature_same(bytea, bytea, internal),
+        FUNCTION        8       chessboard_gist_distance(internal, chessboard, int2, oid, internal),
+        STORAGE         bytea;
+
+-- Appends a legal move in SAN (e.g. Nf3, exd8=Q) or coordinate notation
+-- (e.g. e2e4, e7e8q). The game is kept in expanded form in memory, so
+-- appending move by move in PL/pgSQL costs O(1) per move instead of
+-- re-reading the whole game.
+CREATE OR REPLACE FUNCTION append_move(chessgame,text)
+  RETURNS chessgame
+  AS 'MODULE_PATHNAME', 'append_move'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR || (
+  LEFTARG = chessgame, RIGHTARG = text,
+  PROCEDURE = append_move
+);
+
+CREATE OR REPLACE FUNCTION apply_moves(chessgame,text[])
+  RETURNS chessgame
+  AS 'MODULE_PATHNAME', 'apply_moves'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Position after playing a legal move, in the same notations
+CREATE OR REPLACE FUNCTION chessboard_apply_move(chessboard,text)
+  RETURNS chessboard
+  AS 'MODULE_PATHNAME', 'chessboard_apply_move'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR + (
+  LEFTARG = chessboard, RIGHTARG = text,
+  PROCEDURE = chessboard_apply_move
+);
+
+
+/******************************************************************************/
+                 --B-Tree
+/******************************************************************************/
+
+CREATE OR REPLACE FUNCTION chessgame_abs_eq(chessgame, chessgame)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_abs_lt(chessgame, chessgame)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_abs_le(chessgame, chessgame)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_abs_gt(chessgame, chessgame)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_abs_ge(chessgame, chessgame)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR = (
+  LEFTARG = chessgame, RIGHTARG = chessgame,
+  PROCEDURE = chessgame_abs_eq,
+  COMMUTATOR = =, NEGATOR = <>,
+  RESTRICT = eqsel, JOIN = eqjoinsel
+);
+CREATE OPERATOR < (
+  LEFTARG = chessgame, RIGHTARG = chessgame,
+  PROCEDURE = chessgame_abs_lt,
+  COMMUTATOR = >, NEGATOR = >=,
+  RESTRICT = scalarltsel, JOIN = scalarltjoinsel
+);
+CREATE OPERATOR <= (
+  LEFTARG = chessgame, RIGHTARG = chessgame,
+  PROCEDURE = chessgame_abs_le,
+  COMMUTATOR = >=, NEGATOR = >,
+  RESTRICT = scalarlesel, JOIN = scalarlejoinsel
+);
+CREATE OPERATOR >= (
+  LEFTARG = chessgame, RIGHTARG = chessgame,
+  PROCEDURE = chessgame_abs_ge,
+  COMMUTATOR = <=, NEGATOR = <,
+  RESTRICT = scalargesel, JOIN = scalargejoinsel
+);
+CREATE OPERATOR > (
+  LEFTARG = chessgame, RIGHTARG = chessgame,
+  PROCEDURE = chessgame_abs_gt,
+  COMMUTATOR = <, NEGATOR = <=,
+  RESTRICT = scalargtsel, JOIN = scalargtjoinsel
+);
+
+CREATE OR REPLACE FUNCTION chessgame_abs_cmp(chessgame, chessgame)
+  RETURNS integer
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR CLASS chessgame_abs_ops
+DEFAULT FOR TYPE chessgame USING btree
+AS
+        OPERATOR        1       <  ,
+        OPERATOR        2       <= ,
+        OPERATOR        3       =  ,
+        OPERATOR        4       >= ,
+        OPERATOR        5       >  ,
+        FUNCTION        1       chessgame_abs_cmp(chessgame, chessgame);
+
+-- Lets a btree index serve ^@ through the equivalent range
+CREATE OR REPLACE FUNCTION chessgame_starts_with_support(internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_starts_with(chessgame, chessgame)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+  SUPPORT chessgame_starts_with_support;
+
+-- Estimated from the opening prefixes gathered by ANALYZE
+CREATE OR REPLACE FUNCTION chessgame_prefix_sel(internal, oid, internal, integer)
+  RETURNS float8
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR ^@ (
+  LEFTARG = chessgame, RIGHTARG = chessgame,
+  PROCEDURE = chessgame_starts_with,
+  RESTRICT = chessgame_prefix_sel, JOIN = contjoinsel
+);
+
+-- Inlined so that ^@ reaches the planner: SP-GiST indexes it directly,
+-- btree through chessgame_starts_with_support
+CREATE OR REPLACE FUNCTION hasOpening(chessgame1 chessgame,chessgame2 chessgame)
+  RETURNS boolean as $$
+    SELECT $1 ^@ $2;
+  $$ LANGUAGE SQL IMMUTABLE PARALLEL SAFE;
+
+-- Distinct moves played after the prefix and the number of games playing
+-- each, read by skipping through a btree index on chessgame from one next
+-- move to the following one. Unless exact, counts are estimated from where
+-- each move's range starts and ends in the btree, scaled by the index's
+-- reltuples, so the cost depends on the number of moves, not of games;
+-- ranges within one leaf page are counted exactly. exact reads every
+-- matching entry and its heap row to leave out rows no longer visible, at
+-- a cost linear in the number of games under the prefix.
+-- Promotions to different pieces on the same squares count as one move.
+CREATE OR REPLACE FUNCTION next_moves(index regclass, prefix chessgame,
+    exact boolean DEFAULT false, OUT move text, OUT games bigint)
+  RETURNS SETOF record
+  AS 'MODULE_PATHNAME', 'next_moves'
+  LANGUAGE C STABLE STRICT PARALLEL SAFE
+  ROWS 20;
+
+/******************************************************************************/
+                 --SP-GiST
+/******************************************************************************/
+
+CREATE OR REPLACE FUNCTION chessgame_spg_config(internal, internal)
+  RETURNS void
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_spg_choose(internal, internal)
+  RETURNS void
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_spg_picksplit(internal, internal)
+  RETURNS void
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_spg_inner_consistent(internal, internal)
+  RETURNS void
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_spg_leaf_consistent(internal, internal)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_spg_compress(chessgame)
+  RETURNS bytea
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR CLASS chessgame_spgist_ops
+DEFAULT FOR TYPE chessgame USING spgist
+AS
+        OPERATOR        1       <  ,
+        OPERATOR        2       <= ,
+        OPERATOR        3       =  ,
+        OPERATOR        4       >= ,
+        OPERATOR        5       >  ,
+        OPERATOR        6       ^@ ,
+        FUNCTION        1       chessgame_spg_config(internal, internal),
+        FUNCTION        2       chessgame_spg_choose(internal, internal),
+        FUNCTION        3       chessgame_spg_picksplit(internal, internal),
+        FUNCTION        4       chessgame_spg_inner_consistent(internal, internal),
+        FUNCTION        5       chessgame_spg_leaf_consistent(internal, internal),
+        FUNCTION        6       chessgame_spg_compress(chessgame),
+        STORAGE         bytea;
+
+/******************************************************************************
+* Opening prefix dictionary
+******************************************************************************/
+
+-- Frequent openings, games starting with one of them can be stored as its id
+-- plus the remaining moves (see chessgame.prefix_compression). Stored games
+-- reference these rows, so entries must never be updated or deleted.
+CREATE TABLE chessgame_prefix (
+  id     integer PRIMARY KEY CHECK (id BETWEEN 1 AND 65535),
+  moves  bytea NOT NULL UNIQUE
+);
+
+SELECT pg_catalog.pg_extension_config_dump('chessgame_prefix', '');
+
+CREATE OR REPLACE FUNCTION chessgame_prefix_changed()
+  RETURNS trigger
+  AS 'MODULE_PATHNAME', 'chessgame_prefix_changed'
+  LANGUAGE C;
+
+-- Entries are append-only, games refer to them by id
+CREATE TRIGGER chessgame_prefix_changed
+  AFTER INSERT ON chessgame_prefix
+  FOR EACH STATEMENT EXECUTE FUNCTION chessgame_prefix_changed();
+
+CREATE TRIGGER chessgame_prefix_append_only
+  BEFORE UPDATE OR DELETE OR TRUNCATE ON chessgame_prefix
+  FOR EACH STATEMENT EXECUTE FUNCTION chessgame_prefix_changed();
+
+CREATE OR REPLACE FUNCTION chessgame_prefix_moves(chessgame, integer)
+  RETURNS bytea
+  AS 'MODULE_PATHNAME', 'chessgame_prefix_moves'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Adds the most frequent openings of the given length found in a table
+-- column to the dictionary, returns the number of new entries.
+CREATE OR REPLACE FUNCTION chessgame_prefix_build(games regclass, col name,
+  plies integer DEFAULT 16, entries integer DEFAULT 1024,
+  mincount integer DEFAULT 100)
+  RETURNS integer AS $$
+DECLARE
+  added integer;
+BEGIN
+  EXECUTE format(
+    'INSERT INTO chessgame_prefix (id, moves)
+       SELECT coalesce((SELECT max(id) FROM chessgame_prefix), 0) +
+                row_number() OVER (ORDER BY n DESC), p
+         FROM (SELECT p, count(*) AS n
+                 FROM (SELECT chessgame_prefix_moves(%I, $1) AS p FROM %s) g
+                WHERE p IS NOT NULL
+                GROUP BY p
+               HAVING count(*) >= $2
+                ORDER BY 2 DESC
+                LIMIT $3) s
+        WHERE NOT EXISTS (SELECT 1 FROM chessgame_prefix d WHERE d.moves = s.p)',
+    col, games)
+  USING plies, mincount, entries;
+  GET DIAGNOSTICS added = ROW_COUNT;
+  RETURN added;
+END;
+$$ LANGUAGE plpgsql;
+
+/******************************************************************************
+* Piece-on-square patterns
+******************************************************************************/
+
+-- A pattern is a chessboard, only its occupied squares are compared
+
+CREATE OR REPLACE FUNCTION chessboard_contains(chessboard, chessboard)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_contains(chessgame, chessboard)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR @> (
+  LEFTARG = chessboard, RIGHTARG = chessboard,
+  PROCEDURE = chessboard_contains,
+  RESTRICT = contsel, JOIN = contjoinsel
+);
+
+CREATE OPERATOR @> (
+  LEFTARG = chessgame, RIGHTARG = chessboard,
+  PROCEDURE = chessgame_contains,
+  RESTRICT = contsel, JOIN = contjoinsel
+);
+
+CREATE OR REPLACE FUNCTION chessboard_gin_extract_value(chessboard, internal, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessboard_gin_extract_query(chessboard, internal, int2, internal, internal, internal, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessboard_gin_consistent(internal, int2, chessboard, int4, internal, internal, internal, internal)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessboard_gin_triconsistent(internal, int2, chessboard, int4, internal, internal, internal)
+  RETURNS "char"
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR CLASS chessboard_pattern_ops
+DEFAULT FOR TYPE chessboard USING gin
+AS
+        OPERATOR        1       @> (chessboard, chessboard),
+        FUNCTION        1       btint4cmp(int4, int4),
+        FUNCTION        2       chessboard_gin_extract_value(chessboard, internal, internal),
+        FUNCTION        3       chessboard_gin_extract_query(chessboard, internal, int2, internal, internal, internal, internal),
+        FUNCTION        4       chessboard_gin_consistent(internal, int2, chessboard, int4, internal, internal, internal, internal),
+        FUNCTION        6       chessboard_gin_triconsistent(internal, int2, chessboard, int4, internal, internal, internal),
+        STORAGE         int4;
+
+/******************************************************************************
+* Material signatures
+******************************************************************************/
+
+-- Piece counts of both sides packed in a bigint, stronger side first, so
+-- the built-in int8 btree and hash opclasses can back expression indexes:
+--   CREATE INDEX ON positions (materialSignature(board));
+--   SELECT ... WHERE materialSignature(board) = materialSignature('KRPvKR');
+
+CREATE OR REPLACE FUNCTION materialSignature(chessboard)
+  RETURNS bigint
+  AS 'MODULE_PATHNAME', 'materialSignature'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION materialSignature(text)
+  RETURNS bigint
+  AS 'MODULE_PATHNAME', 'materialSignature_text'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION materialSignatureText(bigint)
+  RETURNS text
+  AS 'MODULE_PATHNAME', 'materialSignatureText'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Signatures reached by a game, usable with a GIN index on the array
+CREATE OR REPLACE FUNCTION materialSignatures(chessgame)
+  RETURNS bigint[]
+  AS 'MODULE_PATHNAME', 'materialSignatures'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+/******************************************************************************
+* Pawn structures
+******************************************************************************/
+
+CREATE OR REPLACE FUNCTION pawnstructure_in(cstring)
+  RETURNS pawnstructure
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pawnstructure_out(pawnstructure)
+  RETURNS cstring
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Written as the piece placement field of a FEN, only pawns are kept
+CREATE TYPE pawnstructure (
+  internallength = 16,
+  input          = pawnstructure_in,
+  output         = pawnstructure_out,
+  alignment      = double
+);
+
+CREATE OR REPLACE FUNCTION pawnStructure(chessboard)
+  RETURNS pawnstructure
+  AS 'MODULE_PATHNAME', 'pawnStructure'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pawnstructure_eq(pawnstructure, pawnstructure)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pawnstructure_ne(pawnstructure, pawnstructure)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pawnstructure_lt(pawnstructure, pawnstructure)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pawnstructure_le(pawnstructure, pawnstructure)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pawnstructure_gt(pawnstructure, pawnstructure)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pawnstructure_ge(pawnstructure, pawnstructure)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pawnstructure_cmp(pawnstructure, pawnstructure)
+  RETURNS integer
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pawnstructure_hash(pawnstructure)
+  RETURNS integer
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR = (
+  LEFTARG = pawnstructure, RIGHTARG = pawnstructure,
+  PROCEDURE = pawnstructure_eq,
+  COMMUTATOR = =, NEGATOR = <>,
+  RESTRICT = eqsel, JOIN = eqjoinsel,
+  HASHES, MERGES
+);
+CREATE OPERATOR <> (
+  LEFTARG = pawnstructure, RIGHTARG = pawnstructure,
+  PROCEDURE = pawnstructure_ne,
+  COMMUTATOR = <>, NEGATOR = =,
+  RESTRICT = neqsel, JOIN = neqjoinsel
+);
+CREATE OPERATOR < (
+  LEFTARG = pawnstructure, RIGHTARG = pawnstructure,
+  PROCEDURE = pawnstructure_lt,
+  COMMUTATOR = >, NEGATOR = >=
+);
+CREATE OPERATOR <= (
+  LEFTARG = pawnstructure, RIGHTARG = pawnstructure,
+  PROCEDURE = pawnstructure_le,
+  COMMUTATOR = >=, NEGATOR = >
+);
+CREATE OPERATOR >= (
+  LEFTARG = pawnstructure, RIGHTARG = pawnstructure,
+  PROCEDURE = pawnstructure_ge,
+  COMMUTATOR = <=, NEGATOR = <
+);
+CREATE OPERATOR > (
+  LEFTARG = pawnstructure, RIGHTARG = pawnstructure,
+  PROCEDURE = pawnstructure_gt,
+  COMMUTATOR = <, NEGATOR = <=
+);
+
+CREATE OPERATOR CLASS pawnstructure_ops
+DEFAULT FOR TYPE pawnstructure USING btree
+AS
+        OPERATOR        1       <  ,
+        OPERATOR        2       <= ,
+        OPERATOR        3       =  ,
+        OPERATOR        4       >= ,
+        OPERATOR        5       >  ,
+        FUNCTION        1       pawnstructure_cmp(pawnstructure, pawnstructure);
+
+CREATE OPERATOR CLASS pawnstructure_hash_ops
+DEFAULT FOR TYPE pawnstructure USING hash
+AS
+        OPERATOR        1       =  ,
+        FUNCTION        1       pawnstructure_hash(pawnstructure);
+
+-- Jaccard similarity of the pawn sets, in [0, 1]
+CREATE OR REPLACE FUNCTION similarity(pawnstructure, pawnstructure)
+  RETURNS real
+  AS 'MODULE_PATHNAME', 'pawnstructure_similarity'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- True when similarity reaches chessgame.pawn_similarity_threshold
+CREATE OR REPLACE FUNCTION pawnstructure_similar(pawnstructure, pawnstructure)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR % (
+  LEFTARG = pawnstructure, RIGHTARG = pawnstructure,
+  PROCEDURE = pawnstructure_similar,
+  COMMUTATOR = %,
+  RESTRICT = contsel, JOIN = contjoinsel
+);
+
+CREATE OR REPLACE FUNCTION pawnstructure_gin_extract_value(pawnstructure, internal, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pawnstructure_gin_extract_query(pawnstructure, internal, int2, internal, internal, internal, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pawnstructure_gin_consistent(internal, int2, pawnstructure, int4, internal, internal, internal, internal)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Keys are the pawns (square, plus 64 for black). The btree and hash
+-- opclasses serve exact lookups, this one also finds similar structures:
+--   CREATE INDEX ON positions USING gin (pawnStructure(board));
+--   SELECT ... WHERE pawnStructure(board) % '8/pp3ppp/8/8/8/8/PP3PPP/8';
+CREATE OPERATOR CLASS pawnstructure_gin_ops
+FOR TYPE pawnstructure USING gin
+AS
+        OPERATOR        1       =  (pawnstructure, pawnstructure),
+        OPERATOR        2       %  (pawnstructure, pawnstructure),
+        FUNCTION        1       btint2cmp(int2, int2),
+        FUNCTION        2       pawnstructure_gin_extract_value(pawnstructure, internal, internal),
+        FUNCTION        3       pawnstructure_gin_extract_query(pawnstructure, internal, int2, internal, internal, internal, internal),
+        FUNCTION        4       pawnstructure_gin_consistent(internal, int2, pawnstructure, int4, internal, internal, internal, internal),
+        STORAGE         int2;
+
+/******************************************************************************
+* BRIN
+******************************************************************************/
+
+CREATE OR REPLACE FUNCTION chessgame_brin_bloom_opcinfo(internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_brin_bloom_add_value(internal, internal, internal, internal)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_brin_bloom_consistent(internal, internal, internal)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_brin_bloom_union(internal, internal, internal)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessgame_brin_bloom_options(internal)
+  RETURNS void
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+-- Bloom filter of the positions reached in each block range. Every game
+-- sets a few bits per ply, so keep ranges small for archives:
+--   CREATE INDEX ON games USING brin (game chessgame_bloom_ops(bloom_bits = 32768))
+--     WITH (pages_per_range = 4);
+CREATE OPERATOR CLASS chessgame_bloom_ops
+FOR TYPE chessgame USING brin
+AS
+        OPERATOR        1       ? (chessgame, chessboard),
+        FUNCTION        1       chessgame_brin_bloom_opcinfo(internal),
+        FUNCTION        2       chessgame_brin_bloom_add_value(internal, internal, internal, internal),
+        FUNCTION        3       chessgame_brin_bloom_consistent(internal, internal, internal),
+        FUNCTION        4       chessgame_brin_bloom_union(internal, internal, internal),
+        FUNCTION        5       chessgame_brin_bloom_options(internal),
+        STORAGE         bytea;
+
+/******************************************************************************
+* Search
+******************************************************************************/
+
+-- Alpha-beta search to the given depth in plies, score from white's point
+-- of view. The transposition table (chessgame.tt_size) is kept for the
+-- rest of the statement, so evaluating many related positions is cheap.
+CREATE OR REPLACE FUNCTION evaluate(chessboard, integer)
+  RETURNS integer
+  AS 'MODULE_PATHNAME', 'evaluate'
+  LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+-- Best move in coordinate notation (e.g. e2e4), NULL if there is none
+CREATE OR REPLACE FUNCTION best_move(chessboard, integer)
+  RETURNS text
+  AS 'MODULE_PATHNAME', 'best_move'
+  LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+-- Evaluation and best move of every position of the game, start included
+CREATE OR REPLACE FUNCTION analyse_game(game chessgame, depth integer,
+    OUT ply integer, OUT eval integer, OUT best_move text)
+  RETURNS SETOF record
+  AS 'MODULE_PATHNAME', 'analyse_game'
+  LANGUAGE C VOLATILE STRICT PARALLEL SAFE
+  ROWS 80;
+
+/******************************************************************************
+* Background analysis
+******************************************************************************/
+
+-- Games waiting for analysis by the background workers, which are started
+-- when chessgame is in shared_preload_libraries and
+-- chessgame.analysis_workers > 0. Jobs are removed once analysed. The
+-- depth is checked against the limits of analyse_game when enqueued.
+CREATE TABLE chessgame_analysis_queue (
+  id        bigserial PRIMARY KEY,
+  game_id   bigint NOT NULL,
+  depth     integer NOT NULL CHECK (depth BETWEEN 0 AND 12),
+  game      chessgame NOT NULL,
+  enqueued  timestamptz NOT NULL DEFAULT now()
+);
+
+-- One row per position of each analysed game, as returned by analyse_game
+CREATE TABLE chessgame_analysis (
+  game_id     bigint NOT NULL,
+  ply         integer NOT NULL,
+  depth       integer NOT NULL,
+  eval        integer NOT NULL,
+  best_move   text,
+  analysed_at timestamptz NOT NULL DEFAULT now(),
+  PRIMARY KEY (game_id, ply)
+);
+
+-- Jobs whose analysis raised an error, taken off the queue so they are not
+-- retried; insert them into the queue again to retry
+CREATE TABLE chessgame_analysis_failed (
+  game_id   bigint NOT NULL,
+  depth     integer NOT NULL,
+  game      chessgame NOT NULL,
+  enqueued  timestamptz NOT NULL,
+  failed_at timestamptz NOT NULL DEFAULT now(),
+  error     text NOT NULL
+);
+
+SELECT pg_catalog.pg_extension_config_dump('chessgame_analysis_queue', '');
+SELECT pg_catalog.pg_extension_config_dump('chessgame_analysis_queue_id_seq', '');
+SELECT pg_catalog.pg_extension_config_dump('chessgame_analysis', '');
+SELECT pg_catalog.pg_extension_config_dump('chessgame_analysis_failed', '');
+
+/******************************************************************************
+* Opening explorer
+******************************************************************************/
+
+-- Moves played from the position reached by the game, with the number of
+-- games and their results, read from the tree kept in shared memory by the
+-- explorer worker. The worker runs when chessgame is in
+-- shared_preload_libraries and chessgame.explorer_size > 0, and builds the
+-- tree from the first chessgame.explorer_depth plies of the games in
+-- chessgame.explorer_table. Each refresh reads rows above the highest key
+-- read so far, so rows committed late with a lower key, updates and
+-- deletes are only seen after explorer_rebuild().
+CREATE OR REPLACE FUNCTION explore(game chessgame, OUT move text,
+    OUT games bigint, OUT white_wins bigint, OUT draws bigint,
+    OUT black_wins bigint)
+  RETURNS SETOF record
+  AS 'MODULE_PATHNAME', 'explore'
+  LANGUAGE C VOLATILE STRICT PARALLEL SAFE
+  ROWS 20;
+
+-- Games in the tree, nodes used out of those available, whether moves were
+-- left out for lack of room, and the highest key read so far
+CREATE OR REPLACE FUNCTION explorer_status(OUT games bigint, OUT nodes bigint,
+    OUT capacity bigint, OUT full boolean, OUT last_key bigint)
+  RETURNS record
+  AS 'MODULE_PATHNAME', 'explorer_status'
+  LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+-- Rebuilds the tree from the whole table, e.g. after updates or deletes
+CREATE OR REPLACE FUNCTION explorer_rebuild()
+  RETURNS void
+  AS 'MODULE_PATHNAME', 'explorer_rebuild'
+  LANGUAGE C VOLATILE STRICT PARALLEL UNSAFE;
+
+REVOKE ALL ON FUNCTION explorer_rebuild() FROM PUBLIC;
+
+/******************************************************************************
+* Statistics
+******************************************************************************/
+
+-- Hot-path counters and per-function calls and time in milliseconds
+-- (time only with chessgame.track_timing). Counts are cluster-wide when
+-- chessgame is in shared_preload_libraries and per backend otherwise.
+-- Backends publish their counts every 1024 calls and at transaction end.
+CREATE OR REPLACE FUNCTION chessgame_stats(OUT name text, OUT value bigint,
+    OUT total_time double precision)
+  RETURNS SETOF record
+  AS 'MODULE_PATHNAME', 'chessgame_stats'
+  LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE VIEW chessgame_stats AS
+  SELECT * FROM chessgame_stats();
+
+CREATE OR REPLACE FUNCTION chessgame_stats_reset()
+  RETURNS void
+  AS 'MODULE_PATHNAME', 'chessgame_stats_reset'
+  LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION chessgame_stats_reset() FROM PUBLIC;
+
+/******************************************************************************
+* Approximate position aggregates
+******************************************************************************/
+
+CREATE OR REPLACE FUNCTION chessgame_hll_trans(internal, chessgame)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessboard_hll_trans(internal, chessboard)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chess_hll_combine(internal, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chess_hll_serialize(internal)
+  RETURNS bytea
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chess_hll_deserialize(bytea, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chess_hll_final(internal)
+  RETURNS bigint
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+-- HyperLogLog estimate of the number of distinct positions, within about
+-- 1% for large counts. A game counts every position it reaches, start
+-- included.
+CREATE AGGREGATE approx_distinct_positions(chessgame) (
+  SFUNC = chessgame_hll_trans,
+  STYPE = internal,
+  SSPACE = 16384,
+  FINALFUNC = chess_hll_final,
+  COMBINEFUNC = chess_hll_combine,
+  SERIALFUNC = chess_hll_serialize,
+  DESERIALFUNC = chess_hll_deserialize,
+  PARALLEL = SAFE
+);
+
+CREATE AGGREGATE approx_distinct_positions(chessboard) (
+  SFUNC = chessboard_hll_trans,
+  STYPE = internal,
+  SSPACE = 16384,
+  FINALFUNC = chess_hll_final,
+  COMBINEFUNC = chess_hll_combine,
+  SERIALFUNC = chess_hll_serialize,
+  DESERIALFUNC = chess_hll_deserialize,
+  PARALLEL = SAFE
+);
+
+-- A position and its approximate number of occurrences; the true count is
+-- between count - error and count
+CREATE TYPE position_count AS (
+  board  chessboard,
+  count  bigint,
+  error  bigint
+);
+
+CREATE OR REPLACE FUNCTION chessgame_top_trans(internal, chessgame, integer)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chessboard_top_trans(internal, chessboard, integer)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chess_top_combine(internal, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chess_top_serialize(internal)
+  RETURNS bytea
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chess_top_deserialize(bytea, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION chess_top_final(internal)
+  RETURNS position_count[]
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+-- Space-Saving summary of the k most frequent positions (k up to 10000),
+-- most frequent first. Every position making up more than 1/k of all the
+-- positions seen is listed.
+CREATE AGGREGATE top_positions(chessgame, integer) (
+  SFUNC = chessgame_top_trans,
+  STYPE = internal,
+  FINALFUNC = chess_top_final,
+  COMBINEFUNC = chess_top_combine,
+  SERIALFUNC = chess_top_serialize,
+  DESERIALFUNC = chess_top_deserialize,
+  PARALLEL = SAFE
+);
+
+CREATE AGGREGATE top_positions(chessboard, integer) (
+  SFUNC = chessboard_top_trans,
+  STYPE = internal,
+  FINALFUNC = chess_top_final,
+  COMBINEFUNC = chess_top_combine,
+  SERIALFUNC = chess_top_serialize,
+  DESERIALFUNC = chess_top_deserialize,
+  PARALLEL = SAFE
+);
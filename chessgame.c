@@ -1,896 +1,7433 @@
-/*
- * chessgame.C
- *
- * PostgreSQL Complex Number Type:
- *
- * complex '(a,b)'
- *
- * Author: Maxime Schoemans <maxime.schoemans@ulb.be>
- */
-
-#include <smallchesslib.h>
-#include <stdio.h>
-#include <postgres.h>
-#include <float.h>
-#include <math.h>
-#include <stdlib.h>
-
-#include "utils/builtins.h"
-#include "libpq/pqformat.h"
-
-PG_MODULE_MAGIC;
-
-#define EPSILON         1.0E-06
-
-#define FPzero(A)       (fabs(A) <= EPSILON)
-#define FPeq(A,B)       (fabs((A) - (B)) <= EPSILON)
-#define FPne(A,B)       (fabs((A) - (B)) > EPSILON)
-#define FPlt(A,B)       ((B) - (A) > EPSILON)
-#define FPle(A,B)       ((A) - (B) <= EPSILON)
-#define FPgt(A,B)       ((A) - (B) > EPSILON)
-#define FPge(A,B)       ((B) - (A) <= EPSILON)
-
-/*****************************************************************************/
-
-/* Structure to represent complex numbers */
-typedef struct
-{
-  double    a,
-            b;
-} Complex;
-
-/* fmgr macros ChessGame type */
-
-#define DatumGetChessGameP(X)  ((SCL_Record *) DatumGetPointer(X))
-#define DatumGetChessBoardP(X) ((SCL_Board *) DatumGetPointer(X))
-#define ChessBoardPGetDatum(X) PointerGetDatum(X)
-#define ChessGamePGetDatum(X)  PointerGetDatum(X)
-#define PG_GETARG_ChessGame_P(n) DatumGetChessGameP(PG_GETARG_DATUM(n))
-#define PG_GETARG_ChessBoard_P(n) DatumGetChessBoardP(PG_GETARG_DATUM(n))
-#define PG_RETURN_ChessGame_P(x) return ChessGamePGetDatum(x)
-#define PG_RETURN_ChessBoard_P(x) return ChessBoardPGetDatum(x)
-
-/*****************************************************************************/
-
-static SCL_Record *
-Chessgame_make(char *str)
-{
-  SCL_Record *c = palloc0(SCL_RECORD_MAX_LENGTH);
-//  SCL_Record *c = palloc0(SCL_RECORD_MAX_LENGTH);
-  SCL_recordFromPGN(*c,str);
-  //SCL_recordFromPGN(*c,"1. f3 e5 2. g4 Qh4#");
-  //SCL_recordFromPGN(*c,"1. Qxc4 c6 2. g4 Qh4#i");
-//  SCL_recordFromPGN(*c,"");
-  return *c;
-
-
-}
-
-static SCL_Board *
-Chessboard_make(char *str)
-{
-  SCL_Board *b = palloc0(SCL_BOARD_STATE_SIZE);
-  SCL_boardInit(*b);
-  SCL_boardFromFEN(*b,str);
-
-
-  /*char *output = palloc0(SCL_FEN_MAX_LENGTH);
-  SCL_boardToFEN(b,output);
-  ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-  errmsg("output: %s",output)));*/
-
-  //SCL_boardFromFEN(*b,'rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1');
-  //SCL_boardFromFEN(*b,'8/5k2/3p4/1p1Pp2p/pP2Pp1P/P4P1K/8/8 b - - 99 50');
-//  SCL_boardFromFEN(*b,'r4r1k/ppp1qpb1/7p/4pRp1/1PB1P3/1QPR3P/P4P2/6K1 w - - 4 26');
-  return b;
-
-}
-/*****************************************************************************/
-
-static void
-p_whitespace(char **str)
-{
-   while (**str == ' ' || **str == '\n' || **str == '\r' || **str == '\t')
-      *str += 1;
-}
-
-static void
-ensure_end_input(char **str, bool end)
-{
-  *str += 1;
-  if (end)
-  {
-    p_whitespace(str);
-    if (**str != 0)
-      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-        errmsg("Could not parse temporal value %c",**str)));
-
-  }
-}
-
-static int
-p_turnNumber(char **str,int numberOfTurns)
-{
-  p_whitespace(str);
-  /*int result = **str - '0';
-  *str += 1;
-  return result == numberOfTurns;*/
-  if( (**str - '0' )==  numberOfTurns )  {
-    *str += 1;
-    return true;
-  }
-  else
-    return false;
-}
-
-static bool
-p_dot(char **str)
-{
-p_whitespace(str);
-  if (**str == '.')
-  {
-    *str += 1;
-    p_whitespace(str);
-   return true;
-  }
-  return false;
-}
-
-
-static bool
-is_uppercase_letter(char **str)
-{
-  if  (**str == 'Q' || **str == 'K' || **str == 'R' || **str == 'B' ||
-		  **str == 'N' )
-      return true;
-  return false;
-}
-static bool
-is_lowercase_letter(char **str)  {
-  if (**str == 'a' || **str == 'b' || **str == 'c' || **str == 'd' ||
-     **str == 'e' || **str == 'f' || **str == 'g' || **str == 'h' )
-      return true;
-  return false;
-}
-
-static bool
-is_number(char **str)  {
-  if (**str == '1' || **str == '2' || **str == '3' || **str == '4' ||
-     **str == '5' || **str == '6' || **str == '7' || **str == '8' )
-      return true;
-  return false;
-}
-
-static bool
-is_move(char **str)
-{
-  if (is_lowercase_letter(str))  {
-    *str+= 1;
-    if (is_number(str))  {
-        *str -= 1;
-        return true;
-    }
-    *str -= 1;
-  }
-  return false;
-}
-
-static bool
-is_firstChar(char **str)
-{
-  bool bool1;
-  *str -= 1;
-  bool1 = **str == ' ';
-  *str +=1;
-  return bool1;
-
-}
-
-static bool
-p_uppercase_letter(char **str)
-{
-  /*bool bool1, bool2;
-  bool1 = is_firstChar(str);
-  *str -= 2;
-  bool2 = is_move(str);
-  *str += 3;
-  return bool1 || bool2;*/
-
-  if (is_firstChar(str))  {
-    *str += 1;
-    return true;
-  }
-
-  else {
-    *str -= 2;
-    if (is_move(str))  {
-      *str += 2;
-       return true;
-    }
-  }
-  return false;
-}
-
-static bool
-p_lowercase_letter(char **str)
-{
-  if (is_move(str))  {
-    *str += 2;
-     //if (**str == '#')  {
-     // ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-      // errmsg("Invvalid input syntax at the line 200 with at the char %c",**str)));
-     // }
-    return true;
-  }
-  else  {
-//     if (**str == 'f')  {
-  //    ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-   //    errmsg("Invvalid input syntax at the line 200 with at the char %c",**str)));
-    //  }
-    bool bool1, bool2, bool3;
-    **str -= 1;
-    bool1 = is_uppercase_letter(str);
-    *str += 2;
-    bool2 = is_lowercase_letter(str) ;
-    bool3 = **str == 'x';
-    //*str += 1;
-    return bool2 || bool3;
-   // return bool1 && (bool2 || bool3);
-  }
-}
-
-static bool
-p_number(char **str)
-{
-  bool bool1,bool2;
-  *str -= 1;
-  bool1 = is_lowercase_letter(str);
-  bool2 = is_uppercase_letter(str);
-  *str += 2;
-  return bool1 || bool2;
-
-}
-
-static bool
-p_x(char **str)
-{
-  *str += 1;
-  ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-  errmsg("Invvalid input syntax for type Chessgame with the character %c, at the line 237",**str)));
-  if (is_move(str))  {
-    *str += 2;
-    return true;
-  }
-  else
-    return false;
-}
-
-static bool
-p_check(char **str,char *firstChar)
-{
-  bool result;
-  *str += 1;
-  result = **str == ' ' && *firstChar == 'K';
-  return result;
-}
-
-static bool
-is_castling(char** str)
-{
-  bool bool1,bool2;
-  *str += 1;
-  bool1 = **str == '-';
-  *str += 1;
-  bool2 = **str == 'O';
-  return bool1 && bool2;
-}
-
-static bool
-p_castling(char **str)
-{
-  if (is_castling(str))  {  //kingside
-    *str += 1;
-    return true;
-  }
-  else {
-    bool bool1 = is_castling(str);  //queesnide
-    *str += 1;
-    return bool1;
-
-  }
-  //return kingside(str)  || queenside(str);
-}
-static bool
-p_move(char **str,bool whitePlay,char *firstChar,int numberOfTurns)
-{
-   p_whitespace(str);
-   char *move = palloc(sizeof(char)*4);
-   while (**str != ' ' )  {
-     bool test;
-     //if (**str == 'c')  {
-     // ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-     //  errmsg("Invvalid input syntax at the line 294 with at the char %c",**str)));
-     // }
-     if (is_uppercase_letter(str))  {
-       if (is_firstChar(str)  && **str == 'K')
-         *firstChar = 'K';
-       test = p_uppercase_letter(str);
-     }
-     else if  (is_lowercase_letter(str))  {
-      // if (**str == 'c')  {
-      //   ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-        // errmsg("Invvalid input syntax at the line 200 with at the char %c",**str)));
-      // }
-       test = p_lowercase_letter(str);
-     }
-     else if (is_number(str))
-       test = p_number(str);
-     else if (**str == 'x')
-       test = p_x(str);
-     else if (**str == '+')
-       test = p_check(str,firstChar);
-     else if (**str == 'O')
-       test = p_castling(str);
-     else
-       test = false;
-     if (!test)
-       return false;
-     if (**str == '#')
-       break;
-    }
-      //ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-       // errmsg("Invvalid input syntax at the line 294 with at the string %s",move)));
-    return true;
-
-}
-
-static SCL_Record *
-Chessgame_parse(char **str)
-{
-  return Chessgame_make(*str);
-  int numberOfTurns = 0;
-  while (**str != '#')  {
-    numberOfTurns += 1;
-    if ( !p_turnNumber(str,numberOfTurns))
-      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-        errmsg("Invalid input syntax for type Chessgame at the turn identifier number %d %c",numberOfTurns,**str)));
-    if ( !p_dot(str))
-      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-        errmsg("Invalid input syntax for type Chessgame with the dot at turn number %d",numberOfTurns)));
-    char *firstChar = palloc(sizeof(char));
-    if ( !p_move(str,true,firstChar,numberOfTurns))
-      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-        errmsg("Invvalid input syntax for type Chessgame with the white play at turn number %d",numberOfTurns)));
-    if (**str == '#')
-      break;
-    if ( !p_move(str,false,firstChar,numberOfTurns))
-      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-        errmsg("Inval@id input syntax for type Chessgame with the black play at turn number %d",numberOfTurns)));
-    if (**str == '#')
-      break;
-  }
-  ensure_end_input(str,true);
-  
-  return Chessgame_make(*str);
-
-}
-
-char* getNextMoveValue(char *c){
-  char col = c[0];
-  char line = c[1];
-  char colName[] = "abcdefgh";
-  char lineName[] = "12345678";
-  int indexCol = strchr(colName,col)-colName;
-  int indexLine = strchr(lineName,line)-lineName;
-  int newLineIndex = indexLine+1;
-  int newColIndex = indexCol;
-  if(newLineIndex >= 8){
-    newLineIndex = 0;
-    newColIndex++;
-    if(newColIndex >= 8){
-      newColIndex = 7;
-      newLineIndex = 7;
-    }
-  }
-  char *newMove= palloc0(sizeof(char)*3);
-  newMove[0] = colName[newColIndex];
-  newMove[1] = lineName[newLineIndex];
-  newMove[2] = '\0'; 
-  return newMove; 
-} 
-
-static char* ChessgameToStr(SCL_Record  *c){
-  char *move = palloc0(sizeof(char)*3000);
-  int numberOfTurns = 1;
-  char test[300];
-  uint8_t source, destination;//, s2, s3
-  for( int i=0; i< SCL_recordLength(*c);i++){
-    if (i%2 == 0)  {
-      char *turn = psprintf("%d. ",numberOfTurns);
-      strcat(move,turn);
-      numberOfTurns ++;
-    }
-    uint8_t source, destination;//, s2, s3
-    char promotion;// p2
-    SCL_recordGetMove(*c,i,&source,&destination,&promotion);
-    SCL_Board *boardFromRecord = palloc0(SCL_BOARD_STATE_SIZE);
-    SCL_recordApply(*c,boardFromRecord,i);
-    char sourceString[10] = "";
-    char destinationString[10] = "";
-    //SCL_squareToString(source,sourceString);
-    //strcat(move,sourceString);
-    //SCL_squareToString(destination,destinationString);
-    char monString[300] = "";
-    SCL_moveToString(boardFromRecord,source,destination,promotion,destinationString); 
-    //processPiece("a1");
-     /*if(i == 3){
-      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-      errmsg("%c %s",boardFromRecord[0][processPiece("a4a1")],boardFromRecord[0])));
-    }*/
-    strcat(move,destinationString);
-
-    /*if (strcmp(sourceString,destinationString) == 0) {
-      strcat(move,destinationString);
-    }
-    else   {
-       strcat(move,sourceString);
-       strcat(move,destinationString);
-    }*/
-    if (promotion != 'q')
-      strncat(move,promotion,1);
-    if (i+1 < SCL_recordLength(*c))
-      strcat(move," ");
-    else
-      strcat(move,"#");
-  }
- /* ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-  errmsg("%c %c %c %c %c",test[0],test[1],test[2],test[3],test[4])));*/
-  return move;
-}
-
-int processPiece(char *c){
-  char col = c[2];
-  char line = c[3];
-  char colName[] = "abcdefgh";
-  char lineName[] = "12345678";
-  /*ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-  errmsg("%c %c",col,line)));*/
-  int indexCol = strchr(colName,col)-colName;
-  int indexLine = strchr(lineName,line)-lineName;
-  return indexCol + 8*indexLine; 
-} 
-
-/**  ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-  errmsg("%s %s",temp1,temp2))); */
-  /*
-static bool compareOpening(SCL_Record *c,SCL_Record *d){
-  /*
-  for( int i=0; i< SCL_recordLength(*d);i++){
-    uint8_t s0, s1,s2,s3;
-    char p1,p2;
-    SCL_recordGetMove(*c,i,&s0,&s1,&p1);
-    SCL_recordGetMove(*d,i,&s2,&s3,&p2);
-    if( s0 != s2 || s1 != s3 || p1 != p2){
-      return 0;
-    }
-  }
-  return 1;
-  
-  int firstCompare = chessgame_abs_cmp_internal(c,d);
-  if(firstCompare < 0){
-    return 0;
-  }
-/*
-  uint8_t source,destination;
-  char promotion;
-  int i = SCL_recordLength(d);
-  uint8_t endState = SCL_recordGetMove(*d,i-1,&source,&destination,&promotion);
-  char tempmove2[10] = "";
-  SCL_squareToString(destination,tempmove2);
-  bool forceCondition = 0;
-  if(strcmp(tempmove2,"h8") == 0){
-    forceCondition = 1;
-  }
-  char *supBorn2 = getNextMoveValue(tempmove2);
-  char dummy2[10] = "e2";
-  strcat(dummy2,supBorn2);
-  SCL_recordRemoveLast(d); 
-  SCL_recordAdd(d,source,processPiece(dummy2),promotion,endState);
-
-  bool forceCondition = 0;
-  if(chessgame_abs_cmp_internal(c,d) >= 0 && !forceCondition){
-    return 0;
-  }
-  return 1;
-}*/
-
-static SCL_Record *getBoundGame(SCL_Record *d){
-  uint8_t source,destination;
-  char promotion;
-  int i = SCL_recordLength(d);
-  uint8_t endState = SCL_recordGetMove(*d,i-1,&source,&destination,&promotion);
-  char tempmove2[10] = "";
-  SCL_squareToString(destination,tempmove2);
-  /*bool forceCondition = 0;
-  if(strcmp(tempmove2,"h8") == 0){
-    forceCondition = 1;
-  }*/
-  char *supBorn2 = getNextMoveValue(tempmove2);
-  char dummy2[10] = "e2";
-  strcat(dummy2,supBorn2);
-  SCL_recordRemoveLast(d); 
-  SCL_recordAdd(d,source,processPiece(dummy2),promotion,endState);
-  return d;
-}  
-//Ss
-/**    ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-  errmsg("%s %d %s",ChessgameToStr(d), chessgame_abs_cmp_internal(c,d),ChessgameToStr(c))));*/
-static SCL_Record *getFirstMovesProcess(SCL_Record *chessgame, int halfmoves){
- /* 
-  SCL_Record *newRecord = palloc0(SCL_RECORD_MAX_LENGTH);
-  char test[300];
-  SCL_recordInit(newRecord);
-  uint16_t recordLength =  SCL_recordLength(chessgame);
-  uint8_t squareFrom;
-  uint8_t squareTo;
-  uint8_t move;
-  for(int i = 0 ; i < halfmoves ; i++){
-    char promotedPiece;
-    move = SCL_recordGetMove(*chessgame,i,&squareFrom,&squareTo,&promotedPiece);
-    test[i] = promotedPiece;
-    SCL_recordAdd(*newRecord,squareFrom,squareTo,promotedPiece,move);
-    
-  }
-
-//  ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-//  errmsg("squareForm squareTo: %d %d",squareFrom,squareTo)));
-  return newRecord;
-  */
-  int size = SCL_recordLength(*chessgame);
-  int number = size - halfmoves;
-  for(int i = 0; i < number; i++){
-    SCL_recordRemoveLast(*chessgame);
-  }
-  return *chessgame;
-}
-
-static SCL_Board *
-Chessboard_parse(char **str)
-{
-  return Chessboard_make(*str);
-  /*
-  Parsing
-  int numberOfTurns = 0;
-  while (**str != '#')  {
-    numberOfTurns += 1;
-    if ( !p_turnNumber(str,numberOfTurns))
-      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-        errmsg("Invalid input syntax for type Chessgame at the turn identifier number %d %c",numberOfTurns,**str)));
-    if ( !p_dot(str))
-      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-        errmsg("Invalid input syntax for type Chessgame with the dot at turn number %d",numberOfTurns)));
-    char *firstChar = palloc(sizeof(char));
-    if ( !p_move(str,true,firstChar,numberOfTurns))
-      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-        errmsg("Invvalid input syntax for type Chessgame with the white play at turn number %d",numberOfTurns)));
-    if (**str == '#')
-      break;
-    if ( !p_move(str,false,firstChar,numberOfTurns))
-      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-        errmsg("Inval@id input syntax for type Chessgame with the black play at turn number %d",numberOfTurns)));
-    if (**str == '#')
-      break;
-  }
-  ensure_end_input(str,true);
-  return Chessgame_make(*str);
- */
-}
-
-static char* ChessboardToStr(SCL_Board  *b){
-  char *output = palloc0(SCL_FEN_MAX_LENGTH);
-  uint8_t result = SCL_boardToFEN(b,output);
-  if (result != 0)
-    return output;
-  else  {
-    ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-    errmsg("Error could not charge the board %s",output)));
-  }
-}
-
-static bool compareBoard(SCL_Board *boardFromRecord, SCL_Board *boardToCompare){
-  return !SCL_boardsDiffer(*boardFromRecord,*boardToCompare);
-}
-
-
-
-/*****************************************************************************/
-
-PG_FUNCTION_INFO_V1(chessgame_in);
-Datum
-chessgame_in(PG_FUNCTION_ARGS)
-{
-  char *str = PG_GETARG_CSTRING(0);
-  //SCL_Record c;
-  //SCL_recordInit(c);
-  //SCL_recordFromPGN(c,str);
-  //PG_RETURN_ChessGame_P(Chessgame_make(c));
-
-  //PG_RETURN_ChessGame_P(Chessgame_make(str));
-  PG_RETURN_ChessGame_P(Chessgame_parse(&str));
-}
-
-PG_FUNCTION_INFO_V1(chessgame_out);
-Datum
-chessgame_out(PG_FUNCTION_ARGS)
-{
-  SCL_Record *c = PG_GETARG_ChessGame_P(0);
-  char* result = ChessgameToStr(c);
-  PG_FREE_IF_COPY(c, 0);
-  PG_RETURN_CSTRING(result);
-}
-
-PG_FUNCTION_INFO_V1(complex_recv);
-Datum
-complex_recv(PG_FUNCTION_ARGS)
-{
-  StringInfo  buf = (StringInfo) PG_GETARG_POINTER(0);
-  Complex *c = (Complex *) palloc(sizeof(Complex));
-  c->a = pq_getmsgfloat8(buf);
-  c->b = pq_getmsgfloat8(buf);
-  PG_RETURN_ChessGame_P(c);
-}
-
-/* OLD WAY TO HASOPENING 
-PG_FUNCTION_INFO_V1(hasOpening);
-Datum
-hasOpening(PG_FUNCTION_ARGS)
-{
-	SCL_Record *c = PG_GETARG_ChessGame_P(0);
-	SCL_Record *d = PG_GETARG_ChessGame_P(1);
-  PG_RETURN_BOOL(compareOpening(c,d));
-}
-*/
-
-PG_FUNCTION_INFO_V1(getFirstMoves);
-Datum
-getFirstMoves(PG_FUNCTION_ARGS)
-{
-
-  SCL_Record *chessGameRecord = PG_GETARG_ChessGame_P(0);
-  int halfmoves = PG_GETARG_INT32(1);
-  SCL_Record *c = getFirstMovesProcess(chessGameRecord,halfmoves);
-  PG_RETURN_ChessGame_P(c);
-}
-
-PG_FUNCTION_INFO_V1(hasBoard);
-Datum
-hasBoard(PG_FUNCTION_ARGS)
-{
-  SCL_Record *chessGameRecord = PG_GETARG_ChessGame_P(0);
-  SCL_Board *boardToCompare = PG_GETARG_ChessBoard_P(1);
-  int halfmoves = PG_GETARG_INT32(2);
-  SCL_Board *boardFromRecord = palloc0(SCL_BOARD_STATE_SIZE);
-  int i = 1;
-  bool result;
-  for (i = 1; i <= halfmoves;i++)  {
-    SCL_boardInit(*boardFromRecord);
-    SCL_recordApply(chessGameRecord,boardFromRecord,i);
-    result = compareBoard(boardFromRecord,boardToCompare);  
-    if (result)  {
-      break;
-    }
-  }
-  PG_RETURN_BOOL(result);
-}
-
-PG_FUNCTION_INFO_V1(chessboard_in);
-Datum
-chessboard_in(PG_FUNCTION_ARGS)
-{
-  char *str = PG_GETARG_CSTRING(0);
-  PG_RETURN_ChessBoard_P(Chessboard_parse(&str));
-
-/*  SCL_Board b;
-  SCL_boardInit(b);
-  SCL_boardFromFEN(b,str);
-  char *output = palloc0(SCL_FEN_MAX_LENGTH);
-  SCL_boardToFEN(b,output);
-
-  //ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-  //errmsg("output: %s",output)));
-  */
- 
-}
-
-PG_FUNCTION_INFO_V1(chessboard_out);
-Datum
-chessboard_out(PG_FUNCTION_ARGS)
-{
-  SCL_Board *b = (SCL_Board*)PG_GETARG_ChessBoard_P(0);
-  SCL_boardEstimatePhase(b);
-  char* result = ChessboardToStr(b);
-
-
- /* char *output = palloc0(SCL_FEN_MAX_LENGTH);
-  SCL_boardToFEN(b,output);
-  ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-  errmsg("b output: %s",output))); */
-/* if (result == NULL) {
-    ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-                    errmsg("ChessboardToStr returned NULL")));
-} else {
-    printf("Result: %s\n", result); // Vérification préalable
-    ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-                    errmsg("b output: %s", result)));
-}*/
-
-  PG_FREE_IF_COPY(b, 0);
-  PG_RETURN_CSTRING(result);
-}
-
-PG_FUNCTION_INFO_V1(getBoard);
-Datum
-getBoard(PG_FUNCTION_ARGS)
-{
-  SCL_Record *chessGameRecord = PG_GETARG_ChessGame_P(0);
-  int halfmoves = PG_GETARG_INT32(1);
-  SCL_Board *boardFromRecord = palloc0(SCL_BOARD_STATE_SIZE);
-  SCL_boardInit(*boardFromRecord);
-  SCL_recordApply(chessGameRecord,boardFromRecord,halfmoves);
-  /*ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-                    errmsg("b output:: ")));*/
-  PG_RETURN_ChessBoard_P(boardFromRecord);
-}
-
-PG_FUNCTION_INFO_V1(getBoundedGame);
-Datum
-getBoundedGame(PG_FUNCTION_ARGS)
-{
-  SCL_Record *chessGameRecord = PG_GETARG_ChessGame_P(0);
-  /*ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-                    errmsg("b output:: ")));*/
-  PG_RETURN_ChessBoard_P(getBoundGame(chessGameRecord));
-}
-
-/*---------------------------------*/
-
-chessgame_abs_cmp_internal(SCL_Record *a, SCL_Record *b)
-{
-  int r1 = SCL_recordLength(*a);
-  int r2 = SCL_recordLength(*b);
-  int n; 
-   
-  if(r1 > r2){
-    n = r2;
-  }else{
-    n = r1;
-  }
-    uint8_t squareFrom1;
-    uint8_t squareTo1;
-    uint8_t squareFrom2;
-    uint8_t squareTo2;
-    for (int i = 0; i < n; i++)  {
-      char promotedPiece1;
-      char promotedPiece2;
-      uint8_t move1 = SCL_recordGetMove(*a,i,&squareFrom1,&squareTo1,&promotedPiece1);
-      uint8_t move2 = SCL_recordGetMove(*b,i,&squareFrom2,&squareTo2,&promotedPiece2);
-    
-    char str1[10] = "";
-    char str2[10] = "";
-    SCL_squareToString(squareFrom1,str1);
-    SCL_squareToString(squareFrom2,str2);
-    if (strcmp(str1,str2) < 0 )
-      return -1;
-        
-    if (strcmp(str1,str2) > 0 )
-        return 1;
-    char str3[10] = "";
-    char str4[10] = "";
-    SCL_squareToString(squareTo1,str3);
-    SCL_squareToString(squareTo2,str4);
-    
-    if (strcmp(str3,str4) < 0 )
-        return -1;
-    if (strcmp(str3,str4) > 0)
-        return 1;
-    }
-    if(r1 > r2)return 1;
-    if(r1 < r2) return -1;
-    return 0;
-}
-
-/**
- * 
- * 
- * char str1[10] = "";
-    char str2[10] = "";
-    SCL_squareToString(squareFrom1,str1);
-    SCL_squareToString(squareFrom2,str2);
- */
-PG_FUNCTION_INFO_V1(chessgame_abs_eq);
-Datum
-chessgame_abs_eq(PG_FUNCTION_ARGS)
-{
-  SCL_Record *c = PG_GETARG_ChessGame_P(0);
-  SCL_Record *d = PG_GETARG_ChessGame_P(1);
-  bool result = chessgame_abs_cmp_internal(c, d) == 0;
-  PG_FREE_IF_COPY(c, 0);
-  PG_FREE_IF_COPY(d, 1);
-  PG_RETURN_BOOL(result);
-}
-
-PG_FUNCTION_INFO_V1(chessgame_abs_ne);
-Datum
-chessgame_abs_ne(PG_FUNCTION_ARGS)
-{
-  SCL_Record *c = PG_GETARG_ChessGame_P(0);
-  SCL_Record *d = PG_GETARG_ChessGame_P(1);
-  bool result = chessgame_abs_cmp_internal(c, d) != 0;
-  PG_FREE_IF_COPY(c, 0);
-  PG_FREE_IF_COPY(d, 1);
-  PG_RETURN_BOOL(result);
-}
-
-PG_FUNCTION_INFO_V1(chessgame_abs_lt);
-Datum
-chessgame_abs_lt(PG_FUNCTION_ARGS)
-{
-  SCL_Record *c = PG_GETARG_ChessGame_P(0);
-  SCL_Record *d = PG_GETARG_ChessGame_P(1);
-  bool result = chessgame_abs_cmp_internal(c, d) < 0;
-  PG_FREE_IF_COPY(c, 0);
-  PG_FREE_IF_COPY(d, 1);
-  PG_RETURN_BOOL(result);
-}
-
-PG_FUNCTION_INFO_V1(chessgame_abs_le);
-Datum
-chessgame_abs_le(PG_FUNCTION_ARGS)
-{
-  SCL_Record *c = PG_GETARG_ChessGame_P(0);
-  SCL_Record *d = PG_GETARG_ChessGame_P(1);
-  bool result = chessgame_abs_cmp_internal(c, d) <= 0;
-  PG_FREE_IF_COPY(c, 0);
-  PG_FREE_IF_COPY(d, 1);
-  PG_RETURN_BOOL(result);
-}
-
-PG_FUNCTION_INFO_V1(chessgame_abs_gt);
-Datum
-chessgame_abs_gt(PG_FUNCTION_ARGS)
-{
-  SCL_Record *c = PG_GETARG_ChessGame_P(0);
-  SCL_Record *d = PG_GETARG_ChessGame_P(1);
-  bool result = chessgame_abs_cmp_internal(c, d) > 0;
-  PG_FREE_IF_COPY(c, 0);
-  PG_FREE_IF_COPY(d, 1);
-  PG_RETURN_BOOL(result);
-}
-
-PG_FUNCTION_INFO_V1(chessgame_abs_ge);
-Datum
-chessgame_abs_ge(PG_FUNCTION_ARGS)
-{
-  SCL_Record *c = PG_GETARG_ChessGame_P(0);
-  SCL_Record *d = PG_GETARG_ChessGame_P(1);
-  bool result = chessgame_abs_cmp_internal(c, d) >= 0;
-  PG_FREE_IF_COPY(c, 0);
-  PG_FREE_IF_COPY(d, 1);
-  PG_RETURN_BOOL(result);
-}
-
-PG_FUNCTION_INFO_V1(chessgame_abs_cmp);
-Datum
-chessgame_abs_cmp(PG_FUNCTION_ARGS)
-{
-  SCL_Record *c = PG_GETARG_ChessGame_P(0);
-  SCL_Record *d = PG_GETARG_ChessGame_P(1);
-  int result = chessgame_abs_cmp_internal(c, d);
-  PG_FREE_IF_COPY(c, 0);
-  PG_FREE_IF_COPY(d, 1);
-  PG_RETURN_INT32(result);
-}
-
-
-
-
+/*
+ * chessgame.C
+ *
+ * PostgreSQL Complex Number Type:
+ *
+ * complex '(a,b)'
+ *
+ * Author: Maxime Schoemans <maxime.schoemans@ulb.be>
+ */
+
+#include <smallchesslib.h>
+#include <stdio.h>
+#include <postgres.h>
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "access/brin_internal.h"
+#include "access/brin_tuple.h"
+#include "access/genam.h"
+#include "access/gin.h"
+#include "access/gist.h"
+#include "access/htup_details.h"
+#include "access/nbtree.h"
+#include "access/relscan.h"
+#include "access/reloptions.h"
+#include "access/skey.h"
+#include "access/spgist.h"
+#include "access/stratnum.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "access/xact.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_statistic.h"
+#include "catalog/pg_type.h"
+#include "commands/extension.h"
+#include "commands/trigger.h"
+#include "commands/vacuum.h"
+#include "common/hashfn.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/supportnodes.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
+#include "portability/instr_time.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/bufmgr.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/expandeddatum.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/selfuncs.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/typcache.h"
+#include "libpq/pqformat.h"
+
+PG_MODULE_MAGIC;
+
+void _PG_init(void);
+
+static void chess_stats_init_local(void);
+
+static void chessgame_shmem_request(void);
+static void chessgame_shmem_startup(void);
+static Size chess_explorer_size(void);
+static void chess_explorer_shmem_init(void);
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+#define EPSILON         1.0E-06
+
+#define FPzero(A)       (fabs(A) <= EPSILON)
+#define FPeq(A,B)       (fabs((A) - (B)) <= EPSILON)
+#define FPne(A,B)       (fabs((A) - (B)) > EPSILON)
+#define FPlt(A,B)       ((B) - (A) > EPSILON)
+#define FPle(A,B)       ((A) - (B) <= EPSILON)
+#define FPgt(A,B)       ((A) - (B) > EPSILON)
+#define FPge(A,B)       ((B) - (A) <= EPSILON)
+
+/*****************************************************************************/
+
+/*
+ * On-disk representation of a chessgame: only the SCL_Record items used by
+ * the game (2 bytes per ply, including the terminating item) instead of the
+ * full SCL_RECORD_MAX_SIZE record. When prefix is not 0 the items only hold
+ * the moves following the opening stored under that id in the
+ * chessgame_prefix dictionary.
+ */
+typedef struct
+{
+  int32     vl_len_;    /* varlena header (do not touch directly!) */
+  uint16    prefix;     /* chessgame_prefix id, 0 if stored verbatim */
+  uint8     items[FLEXIBLE_ARRAY_MEMBER];
+} ChessGame;
+
+#define CHESSGAME_HDRSZ   offsetof(ChessGame, items)
+
+/* Longest opening (in plies) the prefix dictionary can hold */
+#define CHESSGAME_PREFIX_MAX_PLIES 32
+
+/* fmgr macros ChessGame type */
+
+#define DatumGetChessBoardP(X) ((SCL_Board *) DatumGetPointer(X))
+#define ChessBoardPGetDatum(X) PointerGetDatum(X)
+#define PG_GETARG_ChessGame_P(n) chessgame_expand(fcinfo, PG_GETARG_DATUM(n))
+#define PG_GETARG_ChessBoard_P(n) DatumGetChessBoardP(PG_GETARG_DATUM(n))
+#define PG_RETURN_ChessGame_P(x) return chessgame_flatten(fcinfo, x)
+#define PG_RETURN_ChessBoard_P(x) return ChessBoardPGetDatum(x)
+
+/*****************************************************************************/
+
+/* GUC: store new games as dictionary prefix id + remaining moves */
+static bool prefixCompression = false;
+
+/* GUC: minimum similarity for the pawnstructure % operator */
+static double pawnSimilarityThreshold = 0.6;
+
+/* GUC: size of the search transposition table, in kB */
+static int searchTTSize = 8192;
+
+/* GUC: size of the transposition table shared by all backends, in kB */
+static int sharedTTSize = 0;
+
+/* GUCs: collect chessgame_stats counters and function timings */
+static bool trackStats = true;
+static bool trackTiming = false;
+
+/* GUC: text format produced by chessgame_out */
+typedef enum
+{
+  CHESSGAME_FORMAT_PGN,
+  CHESSGAME_FORMAT_UCI
+} ChessgameFormat;
+
+static const struct config_enum_entry outputFormatOptions[] = {
+  {"pgn", CHESSGAME_FORMAT_PGN, false},
+  {"uci", CHESSGAME_FORMAT_UCI, false},
+  {NULL, 0, false}
+};
+
+static int outputFormat = CHESSGAME_FORMAT_PGN;
+
+/* GUCs of the background analysis workers */
+static int analysisWorkers = 0;
+static char *analysisDatabase = NULL;
+static int analysisBatchSize = 16;
+static int analysisNaptime = 1000;
+
+/* GUCs of the opening explorer */
+static int explorerSize = 0;
+static char *explorerDatabase = NULL;
+static char *explorerTable = NULL;
+static char *explorerKeyColumn = NULL;
+static char *explorerGameColumn = NULL;
+static char *explorerResultColumn = NULL;
+static int explorerDepth = 30;
+static int explorerNaptime = 10000;
+
+/*
+ * Backend-local copy of the chessgame_prefix dictionary. Entries are looked
+ * up by their moves when compressing and by id when expanding. Dictionary
+ * rows are append-only, so a stale cache can only miss new ids, in which
+ * case it is simply reloaded.
+ */
+typedef struct
+{
+  uint16    plies;
+  uint8     items[CHESSGAME_PREFIX_MAX_PLIES * 2];
+} ChessPrefixKey;
+
+typedef struct
+{
+  ChessPrefixKey key;   /* hash key, must be first */
+  uint16    id;
+} ChessPrefixEntry;
+
+static MemoryContext prefixCacheContext = NULL;
+static HTAB *prefixByMoves = NULL;
+static ChessPrefixKey **prefixById = NULL;
+static int  prefixMaxId = 0;
+static bool prefixPlies[CHESSGAME_PREFIX_MAX_PLIES + 1];
+static bool prefixCacheValid = false;
+static Oid  prefixRelid = InvalidOid;
+static Oid  chessgameNamespace = InvalidOid;
+
+/*
+ * Replay memo: the boards of the last game replayed by this backend, shared
+ * by every chess function called on it. Expressions such as
+ * getBoard(g, 10), getBoard(g, 20) and hasBoard(g, b, 80) on the same row
+ * thus replay the game once. The game is identified by its stored bytes,
+ * and boards are only computed up to the highest ply asked for so far.
+ */
+#define CHESS_REPLAY_MAX_RAW (VARHDRSZ + 8 + SCL_RECORD_MAX_SIZE)
+
+typedef struct
+{
+  bool        valid;
+  Size        rawlen;
+  char        raw[CHESS_REPLAY_MAX_RAW];
+  SCL_Record  record;
+  int         length;     /* plies in record */
+  int         computed;   /* boards[0 .. computed] are filled in */
+  SCL_Board   boards[SCL_RECORD_MAX_LENGTH + 1];
+} ChessReplayMemo;
+
+static ChessReplayMemo replayMemo;
+
+static void
+chessgame_prefix_invalidate(Datum arg, Oid relid)
+{
+  if (relid == InvalidOid || relid == prefixRelid)
+  {
+    prefixCacheValid = false;
+    replayMemo.valid = false;
+    if (relid == InvalidOid)
+      chessgameNamespace = InvalidOid;
+  }
+}
+
+void
+_PG_init(void)
+{
+  DefineCustomBoolVariable("chessgame.prefix_compression",
+    "Store new chessgame values as a chessgame_prefix id plus the remaining moves.",
+    NULL,
+    &prefixCompression,
+    false,
+    PGC_USERSET,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomRealVariable("chessgame.pawn_similarity_threshold",
+    "Sets the minimum similarity of pawn structures matched by the % operator.",
+    NULL,
+    &pawnSimilarityThreshold,
+    0.6,
+    0.0,
+    1.0,
+    PGC_USERSET,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomIntVariable("chessgame.tt_size",
+    "Sets the size of the transposition table used by evaluate() and best_move().",
+    NULL,
+    &searchTTSize,
+    8192,
+    64,
+    MAX_KILOBYTES,
+    PGC_USERSET,
+    GUC_UNIT_KB,
+    NULL, NULL, NULL);
+
+  DefineCustomIntVariable("chessgame.analysis_workers",
+    "Number of background workers analysing queued games.",
+    NULL,
+    &analysisWorkers,
+    0,
+    0,
+    MAX_BACKENDS,
+    PGC_POSTMASTER,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomStringVariable("chessgame.analysis_database",
+    "Database the analysis workers connect to.",
+    NULL,
+    &analysisDatabase,
+    "postgres",
+    PGC_POSTMASTER,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomIntVariable("chessgame.analysis_batch_size",
+    "Number of queued games an analysis worker handles per transaction.",
+    NULL,
+    &analysisBatchSize,
+    16,
+    1,
+    10000,
+    PGC_SIGHUP,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomIntVariable("chessgame.analysis_naptime",
+    "Time an analysis worker sleeps when the queue is empty.",
+    NULL,
+    &analysisNaptime,
+    1000,
+    10,
+    INT_MAX,
+    PGC_SIGHUP,
+    GUC_UNIT_MS,
+    NULL, NULL, NULL);
+
+  DefineCustomIntVariable("chessgame.shared_tt_size",
+    "Sets the size of the transposition table shared by all backends.",
+    "Zero gives each search its own table of chessgame.tt_size.",
+    &sharedTTSize,
+    0,
+    0,
+    MAX_KILOBYTES,
+    PGC_POSTMASTER,
+    GUC_UNIT_KB,
+    NULL, NULL, NULL);
+
+  DefineCustomEnumVariable("chessgame.output_format",
+    "Text format of chessgame output.",
+    "pgn gives numbered moves, uci gives bare coordinate moves (e2e4 e7e5). "
+    "Input accepts both.",
+    &outputFormat,
+    CHESSGAME_FORMAT_PGN,
+    outputFormatOptions,
+    PGC_USERSET,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomBoolVariable("chessgame.track_stats",
+    "Collects the counters shown in chessgame_stats.",
+    NULL,
+    &trackStats,
+    true,
+    PGC_SUSET,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomBoolVariable("chessgame.track_timing",
+    "Collects time spent in the functions shown in chessgame_stats.",
+    NULL,
+    &trackTiming,
+    false,
+    PGC_SUSET,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomIntVariable("chessgame.explorer_size",
+    "Sets the shared memory reserved for the opening explorer tree.",
+    "Zero disables the opening explorer and its background worker.",
+    &explorerSize,
+    0,
+    0,
+    MAX_KILOBYTES,
+    PGC_POSTMASTER,
+    GUC_UNIT_KB,
+    NULL, NULL, NULL);
+
+  DefineCustomStringVariable("chessgame.explorer_database",
+    "Database the opening explorer worker connects to.",
+    NULL,
+    &explorerDatabase,
+    "postgres",
+    PGC_POSTMASTER,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomStringVariable("chessgame.explorer_table",
+    "Table of games the opening explorer tree is built from.",
+    NULL,
+    &explorerTable,
+    "",
+    PGC_SIGHUP,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomStringVariable("chessgame.explorer_key_column",
+    "Increasing bigint column of chessgame.explorer_table.",
+    "Rows are added to the tree in key order, rows with a key above the "
+    "highest one seen are picked up on each refresh. Rows committed with "
+    "a lower key than one already read are missed until explorer_rebuild().",
+    &explorerKeyColumn,
+    "id",
+    PGC_SIGHUP,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomStringVariable("chessgame.explorer_game_column",
+    "chessgame column of chessgame.explorer_table.",
+    NULL,
+    &explorerGameColumn,
+    "game",
+    PGC_SIGHUP,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomStringVariable("chessgame.explorer_result_column",
+    "Text column of chessgame.explorer_table holding 1-0, 0-1 or 1/2-1/2.",
+    "Empty counts games without results.",
+    &explorerResultColumn,
+    "",
+    PGC_SIGHUP,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomIntVariable("chessgame.explorer_depth",
+    "Number of plies of each game kept in the opening explorer tree.",
+    "Changing it rebuilds the tree.",
+    &explorerDepth,
+    30,
+    1,
+    SCL_RECORD_MAX_LENGTH,
+    PGC_SIGHUP,
+    0,
+    NULL, NULL, NULL);
+
+  DefineCustomIntVariable("chessgame.explorer_naptime",
+    "Time between refreshes of the opening explorer tree.",
+    NULL,
+    &explorerNaptime,
+    10000,
+    10,
+    INT_MAX,
+    PGC_SIGHUP,
+    GUC_UNIT_MS,
+    NULL, NULL, NULL);
+
+  MarkGUCPrefixReserved("chessgame");
+
+  chess_stats_init_local();
+
+  if (process_shared_preload_libraries_in_progress)
+  {
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = chessgame_shmem_request;
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = chessgame_shmem_startup;
+
+    for (int i = 0; i < analysisWorkers; i++)
+    {
+      BackgroundWorker worker;
+
+      memset(&worker, 0, sizeof(worker));
+      worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+        BGWORKER_BACKEND_DATABASE_CONNECTION;
+      worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+      worker.bgw_restart_time = 10;
+      snprintf(worker.bgw_library_name, BGW_MAXLEN, "chessgame");
+      snprintf(worker.bgw_function_name, BGW_MAXLEN, "chessgame_analysis_main");
+      snprintf(worker.bgw_name, BGW_MAXLEN, "chessgame analysis worker %d", i);
+      snprintf(worker.bgw_type, BGW_MAXLEN, "chessgame analysis worker");
+      worker.bgw_main_arg = Int32GetDatum(i);
+      RegisterBackgroundWorker(&worker);
+    }
+
+    if (explorerSize > 0)
+    {
+      BackgroundWorker worker;
+
+      memset(&worker, 0, sizeof(worker));
+      worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+        BGWORKER_BACKEND_DATABASE_CONNECTION;
+      worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+      worker.bgw_restart_time = 10;
+      snprintf(worker.bgw_library_name, BGW_MAXLEN, "chessgame");
+      snprintf(worker.bgw_function_name, BGW_MAXLEN, "chessgame_explorer_main");
+      snprintf(worker.bgw_name, BGW_MAXLEN, "chessgame explorer worker");
+      snprintf(worker.bgw_type, BGW_MAXLEN, "chessgame explorer worker");
+      RegisterBackgroundWorker(&worker);
+    }
+  }
+
+  CacheRegisterRelcacheCallback(chessgame_prefix_invalidate, (Datum) 0);
+}
+
+/*****************************************************************************/
+/* Statistics */
+
+/*
+ * Counters behind the chessgame_stats view. They live in shared memory when
+ * the library is preloaded and are backend-local otherwise. Hot loops add
+ * their totals once per call, never per ply or node, and to plain
+ * backend-local counters: those are added to the atomics every
+ * CHESS_STATS_FLUSH_CALLS calls and at transaction end, so concurrent
+ * backends do not fight over the shared cache lines on every call.
+ */
+#define CHESS_STATS_FLUSH_CALLS 1024
+
+typedef enum
+{
+  CHESS_STAT_PLIES_APPLIED,
+  CHESS_STAT_BOARDS_COMPARED,
+  CHESS_STAT_PARSE_CALLS,
+  CHESS_STAT_PARSE_BYTES,
+  CHESS_STAT_NODES_SEARCHED,
+  CHESS_STAT_TT_HITS,
+  CHESS_STAT_TT_MISSES,
+  CHESS_STAT_NCOUNTERS
+} ChessStatCounter;
+
+static const char *const chessStatCounterNames[CHESS_STAT_NCOUNTERS] = {
+  "plies_applied",
+  "boards_compared",
+  "parse_calls",
+  "parse_bytes",
+  "nodes_searched",
+  "tt_hits",
+  "tt_misses"
+};
+
+typedef enum
+{
+  CHESS_FN_CHESSGAME_IN,
+  CHESS_FN_CHESSGAME_OUT,
+  CHESS_FN_CHESSBOARD_IN,
+  CHESS_FN_HASBOARD,
+  CHESS_FN_GETBOARD,
+  CHESS_FN_HAS_POSITION,
+  CHESS_FN_EVALUATE,
+  CHESS_FN_BEST_MOVE,
+  CHESS_FN_ANALYSE_GAME,
+  CHESS_FN_NFUNCTIONS
+} ChessStatFunction;
+
+static const char *const chessStatFunctionNames[CHESS_FN_NFUNCTIONS] = {
+  "chessgame_in",
+  "chessgame_out",
+  "chessboard_in",
+  "hasBoard",
+  "getBoard",
+  "chessgame_has_position",
+  "evaluate",
+  "best_move",
+  "analyse_game"
+};
+
+typedef struct
+{
+  pg_atomic_uint64 counters[CHESS_STAT_NCOUNTERS];
+  pg_atomic_uint64 calls[CHESS_FN_NFUNCTIONS];
+  pg_atomic_uint64 usecs[CHESS_FN_NFUNCTIONS];
+} ChessStats;
+
+static ChessStats chessLocalStats;
+static ChessStats *chessStats = &chessLocalStats;
+
+/* Counts of this backend not yet added to chessStats */
+static struct
+{
+  uint64    counters[CHESS_STAT_NCOUNTERS];
+  uint64    calls[CHESS_FN_NFUNCTIONS];
+  uint64    usecs[CHESS_FN_NFUNCTIONS];
+  int       ncalls;
+} chessPendingStats;
+
+static void
+chess_stats_flush(void)
+{
+  for (int i = 0; i < CHESS_STAT_NCOUNTERS; i++)
+  {
+    if (chessPendingStats.counters[i] > 0)
+      pg_atomic_fetch_add_u64(&chessStats->counters[i],
+        chessPendingStats.counters[i]);
+  }
+  for (int i = 0; i < CHESS_FN_NFUNCTIONS; i++)
+  {
+    if (chessPendingStats.calls[i] > 0)
+      pg_atomic_fetch_add_u64(&chessStats->calls[i],
+        chessPendingStats.calls[i]);
+    if (chessPendingStats.usecs[i] > 0)
+      pg_atomic_fetch_add_u64(&chessStats->usecs[i],
+        chessPendingStats.usecs[i]);
+  }
+  memset(&chessPendingStats, 0, sizeof(chessPendingStats));
+}
+
+static void
+chess_stats_xact_callback(XactEvent event, void *arg)
+{
+  switch (event)
+  {
+    case XACT_EVENT_COMMIT:
+    case XACT_EVENT_PARALLEL_COMMIT:
+    case XACT_EVENT_ABORT:
+    case XACT_EVENT_PARALLEL_ABORT:
+    case XACT_EVENT_PREPARE:
+      chess_stats_flush();
+      break;
+    default:
+      break;
+  }
+}
+
+static void
+chess_stats_init(ChessStats *stats)
+{
+  for (int i = 0; i < CHESS_STAT_NCOUNTERS; i++)
+    pg_atomic_init_u64(&stats->counters[i], 0);
+  for (int i = 0; i < CHESS_FN_NFUNCTIONS; i++)
+  {
+    pg_atomic_init_u64(&stats->calls[i], 0);
+    pg_atomic_init_u64(&stats->usecs[i], 0);
+  }
+}
+
+static void
+chess_stats_init_local(void)
+{
+  chess_stats_init(&chessLocalStats);
+  RegisterXactCallback(chess_stats_xact_callback, NULL);
+}
+
+static inline void
+chess_stats_count(ChessStatCounter counter, uint64 n)
+{
+  if (trackStats)
+    chessPendingStats.counters[counter] += n;
+}
+
+static inline void
+chess_stats_start(instr_time *start)
+{
+  if (trackStats && trackTiming)
+    INSTR_TIME_SET_CURRENT(*start);
+  else
+    INSTR_TIME_SET_ZERO(*start);
+}
+
+static inline void
+chess_stats_end(ChessStatFunction fn, instr_time *start)
+{
+  if (!trackStats)
+    return;
+  chessPendingStats.calls[fn]++;
+  if (!INSTR_TIME_IS_ZERO(*start))
+  {
+    instr_time end;
+
+    INSTR_TIME_SET_CURRENT(end);
+    INSTR_TIME_SUBTRACT(end, *start);
+    chessPendingStats.usecs[fn] += INSTR_TIME_GET_MICROSEC(end);
+  }
+  if (++chessPendingStats.ncalls >= CHESS_STATS_FLUSH_CALLS)
+    chess_stats_flush();
+}
+
+PG_FUNCTION_INFO_V1(chessgame_stats);
+Datum
+chessgame_stats(PG_FUNCTION_ARGS)
+{
+  ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+  Datum values[3];
+  bool nulls[3] = {false, false, false};
+
+  InitMaterializedSRF(fcinfo, 0);
+  chess_stats_flush();
+
+  nulls[2] = true;
+  for (int i = 0; i < CHESS_STAT_NCOUNTERS; i++)
+  {
+    values[0] = CStringGetTextDatum(chessStatCounterNames[i]);
+    values[1] = Int64GetDatum(
+      (int64) pg_atomic_read_u64(&chessStats->counters[i]));
+    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+  }
+
+  nulls[2] = false;
+  for (int i = 0; i < CHESS_FN_NFUNCTIONS; i++)
+  {
+    values[0] = CStringGetTextDatum(chessStatFunctionNames[i]);
+    values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&chessStats->calls[i]));
+    values[2] = Float8GetDatum(
+      (double) pg_atomic_read_u64(&chessStats->usecs[i]) / 1000.0);
+    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+  }
+  return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(chessgame_stats_reset);
+Datum
+chessgame_stats_reset(PG_FUNCTION_ARGS)
+{
+  memset(&chessPendingStats, 0, sizeof(chessPendingStats));
+  for (int i = 0; i < CHESS_STAT_NCOUNTERS; i++)
+    pg_atomic_write_u64(&chessStats->counters[i], 0);
+  for (int i = 0; i < CHESS_FN_NFUNCTIONS; i++)
+  {
+    pg_atomic_write_u64(&chessStats->calls[i], 0);
+    pg_atomic_write_u64(&chessStats->usecs[i], 0);
+  }
+  PG_RETURN_VOID();
+}
+
+/*
+ * The dictionary table lives in the extension's schema, which is the schema
+ * of whatever chessgame function we are called from. Background workers
+ * have no calling function and look the extension up instead.
+ */
+static Oid
+chessgame_namespace(FunctionCallInfo fcinfo)
+{
+  if (!OidIsValid(chessgameNamespace))
+  {
+    if (fcinfo != NULL)
+      chessgameNamespace = get_func_namespace(fcinfo->flinfo->fn_oid);
+    else
+      chessgameNamespace =
+        get_extension_schema(get_extension_oid("chessgame", false));
+  }
+  return chessgameNamespace;
+}
+
+static void
+chessgame_prefix_load(FunctionCallInfo fcinfo)
+{
+  Relation    rel;
+  SysScanDesc scan;
+  HeapTuple   tup;
+  HASHCTL     ctl;
+  MemoryContext oldcxt;
+
+  if (prefixCacheContext == NULL)
+    prefixCacheContext = AllocSetContextCreate(CacheMemoryContext,
+      "chessgame prefix dictionary", ALLOCSET_DEFAULT_SIZES);
+  else
+    MemoryContextReset(prefixCacheContext);
+
+  prefixByMoves = NULL;
+  prefixById = NULL;
+  prefixMaxId = 0;
+  memset(prefixPlies, 0, sizeof(prefixPlies));
+
+  /* Mark valid first, invalidations arriving while we read win */
+  prefixCacheValid = true;
+
+  prefixRelid = get_relname_relid("chessgame_prefix",
+    chessgame_namespace(fcinfo));
+  if (!OidIsValid(prefixRelid))
+    return;
+
+  oldcxt = MemoryContextSwitchTo(prefixCacheContext);
+
+  memset(&ctl, 0, sizeof(ctl));
+  ctl.keysize = sizeof(ChessPrefixKey);
+  ctl.entrysize = sizeof(ChessPrefixEntry);
+  ctl.hcxt = prefixCacheContext;
+  prefixByMoves = hash_create("chessgame prefix dictionary", 256, &ctl,
+    HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+  rel = table_open(prefixRelid, AccessShareLock);
+  scan = systable_beginscan(rel, InvalidOid, false, NULL, 0, NULL);
+  while (HeapTupleIsValid(tup = systable_getnext(scan)))
+  {
+    ChessPrefixKey key;
+    ChessPrefixEntry *entry;
+    bytea      *moves;
+    bool        isnull;
+    int32       id;
+    int         nbytes;
+
+    id = DatumGetInt32(heap_getattr(tup, 1, RelationGetDescr(rel), &isnull));
+    if (isnull || id < 1 || id > PG_UINT16_MAX)
+      continue;
+    moves = DatumGetByteaPP(heap_getattr(tup, 2, RelationGetDescr(rel),
+      &isnull));
+    if (isnull)
+      continue;
+    nbytes = VARSIZE_ANY_EXHDR(moves);
+    if (nbytes == 0 || nbytes % 2 != 0 ||
+        nbytes > CHESSGAME_PREFIX_MAX_PLIES * 2)
+    {
+      prefixCacheValid = false;
+      ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED),
+        errmsg("invalid chessgame_prefix entry %d", id)));
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.plies = nbytes / 2;
+    memcpy(key.items, VARDATA_ANY(moves), nbytes);
+
+    entry = hash_search(prefixByMoves, &key, HASH_ENTER, NULL);
+    entry->id = id;
+    prefixPlies[key.plies] = true;
+    if (id > prefixMaxId)
+      prefixMaxId = id;
+  }
+  systable_endscan(scan);
+  table_close(rel, AccessShareLock);
+
+  prefixById = palloc0(sizeof(ChessPrefixKey *) * (prefixMaxId + 1));
+  {
+    HASH_SEQ_STATUS status;
+    ChessPrefixEntry *entry;
+
+    hash_seq_init(&status, prefixByMoves);
+    while ((entry = hash_seq_search(&status)) != NULL)
+      prefixById[entry->id] = &entry->key;
+  }
+
+  MemoryContextSwitchTo(oldcxt);
+}
+
+static ChessPrefixKey *
+chessgame_prefix_lookup(FunctionCallInfo fcinfo, uint16 id)
+{
+  if (!prefixCacheValid)
+    chessgame_prefix_load(fcinfo);
+  if (prefixById == NULL || id > prefixMaxId || prefixById[id] == NULL)
+  {
+    /* entry added after we loaded the dictionary? */
+    chessgame_prefix_load(fcinfo);
+    if (prefixById == NULL || id > prefixMaxId || prefixById[id] == NULL)
+      ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED),
+        errmsg("chessgame value references unknown chessgame_prefix entry %d",
+          id)));
+  }
+  return prefixById[id];
+}
+
+/*
+ * Finds the longest dictionary opening that is a strict prefix of the
+ * record. Returns its id (0 if none) and sets *plies to its length.
+ */
+static uint16
+chessgame_prefix_find(FunctionCallInfo fcinfo, const SCL_Record r,
+  int length, int *plies)
+{
+  ChessPrefixKey key;
+  int         l;
+
+  if (!prefixCacheValid)
+    chessgame_prefix_load(fcinfo);
+  if (prefixByMoves == NULL)
+    return 0;
+
+  memset(&key, 0, sizeof(key));
+  l = Min(length - 1, CHESSGAME_PREFIX_MAX_PLIES);
+  memcpy(key.items, r, l * 2);
+  for (; l > 0; l--)
+  {
+    ChessPrefixEntry *entry;
+
+    if (!prefixPlies[l])
+      continue;
+    key.plies = l;
+    memset(key.items + l * 2, 0, sizeof(key.items) - l * 2);
+    entry = hash_search(prefixByMoves, &key, HASH_FIND, NULL);
+    if (entry != NULL)
+    {
+      *plies = l;
+      return entry->id;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Expanded form of a chessgame: the full record together with its length
+ * and the board after its last move, so that games built move by move (e.g.
+ * in PL/pgSQL loops) are extended and read without flattening, detoasting
+ * or replaying them each time.
+ */
+#define EXPANDED_CHESSGAME_MAGIC 0x43475845
+
+typedef struct
+{
+  ExpandedObjectHeader hdr;
+  int         eg_magic;
+  int         length;     /* plies in record */
+  SCL_Record  record;
+  SCL_Board   board;      /* position after the last move */
+  ChessGame  *flat;       /* cached flat form, NULL if not computed */
+} ExpandedChessGame;
+
+static inline ExpandedChessGame *
+chessgame_get_expanded_ro(Datum datum)
+{
+  ExpandedChessGame *eg;
+
+  if (!VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(datum)))
+    return NULL;
+  eg = (ExpandedChessGame *) DatumGetEOHP(datum);
+  Assert(eg->eg_magic == EXPANDED_CHESSGAME_MAGIC);
+  return eg;
+}
+
+/*
+ * Turns a stored chessgame into a full SCL_Record the library can work with.
+ * The result is always a fresh palloc'd copy, callers are free to modify it.
+ */
+static SCL_Record *
+chessgame_expand(FunctionCallInfo fcinfo, Datum datum)
+{
+  ExpandedChessGame *eg = chessgame_get_expanded_ro(datum);
+  ChessGame  *g;
+  SCL_Record *r = palloc0(SCL_RECORD_MAX_SIZE);
+  int         nbytes;
+  int         offset = 0;
+
+  if (eg != NULL)
+  {
+    memcpy(*r, eg->record, SCL_RECORD_MAX_SIZE);
+    return r;
+  }
+
+  g = (ChessGame *) PG_DETOAST_DATUM(datum);
+  nbytes = VARSIZE(g) - CHESSGAME_HDRSZ;
+
+  if (g->prefix != 0)
+  {
+    ChessPrefixKey *p = chessgame_prefix_lookup(fcinfo, g->prefix);
+
+    offset = p->plies * 2;
+    memcpy(*r, p->items, offset);
+  }
+  if (nbytes < 2 || nbytes % 2 != 0 || offset + nbytes > SCL_RECORD_MAX_SIZE)
+    ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED),
+      errmsg("invalid chessgame value")));
+  memcpy(*r + offset, g->items, nbytes);
+
+  if ((Pointer) g != DatumGetPointer(datum))
+    pfree(g);
+  return r;
+}
+
+/* Builds the stored form of a record, compressing it if requested */
+static Datum
+chessgame_flatten(FunctionCallInfo fcinfo, SCL_Record *r)
+{
+  int         length = SCL_recordLength(*r);
+  int         nbytes = Max(length, 1) * 2;
+  int         skip = 0;
+  uint16      prefix = 0;
+  ChessGame  *g;
+
+  if (prefixCompression && length > 1)
+    prefix = chessgame_prefix_find(fcinfo, *r, length, &skip);
+
+  g = palloc(CHESSGAME_HDRSZ + nbytes - skip * 2);
+  SET_VARSIZE(g, CHESSGAME_HDRSZ + nbytes - skip * 2);
+  g->prefix = prefix;
+  memcpy(g->items, *r + skip * 2, nbytes - skip * 2);
+  PG_RETURN_POINTER(g);
+}
+
+static Size chessgame_get_flat_size(ExpandedObjectHeader *eohptr);
+static void chessgame_flatten_into(ExpandedObjectHeader *eohptr,
+  void *result, Size allocated_size);
+
+static const ExpandedObjectMethods ChessGameExpandedMethods = {
+  chessgame_get_flat_size,
+  chessgame_flatten_into
+};
+
+/*
+ * Returns a read-write expanded chessgame for the datum. A read-write
+ * pointer is handed back as is, so callers may modify it in place, anything
+ * else is copied into a new object in the current memory context.
+ */
+static ExpandedChessGame *
+chessgame_get_expanded(FunctionCallInfo fcinfo, Datum datum)
+{
+  ExpandedChessGame *src = chessgame_get_expanded_ro(datum);
+  ExpandedChessGame *eg;
+  MemoryContext objcxt;
+
+  if (src != NULL && VARATT_IS_EXTERNAL_EXPANDED_RW(DatumGetPointer(datum)))
+    return src;
+
+  objcxt = AllocSetContextCreate(CurrentMemoryContext, "expanded chessgame",
+    ALLOCSET_SMALL_SIZES);
+  eg = MemoryContextAllocZero(objcxt, sizeof(ExpandedChessGame));
+  EOH_init_header(&eg->hdr, &ChessGameExpandedMethods, objcxt);
+  eg->eg_magic = EXPANDED_CHESSGAME_MAGIC;
+
+  if (src != NULL)
+  {
+    eg->length = src->length;
+    memcpy(eg->record, src->record, SCL_RECORD_MAX_SIZE);
+    SCL_boardCopy(src->board, eg->board);
+  }
+  else
+  {
+    SCL_Record *r = chessgame_expand(fcinfo, datum);
+
+    memcpy(eg->record, *r, SCL_RECORD_MAX_SIZE);
+    pfree(r);
+    eg->length = SCL_recordLength(eg->record);
+    SCL_boardInit(eg->board);
+    SCL_recordApply(eg->record, eg->board, eg->length);
+  }
+  return eg;
+}
+
+/*
+ * Like SCL_recordAdd, but given the current length so that it does not
+ * have to scan the record for its end.
+ */
+static void
+chess_record_append(SCL_Record r, int length, uint8_t from, uint8_t to,
+  char promotion)
+{
+  uint8_t    *item = r + length * 2;
+  uint8_t     p;
+
+  Assert(length < SCL_RECORD_MAX_LENGTH);
+  switch (promotion)
+  {
+    case 'n': case 'N': p = SCL_RECORD_PROM_N; break;
+    case 'b': case 'B': p = SCL_RECORD_PROM_B; break;
+    case 'r': case 'R': p = SCL_RECORD_PROM_R; break;
+    default:            p = SCL_RECORD_PROM_Q; break;
+  }
+
+  /* only the last item carries the end flag */
+  if (length > 0)
+    item[-2] &= 0x3f;
+  item[0] = from | SCL_RECORD_END;
+  item[1] = to | p;
+}
+
+/* Appends a move to the game and plays it on the board, in O(1) */
+static void
+chessgame_expanded_append(ExpandedChessGame *eg, uint8_t from, uint8_t to,
+  char promotion)
+{
+  chess_record_append(eg->record, eg->length, from, to, promotion);
+  eg->length++;
+
+  SCL_boardMakeMove(eg->board, from, to, promotion);
+
+  if (eg->flat != NULL)
+  {
+    pfree(eg->flat);
+    eg->flat = NULL;
+  }
+}
+
+/* Whether the move takes a pawn to its last rank */
+static bool
+chess_move_is_promotion(SCL_Board board, uint8_t from, uint8_t to)
+{
+  return (board[from] == 'P' && to >= 56) || (board[from] == 'p' && to < 8);
+}
+
+/*
+ * Reads a move for the side to move on the board, either in coordinate
+ * notation (e2e4, e7e8q) or SAN (e4, Nbd7, exd8=Q+, O-O). Only legal moves
+ * are accepted; errors out otherwise.
+ */
+static void
+chess_parse_move(SCL_Board board, const char *move, uint8_t *from,
+  uint8_t *to, char *promotion)
+{
+  int         len = strlen(move);
+  bool        white = SCL_boardWhitesTurn(board);
+  char        piece = 'P';
+  int         files[2] = {-1, -1};
+  int         ranks[2] = {-1, -1};
+  int         nfiles = 0, nranks = 0;
+  int         candidates = 0;
+  bool        promotes = false;
+  const char *c = move;
+
+  *promotion = 'q';
+
+  /* annotations carry no information we need */
+  while (len > 0 && strchr("+#!?", move[len - 1]) != NULL)
+    len--;
+
+  /* coordinate notation */
+  if ((len == 4 || len == 5) &&
+      move[0] >= 'a' && move[0] <= 'h' && move[1] >= '1' && move[1] <= '8' &&
+      move[2] >= 'a' && move[2] <= 'h' && move[3] >= '1' && move[3] <= '8' &&
+      (len == 4 || strchr("qrbnQRBN", move[4]) != NULL))
+  {
+    SCL_stringToMove(move, from, to, promotion);
+    if (!SCL_boardMoveIsLegal(board, *from, *to) ||
+        (len == 5 && !chess_move_is_promotion(board, *from, *to)))
+      ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+        errmsg("illegal move \"%s\"", move)));
+    return;
+  }
+
+  if (len >= 3 && (strncmp(move, "O-O", 3) == 0 ||
+      strncmp(move, "0-0", 3) == 0))
+  {
+    bool long_castle = len >= 5 && (strncmp(move, "O-O-O", 5) == 0 ||
+      strncmp(move, "0-0-0", 5) == 0);
+
+    if (len != (long_castle ? 5 : 3))
+      ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+        errmsg("invalid move \"%s\"", move)));
+    *from = white ? 4 : 60;
+    *to = *from + (long_castle ? -2 : 2);
+    if (!SCL_boardMoveIsLegal(board, *from, *to))
+      ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+        errmsg("illegal move \"%s\"", move)));
+    return;
+  }
+
+  if (len > 0 && strchr("KQRBN", *c) != NULL)
+    piece = *c++;
+  for (; c < move + len; c++)
+  {
+    if (*c >= 'a' && *c <= 'h' && nfiles < 2)
+      files[nfiles++] = *c - 'a';
+    else if (*c >= '1' && *c <= '8' && nranks < 2)
+      ranks[nranks++] = *c - '1';
+    else if (*c == 'x' || *c == '=')
+      continue;
+    else if (piece == 'P' && c == move + len - 1 && strchr("QRBN", *c))
+    {
+      *promotion = pg_tolower((unsigned char) *c);
+      promotes = true;
+    }
+    else
+      break;
+  }
+  if (c != move + len || nfiles == 0 || nranks == 0 ||
+      files[nfiles - 1] < 0 || ranks[nranks - 1] < 0)
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+      errmsg("invalid move \"%s\"", move)));
+
+  /* the last square given is the target, anything before disambiguates */
+  *to = ranks[nranks - 1] * 8 + files[nfiles - 1];
+  if (!white)
+    piece = pg_tolower((unsigned char) piece);
+  for (int sq = 0; sq < SCL_BOARD_SQUARES; sq++)
+  {
+    if (board[sq] != piece ||
+        (nfiles == 2 && sq % 8 != files[0]) ||
+        (nranks == 2 && sq / 8 != ranks[0]) ||
+        !SCL_boardMoveIsLegal(board, sq, *to) ||
+        (promotes && !chess_move_is_promotion(board, sq, *to)))
+      continue;
+    *from = sq;
+    candidates++;
+  }
+  if (candidates == 0)
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+      errmsg("illegal move \"%s\"", move)));
+  if (candidates > 1)
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+      errmsg("ambiguous move \"%s\"", move)));
+}
+
+static void
+chessgame_expanded_append_text(ExpandedChessGame *eg, const char *move)
+{
+  uint8_t from, to;
+  char promotion;
+
+  if (eg->length >= SCL_RECORD_MAX_LENGTH)
+    ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+      errmsg("chessgame cannot have more than %d plies",
+        SCL_RECORD_MAX_LENGTH)));
+  chess_parse_move(eg->board, move, &from, &to, &promotion);
+  chessgame_expanded_append(eg, from, to, promotion);
+}
+
+static Size
+chessgame_get_flat_size(ExpandedObjectHeader *eohptr)
+{
+  ExpandedChessGame *eg = (ExpandedChessGame *) eohptr;
+
+  Assert(eg->eg_magic == EXPANDED_CHESSGAME_MAGIC);
+  if (eg->flat == NULL)
+  {
+    MemoryContext oldcxt = MemoryContextSwitchTo(eg->hdr.eoh_context);
+
+    eg->flat = (ChessGame *) DatumGetPointer(
+      chessgame_flatten(NULL, &eg->record));
+    MemoryContextSwitchTo(oldcxt);
+  }
+  return VARSIZE(eg->flat);
+}
+
+static void
+chessgame_flatten_into(ExpandedObjectHeader *eohptr, void *result,
+  Size allocated_size)
+{
+  ExpandedChessGame *eg = (ExpandedChessGame *) eohptr;
+
+  Assert(eg->flat != NULL && allocated_size == VARSIZE(eg->flat));
+  memcpy(result, eg->flat, allocated_size);
+}
+
+/*
+ * Returns the replay memo loaded with the game, reusing the boards already
+ * computed when it is the game replayed last.
+ */
+static ChessReplayMemo *
+chess_replay_get(FunctionCallInfo fcinfo, Datum datum)
+{
+  struct varlena *raw = (struct varlena *) DatumGetPointer(datum);
+  struct varlena *v = raw;
+  SCL_Record *r;
+  Size        len;
+
+  if (VARATT_IS_EXTERNAL_EXPANDED(raw))
+    len = 0;
+  else
+  {
+    /* toast pointers say nothing reliable about the value, compare content */
+    if (VARATT_IS_EXTERNAL(raw))
+      v = PG_DETOAST_DATUM_PACKED(datum);
+    len = VARSIZE_ANY(v);
+    if (replayMemo.valid && replayMemo.rawlen == len &&
+        memcmp(replayMemo.raw, v, len) == 0)
+      return &replayMemo;
+  }
+
+  r = chessgame_expand(fcinfo, PointerGetDatum(v));
+  memcpy(replayMemo.record, *r, SCL_RECORD_MAX_SIZE);
+  pfree(r);
+  replayMemo.length = SCL_recordLength(replayMemo.record);
+  replayMemo.computed = 0;
+  SCL_boardInit(replayMemo.boards[0]);
+
+  /* games we cannot identify are replayed through the memo but not kept */
+  replayMemo.valid = len > 0 && len <= CHESS_REPLAY_MAX_RAW;
+  if (replayMemo.valid)
+  {
+    memcpy(replayMemo.raw, v, len);
+    replayMemo.rawlen = len;
+  }
+
+  if (v != raw)
+    pfree(v);
+  return &replayMemo;
+}
+
+/* Board after the given number of plies, the final one past the end */
+static SCL_Board *
+chess_replay_board(ChessReplayMemo *m, int ply)
+{
+  int         from = m->computed;
+
+  ply = Max(0, Min(ply, m->length));
+  for (; m->computed < ply; m->computed++)
+  {
+    uint8_t     s0, s1;
+    char        p;
+
+    SCL_boardCopy(m->boards[m->computed], m->boards[m->computed + 1]);
+    SCL_recordGetMove(m->record, m->computed, &s0, &s1, &p);
+    SCL_boardMakeMove(m->boards[m->computed + 1], s0, s1, p);
+  }
+  if (m->computed > from)
+    chess_stats_count(CHESS_STAT_PLIES_APPLIED, m->computed - from);
+  return &m->boards[ply];
+}
+
+/*****************************************************************************/
+
+static SCL_Record *
+Chessgame_make(char *str)
+{
+  SCL_Record *c = palloc0(SCL_RECORD_MAX_SIZE);
+//  SCL_Record *c = palloc0(SCL_RECORD_MAX_LENGTH);
+  SCL_recordFromPGN(*c,str);
+  //SCL_recordFromPGN(*c,"1. f3 e5 2. g4 Qh4#");
+  //SCL_recordFromPGN(*c,"1. Qxc4 c6 2. g4 Qh4#i");
+//  SCL_recordFromPGN(*c,"");
+  return *c;
+
+
+}
+
+static SCL_Board *
+Chessboard_make(char *str)
+{
+  SCL_Board *b = palloc0(SCL_BOARD_STATE_SIZE);
+  SCL_boardInit(*b);
+  SCL_boardFromFEN(*b,str);
+
+
+  /*char *output = palloc0(SCL_FEN_MAX_LENGTH);
+  SCL_boardToFEN(b,output);
+  ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+  errmsg("output: %s",output)));*/
+
+  //SCL_boardFromFEN(*b,'rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1');
+  //SCL_boardFromFEN(*b,'8/5k2/3p4/1p1Pp2p/pP2Pp1P/P4P1K/8/8 b - - 99 50');
+//  SCL_boardFromFEN(*b,'r4r1k/ppp1qpb1/7p/4pRp1/1PB1P3/1QPR3P/P4P2/6K1 w - - 4 26');
+  return b;
+
+}
+/*****************************************************************************/
+
+static void
+p_whitespace(char **str)
+{
+   while (**str == ' ' || **str == '\n' || **str == '\r' || **str == '\t')
+      *str += 1;
+}
+
+static bool
+p_whitespace_char(char c)
+{
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static void
+ensure_end_input(char **str, bool end)
+{
+  *str += 1;
+  if (end)
+  {
+    p_whitespace(str);
+    if (**str != 0)
+      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+        errmsg("Could not parse temporal value %c",**str)));
+
+  }
+}
+
+static int
+p_turnNumber(char **str,int numberOfTurns)
+{
+  p_whitespace(str);
+  /*int result = **str - '0';
+  *str += 1;
+  return result == numberOfTurns;*/
+  if( (**str - '0' )==  numberOfTurns )  {
+    *str += 1;
+    return true;
+  }
+  else
+    return false;
+}
+
+static bool
+p_dot(char **str)
+{
+p_whitespace(str);
+  if (**str == '.')
+  {
+    *str += 1;
+    p_whitespace(str);
+   return true;
+  }
+  return false;
+}
+
+
+static bool
+is_uppercase_letter(char **str)
+{
+  if  (**str == 'Q' || **str == 'K' || **str == 'R' || **str == 'B' ||
+		  **str == 'N' )
+      return true;
+  return false;
+}
+static bool
+is_lowercase_letter(char **str)  {
+  if (**str == 'a' || **str == 'b' || **str == 'c' || **str == 'd' ||
+     **str == 'e' || **str == 'f' || **str == 'g' || **str == 'h' )
+      return true;
+  return false;
+}
+
+static bool
+is_number(char **str)  {
+  if (**str == '1' || **str == '2' || **str == '3' || **str == '4' ||
+     **str == '5' || **str == '6' || **str == '7' || **str == '8' )
+      return true;
+  return false;
+}
+
+static bool
+is_move(char **str)
+{
+  if (is_lowercase_letter(str))  {
+    *str+= 1;
+    if (is_number(str))  {
+        *str -= 1;
+        return true;
+    }
+    *str -= 1;
+  }
+  return false;
+}
+
+static bool
+is_firstChar(char **str)
+{
+  bool bool1;
+  *str -= 1;
+  bool1 = **str == ' ';
+  *str +=1;
+  return bool1;
+
+}
+
+static bool
+p_uppercase_letter(char **str)
+{
+  /*bool bool1, bool2;
+  bool1 = is_firstChar(str);
+  *str -= 2;
+  bool2 = is_move(str);
+  *str += 3;
+  return bool1 || bool2;*/
+
+  if (is_firstChar(str))  {
+    *str += 1;
+    return true;
+  }
+
+  else {
+    *str -= 2;
+    if (is_move(str))  {
+      *str += 2;
+       return true;
+    }
+  }
+  return false;
+}
+
+static bool
+p_lowercase_letter(char **str)
+{
+  if (is_move(str))  {
+    *str += 2;
+     //if (**str == '#')  {
+     // ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+      // errmsg("Invvalid input syntax at the line 200 with at the char %c",**str)));
+     // }
+    return true;
+  }
+  else  {
+//     if (**str == 'f')  {
+  //    ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+   //    errmsg("Invvalid input syntax at the line 200 with at the char %c",**str)));
+    //  }
+    bool bool1, bool2, bool3;
+    **str -= 1;
+    bool1 = is_uppercase_letter(str);
+    *str += 2;
+    bool2 = is_lowercase_letter(str) ;
+    bool3 = **str == 'x';
+    //*str += 1;
+    return bool2 || bool3;
+   // return bool1 && (bool2 || bool3);
+  }
+}
+
+static bool
+p_number(char **str)
+{
+  bool bool1,bool2;
+  *str -= 1;
+  bool1 = is_lowercase_letter(str);
+  bool2 = is_uppercase_letter(str);
+  *str += 2;
+  return bool1 || bool2;
+
+}
+
+static bool
+p_x(char **str)
+{
+  *str += 1;
+  ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+  errmsg("Invvalid input syntax for type Chessgame with the character %c, at the line 237",**str)));
+  if (is_move(str))  {
+    *str += 2;
+    return true;
+  }
+  else
+    return false;
+}
+
+static bool
+p_check(char **str,char *firstChar)
+{
+  bool result;
+  *str += 1;
+  result = **str == ' ' && *firstChar == 'K';
+  return result;
+}
+
+static bool
+is_castling(char** str)
+{
+  bool bool1,bool2;
+  *str += 1;
+  bool1 = **str == '-';
+  *str += 1;
+  bool2 = **str == 'O';
+  return bool1 && bool2;
+}
+
+static bool
+p_castling(char **str)
+{
+  if (is_castling(str))  {  //kingside
+    *str += 1;
+    return true;
+  }
+  else {
+    bool bool1 = is_castling(str);  //queesnide
+    *str += 1;
+    return bool1;
+
+  }
+  //return kingside(str)  || queenside(str);
+}
+static bool
+p_move(char **str,bool whitePlay,char *firstChar,int numberOfTurns)
+{
+   p_whitespace(str);
+   char *move = palloc(sizeof(char)*4);
+   while (**str != ' ' )  {
+     bool test;
+     //if (**str == 'c')  {
+     // ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+     //  errmsg("Invvalid input syntax at the line 294 with at the char %c",**str)));
+     // }
+     if (is_uppercase_letter(str))  {
+       if (is_firstChar(str)  && **str == 'K')
+         *firstChar = 'K';
+       test = p_uppercase_letter(str);
+     }
+     else if  (is_lowercase_letter(str))  {
+      // if (**str == 'c')  {
+      //   ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+        // errmsg("Invvalid input syntax at the line 200 with at the char %c",**str)));
+      // }
+       test = p_lowercase_letter(str);
+     }
+     else if (is_number(str))
+       test = p_number(str);
+     else if (**str == 'x')
+       test = p_x(str);
+     else if (**str == '+')
+       test = p_check(str,firstChar);
+     else if (**str == 'O')
+       test = p_castling(str);
+     else
+       test = false;
+     if (!test)
+       return false;
+     if (**str == '#')
+       break;
+    }
+      //ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+       // errmsg("Invvalid input syntax at the line 294 with at the string %s",move)));
+    return true;
+
+}
+
+/* Whether the text starts with a coordinate move rather than PGN */
+static bool
+chessgame_is_uci(char *str)
+{
+  p_whitespace(&str);
+  return str[0] >= 'a' && str[0] <= 'h' && str[1] >= '1' && str[1] <= '8' &&
+    str[2] >= 'a' && str[2] <= 'h' && str[3] >= '1' && str[3] <= '8';
+}
+
+/*
+ * Reads space separated coordinate moves (e2e4 e7e5 e7e8q) straight into
+ * the record, without move generation. With followBoard the moves are
+ * played from the initial position and each must take a piece of the side
+ * to move to a square not holding one of its own, with a promotion suffix
+ * only on a pawn reaching its last rank; full legality is not checked.
+ * Without it only the syntax is, for move sequences that may start
+ * anywhere in a game, as in chessgame @@ text.
+ */
+static SCL_Record *
+chessgame_parse_uci(char *str, bool followBoard)
+{
+  SCL_Record *r = palloc0(SCL_RECORD_MAX_SIZE);
+  SCL_Board board;
+  int length = 0;
+
+  SCL_recordInit(*r);
+  SCL_boardInit(board);
+  for (;;)
+  {
+    uint8_t from, to;
+    char promotion = 'q';
+    const char *move;
+
+    p_whitespace(&str);
+    if (*str == '\0')
+      break;
+
+    move = str;
+    if (!(str[0] >= 'a' && str[0] <= 'h' && str[1] >= '1' && str[1] <= '8' &&
+          str[2] >= 'a' && str[2] <= 'h' && str[3] >= '1' && str[3] <= '8'))
+      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+        errmsg("invalid input syntax for type chessgame at move %d",
+          length + 1)));
+    from = (str[1] - '1') * 8 + (str[0] - 'a');
+    to = (str[3] - '1') * 8 + (str[2] - 'a');
+    str += 4;
+    if (*str != '\0' && strchr("qrbn", *str) != NULL)
+      promotion = *str++;
+    if ((*str != '\0' && strchr(" \n\r\t", *str) == NULL) || from == to)
+      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+        errmsg("invalid input syntax for type chessgame at move %d: \"%.*s\"",
+          length + 1, (int) (str - move) + 1, move)));
+    if (followBoard &&
+        (board[from] == '.' ||
+         SCL_pieceIsWhite(board[from]) != SCL_boardWhitesTurn(board) ||
+         (board[to] != '.' &&
+          SCL_pieceIsWhite(board[to]) == SCL_boardWhitesTurn(board)) ||
+         (str - move == 5 && !chess_move_is_promotion(board, from, to))))
+      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+        errmsg("illegal move at move %d: \"%.*s\"",
+          length + 1, (int) (str - move), move)));
+    if (length >= SCL_RECORD_MAX_LENGTH)
+      ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+        errmsg("chessgame cannot have more than %d plies",
+          SCL_RECORD_MAX_LENGTH)));
+
+    chess_record_append(*r, length++, from, to, promotion);
+    if (followBoard)
+      SCL_boardMakeMove(board, from, to, promotion);
+  }
+  return r;
+}
+
+/*
+ * Writes the game as space separated coordinate moves. The board is only
+ * followed to know which moves are promotions and need a suffix.
+ */
+static char *
+chessgame_to_uci(SCL_Record *r)
+{
+  int length = SCL_recordLength(*r);
+  char *result = palloc(length * 6 + 1);
+  char *p = result;
+  SCL_Board board;
+
+  SCL_boardInit(board);
+  for (int i = 0; i < length; i++)
+  {
+    uint8_t from, to;
+    char promotion;
+
+    SCL_recordGetMove(*r, i, &from, &to, &promotion);
+    if (i > 0)
+      *p++ = ' ';
+    SCL_moveToString(board, from, to, promotion, p);
+    p += strlen(p);
+    SCL_boardMakeMove(board, from, to, promotion);
+  }
+  *p = '\0';
+  return result;
+}
+
+static SCL_Record *
+Chessgame_parse(char **str)
+{
+  return Chessgame_make(*str);
+  int numberOfTurns = 0;
+  while (**str != '#')  {
+    numberOfTurns += 1;
+    if ( !p_turnNumber(str,numberOfTurns))
+      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+        errmsg("Invalid input syntax for type Chessgame at the turn identifier number %d %c",numberOfTurns,**str)));
+    if ( !p_dot(str))
+      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+        errmsg("Invalid input syntax for type Chessgame with the dot at turn number %d",numberOfTurns)));
+    char *firstChar = palloc(sizeof(char));
+    if ( !p_move(str,true,firstChar,numberOfTurns))
+      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+        errmsg("Invvalid input syntax for type Chessgame with the white play at turn number %d",numberOfTurns)));
+    if (**str == '#')
+      break;
+    if ( !p_move(str,false,firstChar,numberOfTurns))
+      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+        errmsg("Inval@id input syntax for type Chessgame with the black play at turn number %d",numberOfTurns)));
+    if (**str == '#')
+      break;
+  }
+  ensure_end_input(str,true);
+  
+  return Chessgame_make(*str);
+
+}
+
+char* getNextMoveValue(char *c){
+  char col = c[0];
+  char line = c[1];
+  char colName[] = "abcdefgh";
+  char lineName[] = "12345678";
+  int indexCol = strchr(colName,col)-colName;
+  int indexLine = strchr(lineName,line)-lineName;
+  int newLineIndex = indexLine+1;
+  int newColIndex = indexCol;
+  if(newLineIndex >= 8){
+    newLineIndex = 0;
+    newColIndex++;
+    if(newColIndex >= 8){
+      newColIndex = 7;
+      newLineIndex = 7;
+    }
+  }
+  char *newMove= palloc0(sizeof(char)*3);
+  newMove[0] = colName[newColIndex];
+  newMove[1] = lineName[newLineIndex];
+  newMove[2] = '\0'; 
+  return newMove; 
+} 
+
+static char* ChessgameToStr(SCL_Record  *c){
+  char *move = palloc0(sizeof(char)*3000);
+  int numberOfTurns = 1;
+  char test[300];
+  uint8_t source, destination;//, s2, s3
+  for( int i=0; i< SCL_recordLength(*c);i++){
+    if (i%2 == 0)  {
+      char *turn = psprintf("%d. ",numberOfTurns);
+      strcat(move,turn);
+      numberOfTurns ++;
+    }
+    uint8_t source, destination;//, s2, s3
+    char promotion;// p2
+    SCL_recordGetMove(*c,i,&source,&destination,&promotion);
+    SCL_Board *boardFromRecord = palloc0(SCL_BOARD_STATE_SIZE);
+    SCL_recordApply(*c,boardFromRecord,i);
+    char sourceString[10] = "";
+    char destinationString[10] = "";
+    //SCL_squareToString(source,sourceString);
+    //strcat(move,sourceString);
+    //SCL_squareToString(destination,destinationString);
+    char monString[300] = "";
+    SCL_moveToString(boardFromRecord,source,destination,promotion,destinationString); 
+    //processPiece("a1");
+     /*if(i == 3){
+      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+      errmsg("%c %s",boardFromRecord[0][processPiece("a4a1")],boardFromRecord[0])));
+    }*/
+    strcat(move,destinationString);
+
+    /*if (strcmp(sourceString,destinationString) == 0) {
+      strcat(move,destinationString);
+    }
+    else   {
+       strcat(move,sourceString);
+       strcat(move,destinationString);
+    }*/
+    if (promotion != 'q')
+      strncat(move,promotion,1);
+    if (i+1 < SCL_recordLength(*c))
+      strcat(move," ");
+    else
+      strcat(move,"#");
+  }
+ /* ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+  errmsg("%c %c %c %c %c",test[0],test[1],test[2],test[3],test[4])));*/
+  return move;
+}
+
+int processPiece(char *c){
+  char col = c[2];
+  char line = c[3];
+  char colName[] = "abcdefgh";
+  char lineName[] = "12345678";
+  /*ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+  errmsg("%c %c",col,line)));*/
+  int indexCol = strchr(colName,col)-colName;
+  int indexLine = strchr(lineName,line)-lineName;
+  return indexCol + 8*indexLine; 
+} 
+
+/**  ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+  errmsg("%s %s",temp1,temp2))); */
+  /*
+static bool compareOpening(SCL_Record *c,SCL_Record *d){
+  /*
+  for( int i=0; i< SCL_recordLength(*d);i++){
+    uint8_t s0, s1,s2,s3;
+    char p1,p2;
+    SCL_recordGetMove(*c,i,&s0,&s1,&p1);
+    SCL_recordGetMove(*d,i,&s2,&s3,&p2);
+    if( s0 != s2 || s1 != s3 || p1 != p2){
+      return 0;
+    }
+  }
+  return 1;
+  
+  int firstCompare = chessgame_abs_cmp_internal(c,d);
+  if(firstCompare < 0){
+    return 0;
+  }
+/*
+  uint8_t source,destination;
+  char promotion;
+  int i = SCL_recordLength(d);
+  uint8_t endState = SCL_recordGetMove(*d,i-1,&source,&destination,&promotion);
+  char tempmove2[10] = "";
+  SCL_squareToString(destination,tempmove2);
+  bool forceCondition = 0;
+  if(strcmp(tempmove2,"h8") == 0){
+    forceCondition = 1;
+  }
+  char *supBorn2 = getNextMoveValue(tempmove2);
+  char dummy2[10] = "e2";
+  strcat(dummy2,supBorn2);
+  SCL_recordRemoveLast(d); 
+  SCL_recordAdd(d,source,processPiece(dummy2),promotion,endState);
+
+  bool forceCondition = 0;
+  if(chessgame_abs_cmp_internal(c,d) >= 0 && !forceCondition){
+    return 0;
+  }
+  return 1;
+}*/
+
+static SCL_Record *getBoundGame(SCL_Record *d){
+  uint8_t source,destination;
+  char promotion;
+  int i = SCL_recordLength(d);
+  uint8_t endState = SCL_recordGetMove(*d,i-1,&source,&destination,&promotion);
+  char tempmove2[10] = "";
+  SCL_squareToString(destination,tempmove2);
+  /*bool forceCondition = 0;
+  if(strcmp(tempmove2,"h8") == 0){
+    forceCondition = 1;
+  }*/
+  char *supBorn2 = getNextMoveValue(tempmove2);
+  char dummy2[10] = "e2";
+  strcat(dummy2,supBorn2);
+  SCL_recordRemoveLast(d); 
+  SCL_recordAdd(d,source,processPiece(dummy2),promotion,endState);
+  return d;
+}  
+//Ss
+/**    ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+  errmsg("%s %d %s",ChessgameToStr(d), chessgame_abs_cmp_internal(c,d),ChessgameToStr(c))));*/
+static SCL_Record *getFirstMovesProcess(SCL_Record *chessgame, int halfmoves){
+ /* 
+  SCL_Record *newRecord = palloc0(SCL_RECORD_MAX_LENGTH);
+  char test[300];
+  SCL_recordInit(newRecord);
+  uint16_t recordLength =  SCL_recordLength(chessgame);
+  uint8_t squareFrom;
+  uint8_t squareTo;
+  uint8_t move;
+  for(int i = 0 ; i < halfmoves ; i++){
+    char promotedPiece;
+    move = SCL_recordGetMove(*chessgame,i,&squareFrom,&squareTo,&promotedPiece);
+    test[i] = promotedPiece;
+    SCL_recordAdd(*newRecord,squareFrom,squareTo,promotedPiece,move);
+    
+  }
+
+//  ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+//  errmsg("squareForm squareTo: %d %d",squareFrom,squareTo)));
+  return newRecord;
+  */
+  int size = SCL_recordLength(*chessgame);
+  int number = size - halfmoves;
+  for(int i = 0; i < number; i++){
+    SCL_recordRemoveLast(*chessgame);
+  }
+  return *chessgame;
+}
+
+static SCL_Board *
+Chessboard_parse(char **str)
+{
+  return Chessboard_make(*str);
+  /*
+  Parsing
+  int numberOfTurns = 0;
+  while (**str != '#')  {
+    numberOfTurns += 1;
+    if ( !p_turnNumber(str,numberOfTurns))
+      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+        errmsg("Invalid input syntax for type Chessgame at the turn identifier number %d %c",numberOfTurns,**str)));
+    if ( !p_dot(str))
+      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+        errmsg("Invalid input syntax for type Chessgame with the dot at turn number %d",numberOfTurns)));
+    char *firstChar = palloc(sizeof(char));
+    if ( !p_move(str,true,firstChar,numberOfTurns))
+      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+        errmsg("Invvalid input syntax for type Chessgame with the white play at turn number %d",numberOfTurns)));
+    if (**str == '#')
+      break;
+    if ( !p_move(str,false,firstChar,numberOfTurns))
+      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+        errmsg("Inval@id input syntax for type Chessgame with the black play at turn number %d",numberOfTurns)));
+    if (**str == '#')
+      break;
+  }
+  ensure_end_input(str,true);
+  return Chessgame_make(*str);
+ */
+}
+
+static char* ChessboardToStr(SCL_Board  *b){
+  char *output = palloc0(SCL_FEN_MAX_LENGTH);
+  uint8_t result = SCL_boardToFEN(b,output);
+  if (result != 0)
+    return output;
+  else  {
+    ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+    errmsg("Error could not charge the board %s",output)));
+  }
+}
+
+static bool compareBoard(SCL_Board *boardFromRecord, SCL_Board *boardToCompare){
+  return !SCL_boardsDiffer(*boardFromRecord,*boardToCompare);
+}
+
+
+
+/*****************************************************************************/
+
+PG_FUNCTION_INFO_V1(chessgame_in);
+Datum
+chessgame_in(PG_FUNCTION_ARGS)
+{
+  char *str = PG_GETARG_CSTRING(0);
+  //SCL_Record c;
+  //SCL_recordInit(c);
+  //SCL_recordFromPGN(c,str);
+  //PG_RETURN_ChessGame_P(Chessgame_make(c));
+
+  //PG_RETURN_ChessGame_P(Chessgame_make(str));
+  SCL_Record *result;
+  instr_time start;
+
+  chess_stats_start(&start);
+  chess_stats_count(CHESS_STAT_PARSE_CALLS, 1);
+  chess_stats_count(CHESS_STAT_PARSE_BYTES, strlen(str));
+  if (chessgame_is_uci(str))
+    result = chessgame_parse_uci(str, true);
+  else
+    result = Chessgame_parse(&str);
+  chess_stats_end(CHESS_FN_CHESSGAME_IN, &start);
+  PG_RETURN_ChessGame_P(result);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_out);
+Datum
+chessgame_out(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  instr_time start;
+  char* result;
+
+  chess_stats_start(&start);
+  if (outputFormat == CHESSGAME_FORMAT_UCI)
+    result = chessgame_to_uci(c);
+  else
+    result = ChessgameToStr(c);
+  chess_stats_end(CHESS_FN_CHESSGAME_OUT, &start);
+  PG_FREE_IF_COPY(c, 0);
+  PG_RETURN_CSTRING(result);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_from_uci);
+Datum
+chessgame_from_uci(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_ChessGame_P(chessgame_parse_uci(
+    text_to_cstring(PG_GETARG_TEXT_PP(0)), true));
+}
+
+PG_FUNCTION_INFO_V1(chessgame_to_uci_text);
+Datum
+chessgame_to_uci_text(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+
+  PG_RETURN_TEXT_P(cstring_to_text(chessgame_to_uci(c)));
+}
+
+/* OLD WAY TO HASOPENING 
+PG_FUNCTION_INFO_V1(hasOpening);
+Datum
+hasOpening(PG_FUNCTION_ARGS)
+{
+	SCL_Record *c = PG_GETARG_ChessGame_P(0);
+	SCL_Record *d = PG_GETARG_ChessGame_P(1);
+  PG_RETURN_BOOL(compareOpening(c,d));
+}
+*/
+
+PG_FUNCTION_INFO_V1(getFirstMoves);
+Datum
+getFirstMoves(PG_FUNCTION_ARGS)
+{
+
+  SCL_Record *chessGameRecord = PG_GETARG_ChessGame_P(0);
+  int halfmoves = PG_GETARG_INT32(1);
+  SCL_Record *c = getFirstMovesProcess(chessGameRecord,halfmoves);
+  PG_RETURN_ChessGame_P(c);
+}
+
+PG_FUNCTION_INFO_V1(hasBoard);
+Datum
+hasBoard(PG_FUNCTION_ARGS)
+{
+  ChessReplayMemo *memo = chess_replay_get(fcinfo, PG_GETARG_DATUM(0));
+  SCL_Board *boardToCompare = PG_GETARG_ChessBoard_P(1);
+  int halfmoves = PG_GETARG_INT32(2);
+  int i = 1;
+  bool result = false;
+  instr_time start;
+
+  chess_stats_start(&start);
+  for (i = 1; i <= halfmoves;i++)  {
+    result = compareBoard(chess_replay_board(memo, i), boardToCompare);
+    /* past the end the board no longer changes */
+    if (result || i >= memo->length)  {
+      break;
+    }
+  }
+  chess_stats_count(CHESS_STAT_BOARDS_COMPARED, Min(i, Max(halfmoves, 0)));
+  chess_stats_end(CHESS_FN_HASBOARD, &start);
+  PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(chessboard_in);
+Datum
+chessboard_in(PG_FUNCTION_ARGS)
+{
+  char *str = PG_GETARG_CSTRING(0);
+  SCL_Board *result;
+  instr_time start;
+
+  chess_stats_start(&start);
+  chess_stats_count(CHESS_STAT_PARSE_CALLS, 1);
+  chess_stats_count(CHESS_STAT_PARSE_BYTES, strlen(str));
+  result = Chessboard_parse(&str);
+  chess_stats_end(CHESS_FN_CHESSBOARD_IN, &start);
+  PG_RETURN_ChessBoard_P(result);
+
+/*  SCL_Board b;
+  SCL_boardInit(b);
+  SCL_boardFromFEN(b,str);
+  char *output = palloc0(SCL_FEN_MAX_LENGTH);
+  SCL_boardToFEN(b,output);
+
+  //ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+  //errmsg("output: %s",output)));
+  */
+ 
+}
+
+PG_FUNCTION_INFO_V1(chessboard_out);
+Datum
+chessboard_out(PG_FUNCTION_ARGS)
+{
+  SCL_Board *b = (SCL_Board*)PG_GETARG_ChessBoard_P(0);
+  SCL_boardEstimatePhase(b);
+  char* result = ChessboardToStr(b);
+
+
+ /* char *output = palloc0(SCL_FEN_MAX_LENGTH);
+  SCL_boardToFEN(b,output);
+  ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+  errmsg("b output: %s",output))); */
+/* if (result == NULL) {
+    ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                    errmsg("ChessboardToStr returned NULL")));
+} else {
+    printf("Result: %s\n", result); // Vérification préalable
+    ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                    errmsg("b output: %s", result)));
+}*/
+
+  PG_FREE_IF_COPY(b, 0);
+  PG_RETURN_CSTRING(result);
+}
+
+PG_FUNCTION_INFO_V1(append_move);
+Datum
+append_move(PG_FUNCTION_ARGS)
+{
+  ExpandedChessGame *eg = chessgame_get_expanded(fcinfo, PG_GETARG_DATUM(0));
+
+  chessgame_expanded_append_text(eg,
+    text_to_cstring(PG_GETARG_TEXT_PP(1)));
+  PG_RETURN_DATUM(EOHPGetRWDatum(&eg->hdr));
+}
+
+PG_FUNCTION_INFO_V1(apply_moves);
+Datum
+apply_moves(PG_FUNCTION_ARGS)
+{
+  ExpandedChessGame *eg = chessgame_get_expanded(fcinfo, PG_GETARG_DATUM(0));
+  ArrayType *moves = PG_GETARG_ARRAYTYPE_P(1);
+  Datum *elems;
+  bool *nulls;
+  int n;
+
+  deconstruct_array(moves, TEXTOID, -1, false, TYPALIGN_INT,
+    &elems, &nulls, &n);
+  for (int i = 0; i < n; i++)
+  {
+    if (nulls[i])
+      ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+        errmsg("move %d is null", i + 1)));
+    chessgame_expanded_append_text(eg, TextDatumGetCString(elems[i]));
+  }
+  PG_RETURN_DATUM(EOHPGetRWDatum(&eg->hdr));
+}
+
+PG_FUNCTION_INFO_V1(chessboard_apply_move);
+Datum
+chessboard_apply_move(PG_FUNCTION_ARGS)
+{
+  SCL_Board *b = PG_GETARG_ChessBoard_P(0);
+  char *move = text_to_cstring(PG_GETARG_TEXT_PP(1));
+  SCL_Board *result = palloc(SCL_BOARD_STATE_SIZE);
+  uint8_t from, to;
+  char promotion;
+
+  SCL_boardCopy(*b, *result);
+  chess_parse_move(*result, move, &from, &to, &promotion);
+  SCL_boardMakeMove(*result, from, to, promotion);
+  PG_RETURN_ChessBoard_P(result);
+}
+
+PG_FUNCTION_INFO_V1(getBoard);
+Datum
+getBoard(PG_FUNCTION_ARGS)
+{
+  ExpandedChessGame *eg = chessgame_get_expanded_ro(PG_GETARG_DATUM(0));
+  int halfmoves = PG_GETARG_INT32(1);
+  SCL_Board *boardFromRecord = palloc0(SCL_BOARD_STATE_SIZE);
+  instr_time start;
+
+  chess_stats_start(&start);
+
+  /* the board after the last move is kept by expanded games */
+  if (eg != NULL && halfmoves >= eg->length)
+  {
+    SCL_boardCopy(eg->board, *boardFromRecord);
+    chess_stats_end(CHESS_FN_GETBOARD, &start);
+    PG_RETURN_ChessBoard_P(boardFromRecord);
+  }
+
+  /* negative plies wrap around to the end, as in SCL_recordApply */
+  SCL_boardCopy(*chess_replay_board(chess_replay_get(fcinfo,
+    PG_GETARG_DATUM(0)), (uint16_t) halfmoves), *boardFromRecord);
+  chess_stats_end(CHESS_FN_GETBOARD, &start);
+  /*ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                    errmsg("b output:: ")));*/
+  PG_RETURN_ChessBoard_P(boardFromRecord);
+}
+
+PG_FUNCTION_INFO_V1(getBoundedGame);
+Datum
+getBoundedGame(PG_FUNCTION_ARGS)
+{
+  SCL_Record *chessGameRecord = PG_GETARG_ChessGame_P(0);
+  /*ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                    errmsg("b output:: ")));*/
+  PG_RETURN_ChessGame_P(getBoundGame(chessGameRecord));
+}
+
+/*---------------------------------*/
+
+/*
+ * Sort key of a record item: the from and to squares numbered file first
+ * ("a1" < "a2" < ... < "h8"), which is the order comparing the square names
+ * as strings gives. Promotions and end flags take no part in comparisons.
+ */
+static inline uint16
+chessgame_item_key(const uint8_t *item)
+{
+  uint8_t from = item[0] & 0x3f;
+  uint8_t to = item[1] & 0x3f;
+
+  return (((from % 8) * 8 + from / 8) << 6) | ((to % 8) * 8 + to / 8);
+}
+
+static int
+chessgame_abs_cmp_internal(SCL_Record *a, SCL_Record *b)
+{
+  int r1 = SCL_recordLength(*a);
+  int r2 = SCL_recordLength(*b);
+  int n = Min(r1, r2);
+
+  for (int i = 0; i < n; i++)  {
+    uint16 k1 = chessgame_item_key(*a + i * 2);
+    uint16 k2 = chessgame_item_key(*b + i * 2);
+
+    if (k1 != k2)
+      return k1 < k2 ? -1 : 1;
+  }
+  if(r1 > r2)return 1;
+  if(r1 < r2) return -1;
+  return 0;
+}
+
+/**
+ * 
+ * 
+ * char str1[10] = "";
+    char str2[10] = "";
+    SCL_squareToString(squareFrom1,str1);
+    SCL_squareToString(squareFrom2,str2);
+ */
+PG_FUNCTION_INFO_V1(chessgame_abs_eq);
+Datum
+chessgame_abs_eq(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  SCL_Record *d = PG_GETARG_ChessGame_P(1);
+  bool result = chessgame_abs_cmp_internal(c, d) == 0;
+  PG_FREE_IF_COPY(c, 0);
+  PG_FREE_IF_COPY(d, 1);
+  PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_abs_ne);
+Datum
+chessgame_abs_ne(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  SCL_Record *d = PG_GETARG_ChessGame_P(1);
+  bool result = chessgame_abs_cmp_internal(c, d) != 0;
+  PG_FREE_IF_COPY(c, 0);
+  PG_FREE_IF_COPY(d, 1);
+  PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_abs_lt);
+Datum
+chessgame_abs_lt(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  SCL_Record *d = PG_GETARG_ChessGame_P(1);
+  bool result = chessgame_abs_cmp_internal(c, d) < 0;
+  PG_FREE_IF_COPY(c, 0);
+  PG_FREE_IF_COPY(d, 1);
+  PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_abs_le);
+Datum
+chessgame_abs_le(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  SCL_Record *d = PG_GETARG_ChessGame_P(1);
+  bool result = chessgame_abs_cmp_internal(c, d) <= 0;
+  PG_FREE_IF_COPY(c, 0);
+  PG_FREE_IF_COPY(d, 1);
+  PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_abs_gt);
+Datum
+chessgame_abs_gt(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  SCL_Record *d = PG_GETARG_ChessGame_P(1);
+  bool result = chessgame_abs_cmp_internal(c, d) > 0;
+  PG_FREE_IF_COPY(c, 0);
+  PG_FREE_IF_COPY(d, 1);
+  PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_abs_ge);
+Datum
+chessgame_abs_ge(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  SCL_Record *d = PG_GETARG_ChessGame_P(1);
+  bool result = chessgame_abs_cmp_internal(c, d) >= 0;
+  PG_FREE_IF_COPY(c, 0);
+  PG_FREE_IF_COPY(d, 1);
+  PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_abs_cmp);
+Datum
+chessgame_abs_cmp(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  SCL_Record *d = PG_GETARG_ChessGame_P(1);
+  int result = chessgame_abs_cmp_internal(c, d);
+  PG_FREE_IF_COPY(c, 0);
+  PG_FREE_IF_COPY(d, 1);
+  PG_RETURN_INT32(result);
+}
+
+
+
+
+
+/*****************************************************************************/
+/* Opening prefix dictionary */
+
+/*
+ * Returns the first plies moves of a game in the form stored in
+ * chessgame_prefix, or NULL if the game is not longer than that (only
+ * strict prefixes are useful for compression).
+ */
+PG_FUNCTION_INFO_V1(chessgame_prefix_moves);
+Datum
+chessgame_prefix_moves(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  int plies = PG_GETARG_INT32(1);
+  bytea *result;
+
+  if (plies < 1 || plies > CHESSGAME_PREFIX_MAX_PLIES)
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+      errmsg("opening prefix length must be between 1 and %d plies",
+        CHESSGAME_PREFIX_MAX_PLIES)));
+
+  if (SCL_recordLength(*c) <= plies)
+    PG_RETURN_NULL();
+
+  result = palloc(VARHDRSZ + plies * 2);
+  SET_VARSIZE(result, VARHDRSZ + plies * 2);
+  memcpy(VARDATA(result), *c, plies * 2);
+  pfree(c);
+  PG_RETURN_BYTEA_P(result);
+}
+
+/*
+ * Statement trigger on chessgame_prefix. Stored games refer to entries by
+ * id, so the dictionary is append-only: updates, deletes and truncation
+ * are refused. Inserts make every backend reload its copy of the dictionary
+ * once they commit.
+ */
+PG_FUNCTION_INFO_V1(chessgame_prefix_changed);
+Datum
+chessgame_prefix_changed(PG_FUNCTION_ARGS)
+{
+  TriggerData *trigdata = (TriggerData *) fcinfo->context;
+
+  if (!CALLED_AS_TRIGGER(fcinfo))
+    ereport(ERROR, (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+      errmsg("chessgame_prefix_changed: not called by trigger manager")));
+
+  if (!TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+    ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+      errmsg("chessgame_prefix entries cannot be updated or deleted"),
+      errdetail("Stored chessgame values refer to dictionary entries by id.")));
+
+  CacheInvalidateRelcache(trigdata->tg_relation);
+  PG_RETURN_POINTER(NULL);
+}
+
+/*****************************************************************************/
+/* SP-GiST radix tree over move sequences */
+
+/*
+ * The index stores games as sequences of 2 byte item keys (see
+ * chessgame_item_key), inner tuples hold the common prefix of their subtree
+ * and are labeled by the next key, with -1 meaning "no more moves" and -2
+ * marking a dummy node of an allTheSame tuple, as for text in spgtextproc.c.
+ */
+#define SPG_STRATEGY_LESS       1
+#define SPG_STRATEGY_LESSEQUAL  2
+#define SPG_STRATEGY_EQUAL      3
+#define SPG_STRATEGY_GREATEREQUAL 4
+#define SPG_STRATEGY_GREATER    5
+#define SPG_STRATEGY_PREFIX     6
+
+static inline uint16
+chess_keys_get(const char *keys, int i)
+{
+  uint16 k;
+
+  memcpy(&k, keys + i * sizeof(uint16), sizeof(uint16));
+  return k;
+}
+
+static Datum
+chess_keys_datum(const char *keys, int n)
+{
+  bytea *result = palloc(VARHDRSZ + n * sizeof(uint16));
+
+  SET_VARSIZE(result, VARHDRSZ + n * sizeof(uint16));
+  if (n > 0)
+    memcpy(VARDATA(result), keys, n * sizeof(uint16));
+  return PointerGetDatum(result);
+}
+
+static bytea *
+chessgame_to_keys(SCL_Record *r)
+{
+  int n = SCL_recordLength(*r);
+  bytea *result = palloc(VARHDRSZ + n * sizeof(uint16));
+  uint16 *keys = (uint16 *) VARDATA(result);
+
+  SET_VARSIZE(result, VARHDRSZ + n * sizeof(uint16));
+  for (int i = 0; i < n; i++)
+    keys[i] = chessgame_item_key(*r + i * 2);
+  return result;
+}
+
+/* Compares the first n keys of both sequences */
+static int
+chess_keys_cmp(const char *a, const char *b, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    uint16 ka = chess_keys_get(a, i);
+    uint16 kb = chess_keys_get(b, i);
+
+    if (ka != kb)
+      return ka < kb ? -1 : 1;
+  }
+  return 0;
+}
+
+static int
+chess_keys_common(const char *a, const char *b, int na, int nb)
+{
+  int i = 0;
+
+  while (i < na && i < nb && chess_keys_get(a, i) == chess_keys_get(b, i))
+    i++;
+  return i;
+}
+
+/* Binary search of a sorted label array, sets *i to the insert position */
+static bool
+chess_keys_search_label(Datum *nodeLabels, int nNodes, int16 c, int *i)
+{
+  int StopLow = 0,
+      StopHigh = nNodes;
+
+  while (StopLow < StopHigh)
+  {
+    int StopMiddle = (StopLow + StopHigh) >> 1;
+    int16 middle = DatumGetInt16(nodeLabels[StopMiddle]);
+
+    if (c < middle)
+      StopHigh = StopMiddle;
+    else if (c > middle)
+      StopLow = StopMiddle + 1;
+    else
+    {
+      *i = StopMiddle;
+      return true;
+    }
+  }
+  *i = StopHigh;
+  return false;
+}
+
+PG_FUNCTION_INFO_V1(chessgame_starts_with);
+Datum
+chessgame_starts_with(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  SCL_Record *d = PG_GETARG_ChessGame_P(1);
+  int n = SCL_recordLength(*d);
+  bool result = SCL_recordLength(*c) >= n;
+
+  for (int i = 0; result && i < n; i++)
+    result = chessgame_item_key(*c + i * 2) == chessgame_item_key(*d + i * 2);
+  pfree(c);
+  pfree(d);
+  PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_spg_config);
+Datum
+chessgame_spg_config(PG_FUNCTION_ARGS)
+{
+  spgConfigOut *cfg = (spgConfigOut *) PG_GETARG_POINTER(1);
+
+  cfg->prefixType = BYTEAOID;
+  cfg->labelType = INT2OID;
+  cfg->leafType = BYTEAOID;
+  cfg->canReturnData = false;
+  cfg->longValuesOK = false;
+  PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(chessgame_spg_compress);
+Datum
+chessgame_spg_compress(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  bytea *keys = chessgame_to_keys(c);
+
+  pfree(c);
+  PG_RETURN_BYTEA_P(keys);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_spg_choose);
+Datum
+chessgame_spg_choose(PG_FUNCTION_ARGS)
+{
+  spgChooseIn *in = (spgChooseIn *) PG_GETARG_POINTER(0);
+  spgChooseOut *out = (spgChooseOut *) PG_GETARG_POINTER(1);
+  bytea *inKeys = DatumGetByteaPP(in->datum);
+  char *inStr = VARDATA_ANY(inKeys);
+  int inSize = VARSIZE_ANY_EXHDR(inKeys) / sizeof(uint16);
+  char *prefixStr = NULL;
+  int prefixSize = 0;
+  int commonLen = 0;
+  int16 nodeKey = 0;
+  int i = 0;
+
+  /* Check for prefix match, set nodeKey to the first key after prefix */
+  if (in->hasPrefix)
+  {
+    bytea *prefixKeys = DatumGetByteaPP(in->prefixDatum);
+
+    prefixStr = VARDATA_ANY(prefixKeys);
+    prefixSize = VARSIZE_ANY_EXHDR(prefixKeys) / sizeof(uint16);
+
+    commonLen = chess_keys_common(inStr + in->level * sizeof(uint16),
+      prefixStr, inSize - in->level, prefixSize);
+
+    if (commonLen == prefixSize)
+    {
+      if (inSize - in->level > commonLen)
+        nodeKey = chess_keys_get(inStr, in->level + commonLen);
+      else
+        nodeKey = -1;
+    }
+    else
+    {
+      /* Must split tuple because incoming value doesn't match prefix */
+      out->resultType = spgSplitTuple;
+
+      if (commonLen == 0)
+        out->result.splitTuple.prefixHasPrefix = false;
+      else
+      {
+        out->result.splitTuple.prefixHasPrefix = true;
+        out->result.splitTuple.prefixPrefixDatum =
+          chess_keys_datum(prefixStr, commonLen);
+      }
+      out->result.splitTuple.prefixNNodes = 1;
+      out->result.splitTuple.prefixNodeLabels = palloc(sizeof(Datum));
+      out->result.splitTuple.prefixNodeLabels[0] =
+        Int16GetDatum(chess_keys_get(prefixStr, commonLen));
+
+      out->result.splitTuple.childNodeN = 0;
+
+      if (prefixSize - commonLen == 1)
+        out->result.splitTuple.postfixHasPrefix = false;
+      else
+      {
+        out->result.splitTuple.postfixHasPrefix = true;
+        out->result.splitTuple.postfixPrefixDatum =
+          chess_keys_datum(prefixStr + (commonLen + 1) * sizeof(uint16),
+            prefixSize - commonLen - 1);
+      }
+
+      PG_RETURN_VOID();
+    }
+  }
+  else if (inSize > in->level)
+    nodeKey = chess_keys_get(inStr, in->level);
+  else
+    nodeKey = -1;
+
+  if (chess_keys_search_label(in->nodeLabels, in->nNodes, nodeKey, &i))
+  {
+    /* Descend to existing node */
+    int levelAdd;
+
+    out->resultType = spgMatchNode;
+    out->result.matchNode.nodeN = i;
+    levelAdd = commonLen;
+    if (nodeKey >= 0)
+      levelAdd++;
+    out->result.matchNode.levelAdd = levelAdd;
+    if (inSize - in->level - levelAdd > 0)
+      out->result.matchNode.restDatum =
+        chess_keys_datum(inStr + (in->level + levelAdd) * sizeof(uint16),
+          inSize - in->level - levelAdd);
+    else
+      out->result.matchNode.restDatum = chess_keys_datum(NULL, 0);
+  }
+  else if (in->allTheSame)
+  {
+    /* Can't use AddNode action, so split the tuple */
+    out->resultType = spgSplitTuple;
+    out->result.splitTuple.prefixHasPrefix = in->hasPrefix;
+    out->result.splitTuple.prefixPrefixDatum = in->prefixDatum;
+    out->result.splitTuple.prefixNNodes = 1;
+    out->result.splitTuple.prefixNodeLabels = palloc(sizeof(Datum));
+    out->result.splitTuple.prefixNodeLabels[0] = Int16GetDatum(-2);
+    out->result.splitTuple.childNodeN = 0;
+    out->result.splitTuple.postfixHasPrefix = false;
+  }
+  else
+  {
+    /* Add a node for the not-previously-seen key */
+    out->resultType = spgAddNode;
+    out->result.addNode.nodeLabel = Int16GetDatum(nodeKey);
+    out->result.addNode.nodeN = i;
+  }
+
+  PG_RETURN_VOID();
+}
+
+typedef struct
+{
+  Datum   d;
+  int     i;
+  int16   c;
+} ChessSpgNode;
+
+static int
+chess_spg_node_cmp(const void *a, const void *b)
+{
+  int16 ca = ((const ChessSpgNode *) a)->c;
+  int16 cb = ((const ChessSpgNode *) b)->c;
+
+  return (ca > cb) - (ca < cb);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_spg_picksplit);
+Datum
+chessgame_spg_picksplit(PG_FUNCTION_ARGS)
+{
+  spgPickSplitIn *in = (spgPickSplitIn *) PG_GETARG_POINTER(0);
+  spgPickSplitOut *out = (spgPickSplitOut *) PG_GETARG_POINTER(1);
+  bytea *keys0 = DatumGetByteaPP(in->datums[0]);
+  int commonLen;
+  ChessSpgNode *nodes;
+  int i;
+
+  /* Identify longest common prefix, if any */
+  commonLen = VARSIZE_ANY_EXHDR(keys0) / sizeof(uint16);
+  for (i = 1; i < in->nTuples && commonLen > 0; i++)
+  {
+    bytea *keysi = DatumGetByteaPP(in->datums[i]);
+    int tmp = chess_keys_common(VARDATA_ANY(keys0), VARDATA_ANY(keysi),
+      VARSIZE_ANY_EXHDR(keys0) / sizeof(uint16),
+      VARSIZE_ANY_EXHDR(keysi) / sizeof(uint16));
+
+    if (tmp < commonLen)
+      commonLen = tmp;
+  }
+
+  if (commonLen == 0)
+    out->hasPrefix = false;
+  else
+  {
+    out->hasPrefix = true;
+    out->prefixDatum = chess_keys_datum(VARDATA_ANY(keys0), commonLen);
+  }
+
+  /* Extract the node label (first non-common key) from each value */
+  nodes = palloc(sizeof(ChessSpgNode) * in->nTuples);
+  for (i = 0; i < in->nTuples; i++)
+  {
+    bytea *keysi = DatumGetByteaPP(in->datums[i]);
+
+    if (commonLen < VARSIZE_ANY_EXHDR(keysi) / sizeof(uint16))
+      nodes[i].c = chess_keys_get(VARDATA_ANY(keysi), commonLen);
+    else
+      nodes[i].c = -1;
+    nodes[i].i = i;
+    nodes[i].d = in->datums[i];
+  }
+
+  qsort(nodes, in->nTuples, sizeof(ChessSpgNode), chess_spg_node_cmp);
+
+  out->nNodes = 0;
+  out->nodeLabels = palloc(sizeof(Datum) * in->nTuples);
+  out->mapTuplesToNodes = palloc(sizeof(int) * in->nTuples);
+  out->leafTupleDatums = palloc(sizeof(Datum) * in->nTuples);
+
+  for (i = 0; i < in->nTuples; i++)
+  {
+    bytea *keysi = DatumGetByteaPP(nodes[i].d);
+    int sizei = VARSIZE_ANY_EXHDR(keysi) / sizeof(uint16);
+    Datum leafD;
+
+    if (i == 0 || nodes[i].c != nodes[i - 1].c)
+    {
+      out->nodeLabels[out->nNodes] = Int16GetDatum(nodes[i].c);
+      out->nNodes++;
+    }
+
+    if (commonLen < sizei)
+      leafD = chess_keys_datum(VARDATA_ANY(keysi) +
+        (commonLen + 1) * sizeof(uint16), sizei - commonLen - 1);
+    else
+      leafD = chess_keys_datum(NULL, 0);
+
+    out->leafTupleDatums[nodes[i].i] = leafD;
+    out->mapTuplesToNodes[nodes[i].i] = out->nNodes - 1;
+  }
+
+  PG_RETURN_VOID();
+}
+
+/*
+ * Checks a (partial) key sequence against a query. When full is false the
+ * sequence is only the common prefix of a subtree, so answers are "may
+ * contain a match" rather than exact.
+ */
+static bool
+chess_spg_check(StrategyNumber strategy, const char *keys, int n,
+  const char *query, int nquery, bool full)
+{
+  int r = chess_keys_cmp(keys, query, Min(n, nquery));
+
+  if (full && r == 0)
+    r = (n > nquery) - (n < nquery);
+
+  switch (strategy)
+  {
+    case SPG_STRATEGY_LESS:
+      return full ? r < 0 : r <= 0;
+    case SPG_STRATEGY_LESSEQUAL:
+      return r <= 0;
+    case SPG_STRATEGY_EQUAL:
+      return full ? r == 0 : (r == 0 && n <= nquery);
+    case SPG_STRATEGY_GREATEREQUAL:
+      return r >= 0;
+    case SPG_STRATEGY_GREATER:
+      return full ? r > 0 : r >= 0;
+    case SPG_STRATEGY_PREFIX:
+      if (full)
+        return n >= nquery && chess_keys_cmp(keys, query, nquery) == 0;
+      return r == 0;
+    default:
+      elog(ERROR, "unrecognized strategy number: %d", strategy);
+  }
+  return false;
+}
+
+PG_FUNCTION_INFO_V1(chessgame_spg_inner_consistent);
+Datum
+chessgame_spg_inner_consistent(PG_FUNCTION_ARGS)
+{
+  spgInnerConsistentIn *in = (spgInnerConsistentIn *) PG_GETARG_POINTER(0);
+  spgInnerConsistentOut *out = (spgInnerConsistentOut *) PG_GETARG_POINTER(1);
+  bytea *reconstructedValue = (bytea *) DatumGetPointer(in->reconstructedValue);
+  bytea **queries;
+  bytea *reconstr;
+  bytea *prefixKeys = NULL;
+  int prefixSize = 0;
+  int maxReconstrLen;
+  int i, j;
+
+  queries = palloc(sizeof(bytea *) * Max(in->nkeys, 1));
+  for (j = 0; j < in->nkeys; j++)
+    queries[j] = chessgame_to_keys(chessgame_expand(fcinfo,
+      in->scankeys[j].sk_argument));
+
+  /*
+   * Reconstruct the keys represented by each child: the parent's keys, then
+   * this tuple's prefix, then the node label (if not a dummy).
+   */
+  maxReconstrLen = in->level + 1;
+  if (in->hasPrefix)
+  {
+    prefixKeys = DatumGetByteaPP(in->prefixDatum);
+    prefixSize = VARSIZE_ANY_EXHDR(prefixKeys) / sizeof(uint16);
+    maxReconstrLen += prefixSize;
+  }
+
+  reconstr = palloc(VARHDRSZ + maxReconstrLen * sizeof(uint16));
+  if (in->level)
+    memcpy(VARDATA(reconstr), VARDATA(reconstructedValue),
+      in->level * sizeof(uint16));
+  if (prefixSize)
+    memcpy(VARDATA(reconstr) + in->level * sizeof(uint16),
+      VARDATA_ANY(prefixKeys), prefixSize * sizeof(uint16));
+  /* last key of reconstr will be filled in below */
+
+  out->nodeNumbers = palloc(sizeof(int) * in->nNodes);
+  out->levelAdds = palloc(sizeof(int) * in->nNodes);
+  out->reconstructedValues = palloc(sizeof(Datum) * in->nNodes);
+  out->nNodes = 0;
+
+  for (i = 0; i < in->nNodes; i++)
+  {
+    int16 nodeKey = DatumGetInt16(in->nodeLabels[i]);
+    int thisLen;
+    bool res = true;
+
+    /* If nodeKey is a dummy value, don't include it in data */
+    if (nodeKey < 0)
+      thisLen = maxReconstrLen - 1;
+    else
+    {
+      uint16 k = nodeKey;
+
+      memcpy(VARDATA(reconstr) + (maxReconstrLen - 1) * sizeof(uint16),
+        &k, sizeof(uint16));
+      thisLen = maxReconstrLen;
+    }
+
+    for (j = 0; j < in->nkeys && res; j++)
+      res = chess_spg_check(in->scankeys[j].sk_strategy, VARDATA(reconstr),
+        thisLen, VARDATA(queries[j]),
+        (VARSIZE(queries[j]) - VARHDRSZ) / sizeof(uint16), nodeKey == -1);
+
+    if (res)
+    {
+      SET_VARSIZE(reconstr, VARHDRSZ + thisLen * sizeof(uint16));
+      out->nodeNumbers[out->nNodes] = i;
+      out->levelAdds[out->nNodes] = thisLen - in->level;
+      out->reconstructedValues[out->nNodes] =
+        datumCopy(PointerGetDatum(reconstr), false, -1);
+      out->nNodes++;
+    }
+  }
+
+  PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(chessgame_spg_leaf_consistent);
+Datum
+chessgame_spg_leaf_consistent(PG_FUNCTION_ARGS)
+{
+  spgLeafConsistentIn *in = (spgLeafConsistentIn *) PG_GETARG_POINTER(0);
+  spgLeafConsistentOut *out = (spgLeafConsistentOut *) PG_GETARG_POINTER(1);
+  int level = in->level;
+  bytea *leafValue = DatumGetByteaPP(in->leafDatum);
+  bytea *reconstrValue = (bytea *) DatumGetPointer(in->reconstructedValue);
+  int leafSize = VARSIZE_ANY_EXHDR(leafValue) / sizeof(uint16);
+  int fullLen = level + leafSize;
+  char *fullValue;
+  bool res = true;
+
+  /* Keys are exact, no recheck needed */
+  out->recheck = false;
+
+  fullValue = palloc(Max(fullLen, 1) * sizeof(uint16));
+  if (level)
+    memcpy(fullValue, VARDATA(reconstrValue), level * sizeof(uint16));
+  if (leafSize)
+    memcpy(fullValue + level * sizeof(uint16), VARDATA_ANY(leafValue),
+      leafSize * sizeof(uint16));
+
+  for (int j = 0; j < in->nkeys && res; j++)
+  {
+    bytea *query = chessgame_to_keys(chessgame_expand(fcinfo,
+      in->scankeys[j].sk_argument));
+
+    res = chess_spg_check(in->scankeys[j].sk_strategy, fullValue, fullLen,
+      VARDATA(query), (VARSIZE(query) - VARHDRSZ) / sizeof(uint16), true);
+  }
+
+  PG_RETURN_BOOL(res);
+}
+
+/*****************************************************************************/
+/* Piece-on-square patterns */
+
+/*
+ * A pattern is a chessboard whose occupied squares must hold the same piece
+ * on the searched board, empty squares and the extra state bytes are
+ * ignored. The GIN keys of a board are its (square, piece) pairs.
+ */
+static const char chess_pieces[] = "PNBRQKpnbrqk";
+
+#define CHESS_NPIECES 12
+
+static int
+chess_piece_index(char piece)
+{
+  const char *p;
+
+  if (piece == '.' || piece == '\0')
+    return -1;
+  p = strchr(chess_pieces, piece);
+  return p == NULL ? -1 : p - chess_pieces;
+}
+
+static bool
+chessboard_contains_internal(const char *board, const char *pattern)
+{
+  for (int i = 0; i < SCL_BOARD_SQUARES; i++)
+    if (pattern[i] != '.' && pattern[i] != board[i])
+      return false;
+  return true;
+}
+
+static Datum *
+chessboard_gin_keys(const char *board, int32 *nkeys)
+{
+  Datum *keys = palloc(sizeof(Datum) * SCL_BOARD_SQUARES);
+
+  *nkeys = 0;
+  for (int i = 0; i < SCL_BOARD_SQUARES; i++)
+  {
+    int piece = chess_piece_index(board[i]);
+
+    if (piece >= 0)
+      keys[(*nkeys)++] = Int32GetDatum(i * CHESS_NPIECES + piece);
+  }
+  return keys;
+}
+
+PG_FUNCTION_INFO_V1(chessboard_contains);
+Datum
+chessboard_contains(PG_FUNCTION_ARGS)
+{
+  SCL_Board *b = PG_GETARG_ChessBoard_P(0);
+  SCL_Board *pattern = PG_GETARG_ChessBoard_P(1);
+
+  PG_RETURN_BOOL(chessboard_contains_internal(*b, *pattern));
+}
+
+/* Does any position of the game, starting position included, match? */
+PG_FUNCTION_INFO_V1(chessgame_contains);
+Datum
+chessgame_contains(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  SCL_Board *pattern = PG_GETARG_ChessBoard_P(1);
+  int length = SCL_recordLength(*c);
+  SCL_Board board;
+  bool result;
+
+  SCL_boardInit(board);
+  result = chessboard_contains_internal(board, *pattern);
+  for (int i = 0; i < length && !result; i++)
+  {
+    uint8_t s0, s1;
+    char p;
+
+    SCL_recordGetMove(*c, i, &s0, &s1, &p);
+    SCL_boardMakeMove(board, s0, s1, p);
+    result = chessboard_contains_internal(board, *pattern);
+  }
+  pfree(c);
+  PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(chessboard_gin_extract_value);
+Datum
+chessboard_gin_extract_value(PG_FUNCTION_ARGS)
+{
+  SCL_Board *b = PG_GETARG_ChessBoard_P(0);
+  int32 *nkeys = (int32 *) PG_GETARG_POINTER(1);
+
+  PG_RETURN_POINTER(chessboard_gin_keys(*b, nkeys));
+}
+
+PG_FUNCTION_INFO_V1(chessboard_gin_extract_query);
+Datum
+chessboard_gin_extract_query(PG_FUNCTION_ARGS)
+{
+  SCL_Board *pattern = PG_GETARG_ChessBoard_P(0);
+  int32 *nkeys = (int32 *) PG_GETARG_POINTER(1);
+  int32 *searchMode = (int32 *) PG_GETARG_POINTER(6);
+  Datum *keys = chessboard_gin_keys(*pattern, nkeys);
+
+  /* An empty pattern matches every board */
+  if (*nkeys == 0)
+    *searchMode = GIN_SEARCH_MODE_ALL;
+  PG_RETURN_POINTER(keys);
+}
+
+PG_FUNCTION_INFO_V1(chessboard_gin_consistent);
+Datum
+chessboard_gin_consistent(PG_FUNCTION_ARGS)
+{
+  bool *check = (bool *) PG_GETARG_POINTER(0);
+  int32 nkeys = PG_GETARG_INT32(3);
+  bool *recheck = (bool *) PG_GETARG_POINTER(5);
+
+  /* The keys describe the pattern exactly, all of them must be present */
+  *recheck = false;
+  for (int i = 0; i < nkeys; i++)
+    if (!check[i])
+      PG_RETURN_BOOL(false);
+  PG_RETURN_BOOL(true);
+}
+
+PG_FUNCTION_INFO_V1(chessboard_gin_triconsistent);
+Datum
+chessboard_gin_triconsistent(PG_FUNCTION_ARGS)
+{
+  GinTernaryValue *check = (GinTernaryValue *) PG_GETARG_POINTER(0);
+  int32 nkeys = PG_GETARG_INT32(3);
+  GinTernaryValue result = GIN_TRUE;
+
+  for (int i = 0; i < nkeys; i++)
+  {
+    if (check[i] == GIN_FALSE)
+      PG_RETURN_GIN_TERNARY_VALUE(GIN_FALSE);
+    if (check[i] == GIN_MAYBE)
+      result = GIN_MAYBE;
+  }
+  PG_RETURN_GIN_TERNARY_VALUE(result);
+}
+
+/*****************************************************************************/
+/* Material signatures */
+
+/*
+ * Piece counts of one side packed in 20 bits: 4 bits each for pawns,
+ * knights, bishops, rooks and queens (kings are always there). A board's
+ * signature puts the stronger side in the high bits so that e.g. rook and
+ * pawn against rook has the same signature whichever colour has the pawn.
+ */
+#define MATERIAL_SIDE_BITS 20
+
+static const char material_pieces[] = "PNBRQ";
+static const int material_values[] = {1, 3, 3, 5, 9};
+
+static int
+material_side_value(uint32 side)
+{
+  int value = 0;
+
+  for (int i = 0; i < 5; i++)
+    value += ((side >> (i * 4)) & 0x0f) * material_values[i];
+  return value;
+}
+
+static int64
+material_canonical(uint32 white, uint32 black)
+{
+  int vw = material_side_value(white);
+  int vb = material_side_value(black);
+
+  if (vb > vw || (vb == vw && black > white))
+  {
+    uint32 tmp = white;
+
+    white = black;
+    black = tmp;
+  }
+  return ((int64) white << MATERIAL_SIDE_BITS) | black;
+}
+
+static int64
+material_signature_internal(const char *board)
+{
+  uint32 side[2] = {0, 0};
+
+  for (int i = 0; i < SCL_BOARD_SQUARES; i++)
+  {
+    char piece = board[i];
+    const char *p;
+
+    if (piece == '.')
+      continue;
+    p = strchr(material_pieces, piece < 'a' ? piece : piece - 'a' + 'A');
+    if (p == NULL || *p == '\0')
+      continue;
+    /* counts saturate at 15, more than a legal position can have */
+    if (((side[piece >= 'a'] >> ((p - material_pieces) * 4)) & 0x0f) < 15)
+      side[piece >= 'a'] += 1 << ((p - material_pieces) * 4);
+  }
+  return material_canonical(side[0], side[1]);
+}
+
+PG_FUNCTION_INFO_V1(materialSignature);
+Datum
+materialSignature(PG_FUNCTION_ARGS)
+{
+  SCL_Board *b = PG_GETARG_ChessBoard_P(0);
+
+  PG_RETURN_INT64(material_signature_internal(*b));
+}
+
+/* Reads a signature written as e.g. 'KRPvKR' or 'KRPKR' */
+PG_FUNCTION_INFO_V1(materialSignature_text);
+Datum
+materialSignature_text(PG_FUNCTION_ARGS)
+{
+  char *str = text_to_cstring(PG_GETARG_TEXT_PP(0));
+  char *s = str;
+  uint32 side[2] = {0, 0};
+  int current = -1;
+  int kings = 0;
+
+  for (; *s != '\0'; s++)
+  {
+    char c = *s;
+    const char *p;
+
+    if (c == ' ' || c == '\t')
+      continue;
+    if (c == 'v' || c == 'V')
+    {
+      if (current != 0)
+        break;
+      current = 1;
+      continue;
+    }
+    if (c >= 'a' && c <= 'z')
+      c = c - 'a' + 'A';
+    if (c == 'K')
+    {
+      if (++kings > 2 || (kings == 2 && current == 1 && side[1] != 0))
+        break;
+      current = kings - 1;
+      continue;
+    }
+    p = strchr(material_pieces, c);
+    if (p == NULL || c == '\0' || current < 0 ||
+        ((side[current] >> ((p - material_pieces) * 4)) & 0x0f) == 15)
+      break;
+    side[current] += 1 << ((p - material_pieces) * 4);
+  }
+
+  if (*s != '\0' || current != 1)
+    ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+      errmsg("invalid material signature: \"%s\"", str),
+      errhint("Write both sides starting with their king, e.g. 'KRPvKR'.")));
+
+  PG_RETURN_INT64(material_canonical(side[0], side[1]));
+}
+
+PG_FUNCTION_INFO_V1(materialSignatureText);
+Datum
+materialSignatureText(PG_FUNCTION_ARGS)
+{
+  int64 signature = PG_GETARG_INT64(0);
+  char result[2 * (1 + 5 * 15) + 2];
+  char *r = result;
+
+  for (int s = 1; s >= 0; s--)
+  {
+    uint32 side = (signature >> (s * MATERIAL_SIDE_BITS)) &
+      ((1 << MATERIAL_SIDE_BITS) - 1);
+
+    *r++ = 'K';
+    for (int i = 4; i >= 0; i--)
+      for (int n = (side >> (i * 4)) & 0x0f; n > 0; n--)
+        *r++ = material_pieces[i];
+    if (s == 1)
+      *r++ = 'v';
+  }
+  *r = '\0';
+  PG_RETURN_TEXT_P(cstring_to_text(result));
+}
+
+/*
+ * Distinct signatures a game passes through, in order. Material can only
+ * change on captures and pawn moves (promotions, en passant), so the board
+ * is only recounted after those.
+ */
+PG_FUNCTION_INFO_V1(materialSignatures);
+Datum
+materialSignatures(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  int length = SCL_recordLength(*c);
+  Datum *signatures = palloc(sizeof(Datum) * (length + 1));
+  int n = 0;
+  SCL_Board board;
+
+  SCL_boardInit(board);
+  signatures[n++] = Int64GetDatum(material_signature_internal(board));
+  for (int i = 0; i < length; i++)
+  {
+    uint8_t s0, s1;
+    char p;
+    bool changes;
+
+    SCL_recordGetMove(*c, i, &s0, &s1, &p);
+    changes = board[s1] != '.' || board[s0] == 'P' || board[s0] == 'p';
+    SCL_boardMakeMove(board, s0, s1, p);
+    if (changes)
+    {
+      int64 signature = material_signature_internal(board);
+      bool seen = false;
+
+      for (int j = 0; j < n && !seen; j++)
+        seen = DatumGetInt64(signatures[j]) == signature;
+      if (!seen)
+        signatures[n++] = Int64GetDatum(signature);
+    }
+  }
+  pfree(c);
+  PG_RETURN_ARRAYTYPE_P(construct_array(signatures, n, INT8OID,
+    sizeof(int64), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE));
+}
+
+/*****************************************************************************/
+/* Pawn structures */
+
+/*
+ * Pawn structure of a board as two bitmasks of the squares (bit 0 = a1)
+ * holding a white and a black pawn.
+ */
+typedef struct
+{
+  uint64    white;
+  uint64    black;
+} PawnStructure;
+
+#define DatumGetPawnStructureP(X) ((PawnStructure *) DatumGetPointer(X))
+#define PG_GETARG_PawnStructure_P(n) DatumGetPawnStructureP(PG_GETARG_DATUM(n))
+#define PG_RETURN_PawnStructure_P(x) return PointerGetDatum(x)
+
+/* GIN strategies */
+#define PAWN_STRATEGY_EQUAL   1
+#define PAWN_STRATEGY_SIMILAR 2
+
+PG_FUNCTION_INFO_V1(pawnstructure_in);
+Datum
+pawnstructure_in(PG_FUNCTION_ARGS)
+{
+  char *str = PG_GETARG_CSTRING(0);
+  PawnStructure *ps = palloc0(sizeof(PawnStructure));
+  char *s = str;
+  int row = 7,
+      col = 0;
+
+  /* Piece placement as in FEN, pieces other than pawns are ignored */
+  p_whitespace(&s);
+  for (; *s != '\0' && *s != ' '; s++)
+  {
+    if (*s == '/')
+    {
+      if (col != 8 || row == 0)
+        break;
+      row--;
+      col = 0;
+    }
+    else if (*s >= '1' && *s <= '8')
+      col += *s - '0';
+    else if (strchr(chess_pieces, *s) != NULL)
+    {
+      if (col < 8)
+      {
+        if (*s == 'P')
+          ps->white |= UINT64CONST(1) << (row * 8 + col);
+        else if (*s == 'p')
+          ps->black |= UINT64CONST(1) << (row * 8 + col);
+      }
+      col++;
+    }
+    else
+      break;
+    if (col > 8)
+      break;
+  }
+
+  if ((*s != '\0' && *s != ' ') || row != 0 || col != 8)
+    ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+      errmsg("invalid input syntax for type pawnstructure: \"%s\"", str)));
+
+  PG_RETURN_PawnStructure_P(ps);
+}
+
+PG_FUNCTION_INFO_V1(pawnstructure_out);
+Datum
+pawnstructure_out(PG_FUNCTION_ARGS)
+{
+  PawnStructure *ps = PG_GETARG_PawnStructure_P(0);
+  char *result = palloc(8 * 9);
+  char *r = result;
+
+  for (int row = 7; row >= 0; row--)
+  {
+    int empty = 0;
+
+    for (int col = 0; col < 8; col++)
+    {
+      uint64 bit = UINT64CONST(1) << (row * 8 + col);
+      char c = (ps->white & bit) ? 'P' : (ps->black & bit) ? 'p' : 0;
+
+      if (c == 0)
+      {
+        empty++;
+        continue;
+      }
+      if (empty > 0)
+        *r++ = '0' + empty;
+      empty = 0;
+      *r++ = c;
+    }
+    if (empty > 0)
+      *r++ = '0' + empty;
+    if (row > 0)
+      *r++ = '/';
+  }
+  *r = '\0';
+  PG_RETURN_CSTRING(result);
+}
+
+PG_FUNCTION_INFO_V1(pawnStructure);
+Datum
+pawnStructure(PG_FUNCTION_ARGS)
+{
+  SCL_Board *b = PG_GETARG_ChessBoard_P(0);
+  PawnStructure *ps = palloc0(sizeof(PawnStructure));
+
+  for (int i = 0; i < SCL_BOARD_SQUARES; i++)
+  {
+    if ((*b)[i] == 'P')
+      ps->white |= UINT64CONST(1) << i;
+    else if ((*b)[i] == 'p')
+      ps->black |= UINT64CONST(1) << i;
+  }
+  PG_RETURN_PawnStructure_P(ps);
+}
+
+static int
+pawnstructure_cmp_internal(PawnStructure *a, PawnStructure *b)
+{
+  if (a->white != b->white)
+    return a->white < b->white ? -1 : 1;
+  if (a->black != b->black)
+    return a->black < b->black ? -1 : 1;
+  return 0;
+}
+
+/* Jaccard similarity of the pawn sets, two empty structures are equal */
+static float4
+pawnstructure_similarity_internal(PawnStructure *a, PawnStructure *b)
+{
+  int common = pg_popcount64(a->white & b->white) +
+    pg_popcount64(a->black & b->black);
+  int all = pg_popcount64(a->white | b->white) +
+    pg_popcount64(a->black | b->black);
+
+  return all == 0 ? 1.0 : (float4) common / all;
+}
+
+PG_FUNCTION_INFO_V1(pawnstructure_eq);
+Datum
+pawnstructure_eq(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pawnstructure_cmp_internal(PG_GETARG_PawnStructure_P(0),
+    PG_GETARG_PawnStructure_P(1)) == 0);
+}
+
+PG_FUNCTION_INFO_V1(pawnstructure_ne);
+Datum
+pawnstructure_ne(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pawnstructure_cmp_internal(PG_GETARG_PawnStructure_P(0),
+    PG_GETARG_PawnStructure_P(1)) != 0);
+}
+
+PG_FUNCTION_INFO_V1(pawnstructure_lt);
+Datum
+pawnstructure_lt(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pawnstructure_cmp_internal(PG_GETARG_PawnStructure_P(0),
+    PG_GETARG_PawnStructure_P(1)) < 0);
+}
+
+PG_FUNCTION_INFO_V1(pawnstructure_le);
+Datum
+pawnstructure_le(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pawnstructure_cmp_internal(PG_GETARG_PawnStructure_P(0),
+    PG_GETARG_PawnStructure_P(1)) <= 0);
+}
+
+PG_FUNCTION_INFO_V1(pawnstructure_gt);
+Datum
+pawnstructure_gt(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pawnstructure_cmp_internal(PG_GETARG_PawnStructure_P(0),
+    PG_GETARG_PawnStructure_P(1)) > 0);
+}
+
+PG_FUNCTION_INFO_V1(pawnstructure_ge);
+Datum
+pawnstructure_ge(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pawnstructure_cmp_internal(PG_GETARG_PawnStructure_P(0),
+    PG_GETARG_PawnStructure_P(1)) >= 0);
+}
+
+PG_FUNCTION_INFO_V1(pawnstructure_cmp);
+Datum
+pawnstructure_cmp(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_INT32(pawnstructure_cmp_internal(PG_GETARG_PawnStructure_P(0),
+    PG_GETARG_PawnStructure_P(1)));
+}
+
+PG_FUNCTION_INFO_V1(pawnstructure_hash);
+Datum
+pawnstructure_hash(PG_FUNCTION_ARGS)
+{
+  PawnStructure *ps = PG_GETARG_PawnStructure_P(0);
+
+  return hash_any((unsigned char *) ps, sizeof(PawnStructure));
+}
+
+PG_FUNCTION_INFO_V1(pawnstructure_similarity);
+Datum
+pawnstructure_similarity(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_FLOAT4(pawnstructure_similarity_internal(
+    PG_GETARG_PawnStructure_P(0), PG_GETARG_PawnStructure_P(1)));
+}
+
+PG_FUNCTION_INFO_V1(pawnstructure_similar);
+Datum
+pawnstructure_similar(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pawnstructure_similarity_internal(
+    PG_GETARG_PawnStructure_P(0), PG_GETARG_PawnStructure_P(1)) >=
+    pawnSimilarityThreshold);
+}
+
+/* GIN keys are the pawns: square, plus 64 for black */
+static Datum *
+pawnstructure_gin_keys(PawnStructure *ps, int32 *nkeys)
+{
+  Datum *keys = palloc(sizeof(Datum) * 2 * SCL_BOARD_SQUARES);
+
+  *nkeys = 0;
+  for (int i = 0; i < SCL_BOARD_SQUARES; i++)
+  {
+    if (ps->white & (UINT64CONST(1) << i))
+      keys[(*nkeys)++] = Int16GetDatum(i);
+    if (ps->black & (UINT64CONST(1) << i))
+      keys[(*nkeys)++] = Int16GetDatum(SCL_BOARD_SQUARES + i);
+  }
+  return keys;
+}
+
+PG_FUNCTION_INFO_V1(pawnstructure_gin_extract_value);
+Datum
+pawnstructure_gin_extract_value(PG_FUNCTION_ARGS)
+{
+  PawnStructure *ps = PG_GETARG_PawnStructure_P(0);
+  int32 *nkeys = (int32 *) PG_GETARG_POINTER(1);
+
+  PG_RETURN_POINTER(pawnstructure_gin_keys(ps, nkeys));
+}
+
+PG_FUNCTION_INFO_V1(pawnstructure_gin_extract_query);
+Datum
+pawnstructure_gin_extract_query(PG_FUNCTION_ARGS)
+{
+  PawnStructure *ps = PG_GETARG_PawnStructure_P(0);
+  int32 *nkeys = (int32 *) PG_GETARG_POINTER(1);
+  StrategyNumber strategy = PG_GETARG_UINT16(2);
+  int32 *searchMode = (int32 *) PG_GETARG_POINTER(6);
+  Datum *keys = pawnstructure_gin_keys(ps, nkeys);
+
+  /* With a zero threshold values sharing no pawn are similar too */
+  if (*nkeys == 0 ||
+      (strategy == PAWN_STRATEGY_SIMILAR && pawnSimilarityThreshold <= 0.0))
+    *searchMode = GIN_SEARCH_MODE_ALL;
+  PG_RETURN_POINTER(keys);
+}
+
+/*
+ * For similarity a value containing ntrue of the query's pawns can at best
+ * reach ntrue / nkeys (when it has no other pawns), as in pg_trgm.
+ */
+PG_FUNCTION_INFO_V1(pawnstructure_gin_consistent);
+Datum
+pawnstructure_gin_consistent(PG_FUNCTION_ARGS)
+{
+  bool *check = (bool *) PG_GETARG_POINTER(0);
+  StrategyNumber strategy = PG_GETARG_UINT16(1);
+  int32 nkeys = PG_GETARG_INT32(3);
+  bool *recheck = (bool *) PG_GETARG_POINTER(5);
+  int ntrue = 0;
+
+  *recheck = true;
+  for (int i = 0; i < nkeys; i++)
+    if (check[i])
+      ntrue++;
+
+  switch (strategy)
+  {
+    case PAWN_STRATEGY_EQUAL:
+      PG_RETURN_BOOL(ntrue == nkeys);
+    case PAWN_STRATEGY_SIMILAR:
+      PG_RETURN_BOOL(nkeys == 0 ||
+        (float4) ntrue / nkeys >= pawnSimilarityThreshold);
+    default:
+      elog(ERROR, "unrecognized strategy number: %d", strategy);
+  }
+  PG_RETURN_BOOL(false);
+}
+
+/*****************************************************************************/
+/* Position containment and BRIN bloom summaries */
+
+/* Whether the game reaches the position at any ply, start included */
+PG_FUNCTION_INFO_V1(chessgame_has_position);
+Datum
+chessgame_has_position(PG_FUNCTION_ARGS)
+{
+  ChessReplayMemo *memo = chess_replay_get(fcinfo, PG_GETARG_DATUM(0));
+  SCL_Board *position = PG_GETARG_ChessBoard_P(1);
+  bool result = false;
+  int i;
+  instr_time start;
+
+  chess_stats_start(&start);
+  for (i = 0; i <= memo->length && !result; i++)
+    result = !SCL_boardsDiffer(*chess_replay_board(memo, i), *position);
+  chess_stats_count(CHESS_STAT_BOARDS_COMPARED, i);
+  chess_stats_end(CHESS_FN_HAS_POSITION, &start);
+  PG_RETURN_BOOL(result);
+}
+
+/*
+ * Set of target positions probed at every ply of a single replay, chained
+ * by SCL_boardHash32. The set is kept in fn_extra with a copy of the array
+ * it was built from, and rebuilt when called with another array.
+ */
+typedef struct
+{
+  MemoryContext cxt;       /* holds the set and everything below */
+  ArrayType  *source;
+  int         nboards;
+  SCL_Board  *boards;
+  uint32     *hashes;
+  int32      *subscripts;  /* array subscript of each board */
+  int32      *next;        /* next board in the same bucket, -1 at the end */
+  int32      *buckets;     /* first board of each bucket, -1 if empty */
+  uint32      mask;
+} ChessBoardSet;
+
+/* Called for each match; returning false stops the replay */
+typedef bool (*ChessBoardSetCallback) (int subscript, int ply, void *arg);
+
+static ChessBoardSet *
+chess_board_set_build(MemoryContext cxt, ArrayType *arr)
+{
+  ChessBoardSet *set;
+  Datum      *elems;
+  bool       *nulls;
+  int         n;
+  int16       typlen;
+  bool        typbyval;
+  char        typalign;
+  int         nbuckets;
+
+  if (ARR_NDIM(arr) > 1)
+    ereport(ERROR, (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+      errmsg("chessboard array must be one-dimensional")));
+  get_typlenbyvalalign(ARR_ELEMTYPE(arr), &typlen, &typbyval, &typalign);
+  deconstruct_array(arr, ARR_ELEMTYPE(arr), typlen, typbyval, typalign,
+    &elems, &nulls, &n);
+
+  nbuckets = pg_nextpower2_32(Max(n, 4) * 2);
+  set = MemoryContextAllocZero(cxt, sizeof(ChessBoardSet));
+  set->cxt = cxt;
+  set->source = MemoryContextAlloc(cxt, VARSIZE(arr));
+  memcpy(set->source, arr, VARSIZE(arr));
+  set->boards = MemoryContextAlloc(cxt, sizeof(SCL_Board) * Max(n, 1));
+  set->hashes = MemoryContextAlloc(cxt, sizeof(uint32) * Max(n, 1));
+  set->subscripts = MemoryContextAlloc(cxt, sizeof(int32) * Max(n, 1));
+  set->next = MemoryContextAlloc(cxt, sizeof(int32) * Max(n, 1));
+  set->buckets = MemoryContextAlloc(cxt, sizeof(int32) * nbuckets);
+  set->mask = nbuckets - 1;
+  memset(set->buckets, -1, sizeof(int32) * nbuckets);
+
+  for (int i = 0; i < n; i++)
+  {
+    int         j = set->nboards;
+    uint32      bucket;
+
+    if (nulls[i])
+      continue;
+    SCL_boardCopy(*DatumGetChessBoardP(elems[i]), set->boards[j]);
+    set->hashes[j] = SCL_boardHash32(set->boards[j]);
+    set->subscripts[j] = ARR_NDIM(arr) > 0 ? ARR_LBOUND(arr)[0] + i : i + 1;
+    bucket = set->hashes[j] & set->mask;
+    set->next[j] = set->buckets[bucket];
+    set->buckets[bucket] = j;
+    set->nboards++;
+  }
+  pfree(elems);
+  pfree(nulls);
+  return set;
+}
+
+static ChessBoardSet *
+chess_board_set_get(FunctionCallInfo fcinfo, int argno)
+{
+  ChessBoardSet *set = (ChessBoardSet *) fcinfo->flinfo->fn_extra;
+  ArrayType  *arr = PG_GETARG_ARRAYTYPE_P(argno);
+
+  if (set != NULL && VARSIZE(set->source) == VARSIZE(arr) &&
+      memcmp(set->source, arr, VARSIZE(arr)) == 0)
+    return set;
+  if (set != NULL)
+    MemoryContextDelete(set->cxt);
+  set = chess_board_set_build(AllocSetContextCreate(fcinfo->flinfo->fn_mcxt,
+    "chessboard set", ALLOCSET_SMALL_SIZES), arr);
+  fcinfo->flinfo->fn_extra = set;
+  return set;
+}
+
+/*
+ * Replays the game once, start position included, and reports every target
+ * position reached. Boards are only compared on a hash match.
+ */
+static void
+chess_board_set_replay(ChessBoardSet *set, SCL_Record *r,
+  ChessBoardSetCallback callback, void *arg)
+{
+  int         length = SCL_recordLength(*r);
+  SCL_Board   board;
+  uint64      compared = 0;
+  int         ply;
+
+  SCL_boardInit(board);
+  for (ply = 0; set->nboards > 0; ply++)
+  {
+    uint32      hash = SCL_boardHash32(board);
+    uint8_t     s0, s1;
+    char        p;
+
+    for (int i = set->buckets[hash & set->mask]; i >= 0; i = set->next[i])
+    {
+      if (set->hashes[i] != hash)
+        continue;
+      compared++;
+      if (!SCL_boardsDiffer(board, set->boards[i]) &&
+          !callback(set->subscripts[i], ply, arg))
+        goto done;
+    }
+    if (ply == length)
+      break;
+    SCL_recordGetMove(*r, ply, &s0, &s1, &p);
+    SCL_boardMakeMove(board, s0, s1, p);
+  }
+done:
+  chess_stats_count(CHESS_STAT_PLIES_APPLIED, ply);
+  chess_stats_count(CHESS_STAT_BOARDS_COMPARED, compared);
+}
+
+static bool
+has_any_board_match(int subscript, int ply, void *arg)
+{
+  *(bool *) arg = true;
+  return false;
+}
+
+PG_FUNCTION_INFO_V1(hasAnyBoard);
+Datum
+hasAnyBoard(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  ChessBoardSet *set = chess_board_set_get(fcinfo, 1);
+  bool        result = false;
+
+  chess_board_set_replay(set, c, has_any_board_match, &result);
+  pfree(c);
+  PG_RETURN_BOOL(result);
+}
+
+static bool
+matching_boards_row(int subscript, int ply, void *arg)
+{
+  ReturnSetInfo *rsinfo = (ReturnSetInfo *) arg;
+  Datum       values[2];
+  bool        nulls[2] = {false, false};
+
+  values[0] = Int32GetDatum(subscript);
+  values[1] = Int32GetDatum(ply);
+  tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+  return true;
+}
+
+PG_FUNCTION_INFO_V1(matchingBoards);
+Datum
+matchingBoards(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  ChessBoardSet *set = chess_board_set_get(fcinfo, 1);
+
+  InitMaterializedSRF(fcinfo, 0);
+  chess_board_set_replay(set, c, matching_boards_row, fcinfo->resultinfo);
+  pfree(c);
+  return (Datum) 0;
+}
+
+/*****************************************************************************/
+/* Move patterns */
+
+/*
+ * A move pattern is a list of steps that must be matched by plies of the
+ * game in that order, with any number of plies in between:
+ *
+ *   [w:|b:][piece][square][-|x]square[=promotion][@plies]   or   O-O, O-O-O
+ *
+ * Squares may use ? for any file or rank (e?, ?7, ??), a bare piece letter
+ * stands for any move of that piece, and plies is a 1-based ply number N, a
+ * range N-M, <N or >N. For example "Nf5@<20" is a knight landing on f5
+ * before ply 20, "K@<10" an early king move and "b:O-O-O" black castling
+ * long.
+ *
+ * Patterns are compiled once per query into the steps below and matched
+ * greedily over the record bytes, which is exact since a step only depends
+ * on its own ply. The game is replayed, through the replay memo, only for
+ * steps that need piece identity: a piece letter, a capture, a promotion
+ * or castling.
+ */
+typedef struct
+{
+  uint64      from;       /* squares the move may start from */
+  uint64      to;         /* squares the move may end on */
+  int         color;      /* 0 white, 1 black, -1 either */
+  char        piece;      /* upper case piece letter, 0 for any */
+  char        promotion;  /* lower case piece letter, 0 for any */
+  bool        capture;
+  int         minPly;     /* 1-based, inclusive */
+  int         maxPly;
+} ChessPatternStep;
+
+typedef struct
+{
+  text       *source;
+  int         nsteps;
+  ChessPatternStep steps[FLEXIBLE_ARRAY_MEMBER];
+} ChessPattern;
+
+#define CHESS_FILE_MASK(f) (UINT64CONST(0x0101010101010101) << (f))
+#define CHESS_RANK_MASK(r) (UINT64CONST(0xff) << ((r) * 8))
+
+static bool
+chess_pattern_square(char **p, uint64 *mask)
+{
+  char       *c = *p;
+  uint64      files, ranks;
+
+  if (*c >= 'a' && *c <= 'h')
+    files = CHESS_FILE_MASK(*c - 'a');
+  else if (*c == '?')
+    files = PG_UINT64_MAX;
+  else
+    return false;
+  c++;
+  if (*c >= '1' && *c <= '8')
+    ranks = CHESS_RANK_MASK(*c - '1');
+  else if (*c == '?')
+    ranks = PG_UINT64_MAX;
+  else
+    return false;
+  *mask = files & ranks;
+  *p = c + 1;
+  return true;
+}
+
+static void
+chess_pattern_plies(char **p, ChessPatternStep *step)
+{
+  char       *c = *p;
+  char       *end;
+  long        n;
+
+  if (*c == '<' || *c == '>')
+  {
+    char        op = *c++;
+
+    n = strtol(c, &end, 10);
+    if (end == c || n < 1 || n > SCL_RECORD_MAX_LENGTH)
+      ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+        errmsg("invalid ply in move pattern at \"%s\"", *p)));
+    if (op == '<')
+      step->maxPly = n - 1;
+    else
+      step->minPly = n + 1;
+  }
+  else
+  {
+    n = strtol(c, &end, 10);
+    if (end == c || n < 1 || n > SCL_RECORD_MAX_LENGTH)
+      ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+        errmsg("invalid ply in move pattern at \"%s\"", *p)));
+    step->minPly = step->maxPly = n;
+    if (*end == '-')
+    {
+      c = end + 1;
+      n = strtol(c, &end, 10);
+      if (end == c || n < step->minPly || n > SCL_RECORD_MAX_LENGTH)
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+          errmsg("invalid ply range in move pattern at \"%s\"", *p)));
+      step->maxPly = n;
+    }
+  }
+  *p = end;
+}
+
+static void
+chess_pattern_step(char *token, ChessPatternStep *step)
+{
+  char       *c = token;
+  uint64      first, second;
+
+  step->from = step->to = PG_UINT64_MAX;
+  step->color = -1;
+  step->piece = 0;
+  step->promotion = 0;
+  step->capture = false;
+  step->minPly = 1;
+  step->maxPly = SCL_RECORD_MAX_LENGTH;
+
+  if ((c[0] == 'w' || c[0] == 'b') && c[1] == ':')
+  {
+    step->color = c[0] == 'w' ? 0 : 1;
+    c += 2;
+  }
+
+  if (strncmp(c, "O-O-O", 5) == 0 || strncmp(c, "0-0-0", 5) == 0 ||
+      strncmp(c, "O-O", 3) == 0 || strncmp(c, "0-0", 3) == 0)
+  {
+    bool        queenside = c[3] == '-';
+
+    step->piece = 'K';
+    step->from = CHESS_FILE_MASK(4) & (CHESS_RANK_MASK(0) | CHESS_RANK_MASK(7));
+    step->to = CHESS_FILE_MASK(queenside ? 2 : 6) &
+      (CHESS_RANK_MASK(0) | CHESS_RANK_MASK(7));
+    c += queenside ? 5 : 3;
+  }
+  else
+  {
+    if (*c != '\0' && strchr("KQRBNP", *c) != NULL)
+      step->piece = *c++;
+    if (*c == 'x')
+    {
+      step->capture = true;
+      c++;
+    }
+    if (!chess_pattern_square(&c, &first))
+    {
+      /* a bare piece letter matches any move of that piece */
+      if (step->piece == 0 || step->capture)
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+          errmsg("invalid move pattern step \"%s\"", token)));
+    }
+    else if (*c == '-' || *c == 'x')
+    {
+      step->capture |= *c == 'x';
+      c++;
+      if (!chess_pattern_square(&c, &second))
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+          errmsg("invalid move pattern step \"%s\"", token)));
+      step->from = first;
+      step->to = second;
+    }
+    else if (chess_pattern_square(&c, &second))
+    {
+      step->from = first;
+      step->to = second;
+    }
+    else
+      step->to = first;
+
+    if (*c == '=')
+    {
+      c++;
+      if (*c == '\0' || strchr("QRBNqrbn", *c) == NULL)
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+          errmsg("invalid promotion in move pattern step \"%s\"", token)));
+      step->promotion = pg_tolower((unsigned char) *c++);
+    }
+  }
+
+  if (*c == '@')
+  {
+    c++;
+    chess_pattern_plies(&c, step);
+  }
+  if (*c != '\0')
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+      errmsg("invalid move pattern step \"%s\"", token)));
+}
+
+static ChessPattern *
+chess_pattern_compile(MemoryContext cxt, text *source)
+{
+  char       *str = text_to_cstring(source);
+  char       *token;
+  char       *saveptr;
+  int         nsteps = 0;
+  ChessPattern *pattern;
+
+  for (char *c = str; *c != '\0'; c++)
+    if (!p_whitespace_char(*c) && (c == str || p_whitespace_char(c[-1])))
+      nsteps++;
+
+  pattern = MemoryContextAllocZero(cxt, offsetof(ChessPattern, steps) +
+    sizeof(ChessPatternStep) * nsteps);
+  for (token = strtok_r(str, " \t\r\n", &saveptr); token != NULL;
+       token = strtok_r(NULL, " \t\r\n", &saveptr))
+    chess_pattern_step(token, &pattern->steps[pattern->nsteps++]);
+
+  pattern->source = MemoryContextAlloc(cxt, VARSIZE_ANY(source));
+  memcpy(pattern->source, source, VARSIZE_ANY(source));
+  pfree(str);
+  return pattern;
+}
+
+static ChessPattern *
+chess_pattern_get(FunctionCallInfo fcinfo, text *source)
+{
+  ChessPattern *pattern = (ChessPattern *) fcinfo->flinfo->fn_extra;
+
+  if (pattern != NULL &&
+      VARSIZE_ANY_EXHDR(pattern->source) == VARSIZE_ANY_EXHDR(source) &&
+      memcmp(VARDATA_ANY(pattern->source), VARDATA_ANY(source),
+        VARSIZE_ANY_EXHDR(source)) == 0)
+    return pattern;
+  if (pattern != NULL)
+  {
+    pfree(pattern->source);
+    pfree(pattern);
+  }
+  pattern = chess_pattern_compile(fcinfo->flinfo->fn_mcxt, source);
+  fcinfo->flinfo->fn_extra = pattern;
+  return pattern;
+}
+
+static bool
+chess_pattern_match(ChessPattern *pattern, ChessReplayMemo *memo)
+{
+  int         next = 0;
+
+  for (int i = 0; i < memo->length && next < pattern->nsteps; i++)
+  {
+    ChessPatternStep *step = &pattern->steps[next];
+    uint8_t     from = memo->record[i * 2] & 0x3f;
+    uint8_t     to = memo->record[i * 2 + 1] & 0x3f;
+
+    if (i + 1 > step->maxPly)
+      return false;
+    if (i + 1 < step->minPly ||
+        (step->color >= 0 && step->color != i % 2) ||
+        (step->from & (UINT64CONST(1) << from)) == 0 ||
+        (step->to & (UINT64CONST(1) << to)) == 0)
+      continue;
+
+    if (step->piece != 0 || step->capture || step->promotion != 0)
+    {
+      char       *board = *chess_replay_board(memo, i);
+      char        piece = pg_toupper((unsigned char) board[from]);
+      uint8_t     s0, s1;
+      char        promotion;
+
+      if (step->piece != 0 && piece != step->piece)
+        continue;
+      /* a pawn moving diagonally to an empty square takes en passant */
+      if (step->capture && board[to] == '.' &&
+          !(piece == 'P' && from % 8 != to % 8))
+        continue;
+      if (step->promotion != 0)
+      {
+        SCL_recordGetMove(memo->record, i, &s0, &s1, &promotion);
+        if (piece != 'P' || (to / 8 != 0 && to / 8 != 7) ||
+            promotion != step->promotion)
+          continue;
+      }
+    }
+    next++;
+  }
+  return next == pattern->nsteps;
+}
+
+PG_FUNCTION_INFO_V1(chessgame_matches);
+Datum
+chessgame_matches(PG_FUNCTION_ARGS)
+{
+  ChessPattern *pattern = chess_pattern_get(fcinfo, PG_GETARG_TEXT_PP(1));
+  ChessReplayMemo *memo = chess_replay_get(fcinfo, PG_GETARG_DATUM(0));
+
+  PG_RETURN_BOOL(chess_pattern_match(pattern, memo));
+}
+
+/*****************************************************************************/
+/* Move n-gram GIN index */
+
+/*
+ * Games are indexed by every run of CHESS_NGRAM consecutive moves, the item
+ * keys of the moves packed into an int8. A move sequence can only occur in
+ * games holding all of its own n-grams; sequences shorter than that scan
+ * the whole index. Keys ignore promotion pieces and where the run occurs,
+ * so matches are always rechecked.
+ */
+#define CHESS_NGRAM 3
+
+static Datum *
+chessgame_ngram_keys(SCL_Record *r, int length, int32 *nkeys)
+{
+  int n = Max(length - CHESS_NGRAM + 1, 0);
+  Datum *keys = palloc(sizeof(Datum) * Max(n, 1));
+
+  for (int i = 0; i < n; i++)
+  {
+    int64 key = 0;
+
+    for (int j = 0; j < CHESS_NGRAM; j++)
+      key = (key << 12) | chessgame_item_key(*r + (i + j) * 2);
+    keys[i] = Int64GetDatum(key);
+  }
+  *nkeys = n;
+  return keys;
+}
+
+/* Whether the moves occur consecutively anywhere in the game */
+static bool
+chessgame_contains_moves_internal(SCL_Record *c, SCL_Record *moves)
+{
+  int length = SCL_recordLength(*c);
+  int n = SCL_recordLength(*moves);
+
+  for (int i = 0; i + n <= length; i++)
+  {
+    int j;
+
+    for (j = 0; j < n; j++)
+    {
+      const uint8_t *a = *c + (i + j) * 2;
+      const uint8_t *b = *moves + j * 2;
+
+      /* the first byte also holds end flags, the second the promotion */
+      if ((a[0] & 0x3f) != (b[0] & 0x3f) || a[1] != b[1])
+        break;
+    }
+    if (j == n)
+      return true;
+  }
+  return false;
+}
+
+PG_FUNCTION_INFO_V1(chessgame_contains_moves);
+Datum
+chessgame_contains_moves(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  SCL_Record *moves = chessgame_parse_uci(
+    text_to_cstring(PG_GETARG_TEXT_PP(1)), false);
+  bool result = chessgame_contains_moves_internal(c, moves);
+
+  pfree(c);
+  pfree(moves);
+  PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_ngram_extract_value);
+Datum
+chessgame_ngram_extract_value(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  int32 *nkeys = (int32 *) PG_GETARG_POINTER(1);
+
+  PG_RETURN_POINTER(chessgame_ngram_keys(c, SCL_recordLength(*c), nkeys));
+}
+
+PG_FUNCTION_INFO_V1(chessgame_ngram_extract_query);
+Datum
+chessgame_ngram_extract_query(PG_FUNCTION_ARGS)
+{
+  SCL_Record *moves = chessgame_parse_uci(
+    text_to_cstring(PG_GETARG_TEXT_PP(0)), false);
+  int32 *nkeys = (int32 *) PG_GETARG_POINTER(1);
+  int32 *searchMode = (int32 *) PG_GETARG_POINTER(6);
+  Datum *keys = chessgame_ngram_keys(moves, SCL_recordLength(*moves), nkeys);
+
+  /* Too short to hold an n-gram, every game is a candidate */
+  if (*nkeys == 0)
+    *searchMode = GIN_SEARCH_MODE_ALL;
+  PG_RETURN_POINTER(keys);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_ngram_consistent);
+Datum
+chessgame_ngram_consistent(PG_FUNCTION_ARGS)
+{
+  bool *check = (bool *) PG_GETARG_POINTER(0);
+  int32 nkeys = PG_GETARG_INT32(3);
+  bool *recheck = (bool *) PG_GETARG_POINTER(5);
+
+  *recheck = true;
+  for (int i = 0; i < nkeys; i++)
+    if (!check[i])
+      PG_RETURN_BOOL(false);
+  PG_RETURN_BOOL(true);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_ngram_triconsistent);
+Datum
+chessgame_ngram_triconsistent(PG_FUNCTION_ARGS)
+{
+  GinTernaryValue *check = (GinTernaryValue *) PG_GETARG_POINTER(0);
+  int32 nkeys = PG_GETARG_INT32(3);
+
+  for (int i = 0; i < nkeys; i++)
+    if (check[i] == GIN_FALSE)
+      PG_RETURN_GIN_TERNARY_VALUE(GIN_FALSE);
+  PG_RETURN_GIN_TERNARY_VALUE(GIN_MAYBE);
+}
+
+/*****************************************************************************/
+/* Bitmap signatures */
+
+/*
+ * GiST keys of the nearest-neighbour opclasses are bitmaps in a bytea. An
+ * inner key is the OR of the keys below it, so these support functions are
+ * shared by every signature opclass whatever the bitmap length.
+ */
+#define CHESS_SIG_DATA(sig) ((uint8 *) VARDATA(sig))
+#define CHESS_SIG_LEN(sig) (VARSIZE(sig) - VARHDRSZ)
+#define CHESS_SIG_SET(sig, bit) \
+  (CHESS_SIG_DATA(sig)[(bit) / 8] |= 1 << ((bit) % 8))
+#define CHESS_SIG_TEST(sig, bit) \
+  ((CHESS_SIG_DATA(sig)[(bit) / 8] >> ((bit) % 8)) & 1)
+
+static bytea *
+chess_sig_new(int len)
+{
+  bytea      *sig = palloc0(VARHDRSZ + len);
+
+  SET_VARSIZE(sig, VARHDRSZ + len);
+  return sig;
+}
+
+static int
+chess_sig_hamming(bytea *a, bytea *b)
+{
+  uint8      *x = CHESS_SIG_DATA(a);
+  uint8      *y = CHESS_SIG_DATA(b);
+  int         dist = 0;
+
+  for (int i = 0; i < CHESS_SIG_LEN(a); i++)
+    dist += pg_number_of_ones[x[i] ^ y[i]];
+  return dist;
+}
+
+static void
+chess_sig_union(bytea *into, bytea *sig)
+{
+  uint8      *x = CHESS_SIG_DATA(into);
+  uint8      *y = CHESS_SIG_DATA(sig);
+
+  for (int i = 0; i < CHESS_SIG_LEN(into); i++)
+    x[i] |= y[i];
+}
+
+static GISTENTRY *
+chess_sig_entry(GISTENTRY *entry, bytea *sig)
+{
+  GISTENTRY  *retval = palloc(sizeof(GISTENTRY));
+
+  gistentryinit(*retval, PointerGetDatum(sig), entry->rel, entry->page,
+    entry->offset, false);
+  return retval;
+}
+
+PG_FUNCTION_INFO_V1(chess_signature_union);
+Datum
+chess_signature_union(PG_FUNCTION_ARGS)
+{
+  GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+  int        *size = (int *) PG_GETARG_POINTER(1);
+  bytea      *first = (bytea *) DatumGetPointer(entryvec->vector[0].key);
+  bytea      *result = chess_sig_new(CHESS_SIG_LEN(first));
+
+  for (int i = 0; i < entryvec->n; i++)
+    chess_sig_union(result, (bytea *) DatumGetPointer(entryvec->vector[i].key));
+  *size = VARSIZE(result);
+  PG_RETURN_POINTER(result);
+}
+
+PG_FUNCTION_INFO_V1(chess_signature_same);
+Datum
+chess_signature_same(PG_FUNCTION_ARGS)
+{
+  bytea      *a = (bytea *) PG_GETARG_POINTER(0);
+  bytea      *b = (bytea *) PG_GETARG_POINTER(1);
+  bool       *result = (bool *) PG_GETARG_POINTER(2);
+
+  *result = VARSIZE(a) == VARSIZE(b) &&
+    memcmp(CHESS_SIG_DATA(a), CHESS_SIG_DATA(b), CHESS_SIG_LEN(a)) == 0;
+  PG_RETURN_POINTER(result);
+}
+
+/* Number of new bits the signature would add to the subtree */
+PG_FUNCTION_INFO_V1(chess_signature_penalty);
+Datum
+chess_signature_penalty(PG_FUNCTION_ARGS)
+{
+  GISTENTRY  *origentry = (GISTENTRY *) PG_GETARG_POINTER(0);
+  GISTENTRY  *newentry = (GISTENTRY *) PG_GETARG_POINTER(1);
+  float      *penalty = (float *) PG_GETARG_POINTER(2);
+  bytea      *orig = (bytea *) DatumGetPointer(origentry->key);
+  bytea      *sig = (bytea *) DatumGetPointer(newentry->key);
+  uint8      *x = CHESS_SIG_DATA(orig);
+  uint8      *y = CHESS_SIG_DATA(sig);
+  int         added = 0;
+
+  for (int i = 0; i < CHESS_SIG_LEN(orig); i++)
+    added += pg_number_of_ones[y[i] & ~x[i]];
+  *penalty = added;
+  PG_RETURN_POINTER(penalty);
+}
+
+/*
+ * Seeds the two pages with the most distant pair of signatures, then sends
+ * each entry to the page whose union it is closest to.
+ */
+PG_FUNCTION_INFO_V1(chess_signature_picksplit);
+Datum
+chess_signature_picksplit(PG_FUNCTION_ARGS)
+{
+  GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+  GIST_SPLITVEC *v = (GIST_SPLITVEC *) PG_GETARG_POINTER(1);
+  OffsetNumber maxoff = entryvec->n - 1;
+  OffsetNumber seedl = FirstOffsetNumber;
+  OffsetNumber seedr = OffsetNumberNext(FirstOffsetNumber);
+  bytea      *unionl;
+  bytea      *unionr;
+  int         worst = -1;
+
+#define SIG_AT(i) ((bytea *) DatumGetPointer(entryvec->vector[i].key))
+
+  for (OffsetNumber i = FirstOffsetNumber; i < maxoff; i = OffsetNumberNext(i))
+    for (OffsetNumber j = OffsetNumberNext(i); j <= maxoff;
+         j = OffsetNumberNext(j))
+    {
+      int         d = chess_sig_hamming(SIG_AT(i), SIG_AT(j));
+
+      if (d > worst)
+      {
+        worst = d;
+        seedl = i;
+        seedr = j;
+      }
+    }
+
+  v->spl_left = palloc(sizeof(OffsetNumber) * entryvec->n);
+  v->spl_right = palloc(sizeof(OffsetNumber) * entryvec->n);
+  v->spl_nleft = v->spl_nright = 0;
+  unionl = chess_sig_new(CHESS_SIG_LEN(SIG_AT(seedl)));
+  unionr = chess_sig_new(CHESS_SIG_LEN(SIG_AT(seedr)));
+  chess_sig_union(unionl, SIG_AT(seedl));
+  chess_sig_union(unionr, SIG_AT(seedr));
+
+  for (OffsetNumber i = FirstOffsetNumber; i <= maxoff; i = OffsetNumberNext(i))
+  {
+    bool        left;
+
+    if (i == seedl)
+      left = true;
+    else if (i == seedr)
+      left = false;
+    else
+    {
+      int         dl = chess_sig_hamming(unionl, SIG_AT(i));
+      int         dr = chess_sig_hamming(unionr, SIG_AT(i));
+
+      left = dl < dr || (dl == dr && v->spl_nleft <= v->spl_nright);
+    }
+    if (left)
+    {
+      chess_sig_union(unionl, SIG_AT(i));
+      v->spl_left[v->spl_nleft++] = i;
+    }
+    else
+    {
+      chess_sig_union(unionr, SIG_AT(i));
+      v->spl_right[v->spl_nright++] = i;
+    }
+  }
+#undef SIG_AT
+
+  v->spl_ldatum = PointerGetDatum(unionl);
+  v->spl_rdatum = PointerGetDatum(unionr);
+  PG_RETURN_POINTER(v);
+}
+
+/* The signature opclasses only have an ordering operator */
+PG_FUNCTION_INFO_V1(chess_signature_consistent);
+Datum
+chess_signature_consistent(PG_FUNCTION_ARGS)
+{
+  bool       *recheck = (bool *) PG_GETARG_POINTER(4);
+
+  *recheck = true;
+  PG_RETURN_BOOL(true);
+}
+
+/*****************************************************************************/
+/* Game similarity */
+
+/*
+ * Games are compared by the Jaccard similarity of the sets of positions
+ * they reach, start included, each position taken as its SCL_boardHash32.
+ * The GiST opclass stores a CHESS_GAMESIG_LEN byte bitmap signature of the set
+ * and orders by a lower bound of the distance computed from signatures,
+ * rechecked on the heap tuple.
+ */
+#define CHESS_GAMESIG_LEN  256
+#define CHESS_GAMESIG_BIT(hash) \
+  (hash_bytes_uint32(hash) % (CHESS_GAMESIG_LEN * 8))
+
+static int
+chess_uint32_cmp(const void *a, const void *b)
+{
+  uint32 x = *(const uint32 *) a;
+  uint32 y = *(const uint32 *) b;
+
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Sorted distinct hashes of every position of the game */
+static uint32 *
+chessgame_position_hashes(SCL_Record *r, int *n)
+{
+  int         length = SCL_recordLength(*r);
+  uint32     *hashes = palloc(sizeof(uint32) * (length + 1));
+  SCL_Board   board;
+  int         unique = 0;
+
+  SCL_boardInit(board);
+  hashes[0] = SCL_boardHash32(board);
+  for (int i = 0; i < length; i++)
+  {
+    uint8_t     s0, s1;
+    char        p;
+
+    SCL_recordGetMove(*r, i, &s0, &s1, &p);
+    SCL_boardMakeMove(board, s0, s1, p);
+    hashes[i + 1] = SCL_boardHash32(board);
+  }
+  chess_stats_count(CHESS_STAT_PLIES_APPLIED, length);
+
+  qsort(hashes, length + 1, sizeof(uint32), chess_uint32_cmp);
+  for (int i = 0; i <= length; i++)
+    if (unique == 0 || hashes[i] != hashes[unique - 1])
+      hashes[unique++] = hashes[i];
+  *n = unique;
+  return hashes;
+}
+
+static float8
+chessgame_similarity_internal(SCL_Record *a, SCL_Record *b)
+{
+  int         na, nb;
+  uint32     *ha = chessgame_position_hashes(a, &na);
+  uint32     *hb = chessgame_position_hashes(b, &nb);
+  int         i = 0, j = 0, common = 0;
+
+  while (i < na && j < nb)
+  {
+    if (ha[i] == hb[j])
+    {
+      common++;
+      i++;
+      j++;
+    }
+    else if (ha[i] < hb[j])
+      i++;
+    else
+      j++;
+  }
+  pfree(ha);
+  pfree(hb);
+  return (float8) common / (na + nb - common);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_similarity);
+Datum
+chessgame_similarity(PG_FUNCTION_ARGS)
+{
+  SCL_Record *a = PG_GETARG_ChessGame_P(0);
+  SCL_Record *b = PG_GETARG_ChessGame_P(1);
+
+  PG_RETURN_FLOAT8(chessgame_similarity_internal(a, b));
+}
+
+PG_FUNCTION_INFO_V1(chessgame_distance);
+Datum
+chessgame_distance(PG_FUNCTION_ARGS)
+{
+  SCL_Record *a = PG_GETARG_ChessGame_P(0);
+  SCL_Record *b = PG_GETARG_ChessGame_P(1);
+
+  PG_RETURN_FLOAT8(1.0 - chessgame_similarity_internal(a, b));
+}
+
+PG_FUNCTION_INFO_V1(chessgame_gist_compress);
+Datum
+chessgame_gist_compress(PG_FUNCTION_ARGS)
+{
+  GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+  SCL_Record *r;
+  bytea      *sig;
+  uint32     *hashes;
+  int         n;
+
+  if (!entry->leafkey)
+    PG_RETURN_POINTER(entry);
+
+  r = chessgame_expand(fcinfo, entry->key);
+  hashes = chessgame_position_hashes(r, &n);
+  sig = chess_sig_new(CHESS_GAMESIG_LEN);
+  for (int i = 0; i < n; i++)
+    CHESS_SIG_SET(sig, CHESS_GAMESIG_BIT(hashes[i]));
+  pfree(hashes);
+  pfree(r);
+
+  PG_RETURN_POINTER(chess_sig_entry(entry, sig));
+}
+
+/* Signature bits of the query's positions, one per distinct position */
+typedef struct
+{
+  Size        rawlen;
+  char       *raw;
+  int         npositions;
+  uint32     *bits;
+} ChessGameQuery;
+
+static ChessGameQuery *
+chessgame_gist_query(FunctionCallInfo fcinfo, Datum datum)
+{
+  ChessGameQuery *query = (ChessGameQuery *) fcinfo->flinfo->fn_extra;
+  struct varlena *v = PG_DETOAST_DATUM_PACKED(datum);
+  Size        len = VARSIZE_ANY(v);
+  MemoryContext oldcxt;
+  SCL_Record *r;
+  uint32     *hashes;
+
+  if (query != NULL && query->rawlen == len &&
+      memcmp(query->raw, v, len) == 0)
+    return query;
+
+  if (query != NULL)
+  {
+    pfree(query->raw);
+    pfree(query->bits);
+    pfree(query);
+  }
+  oldcxt = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+  query = palloc(sizeof(ChessGameQuery));
+  query->rawlen = len;
+  query->raw = palloc(len);
+  memcpy(query->raw, v, len);
+  r = chessgame_expand(fcinfo, datum);
+  hashes = chessgame_position_hashes(r, &query->npositions);
+  query->bits = palloc(sizeof(uint32) * query->npositions);
+  for (int i = 0; i < query->npositions; i++)
+    query->bits[i] = CHESS_GAMESIG_BIT(hashes[i]);
+  pfree(hashes);
+  pfree(r);
+  MemoryContextSwitchTo(oldcxt);
+
+  fcinfo->flinfo->fn_extra = query;
+  return query;
+}
+
+/*
+ * Every position shared by the query and a game below this entry sets a
+ * query bit of the signature, so with k of the query's n positions having
+ * their bit set, the similarity is at most k / n. 1 - k / n bounds the
+ * distance from below; the exact distance is rechecked on the heap.
+ */
+PG_FUNCTION_INFO_V1(chessgame_gist_distance);
+Datum
+chessgame_gist_distance(PG_FUNCTION_ARGS)
+{
+  GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+  bool       *recheck = (bool *) PG_GETARG_POINTER(4);
+  ChessGameQuery *query = chessgame_gist_query(fcinfo, PG_GETARG_DATUM(1));
+  bytea      *sig = (bytea *) DatumGetPointer(entry->key);
+  int         found = 0;
+
+  for (int i = 0; i < query->npositions; i++)
+    found += CHESS_SIG_TEST(sig, query->bits[i]);
+
+  *recheck = true;
+  PG_RETURN_FLOAT8(1.0 - (float8) found / query->npositions);
+}
+
+/*****************************************************************************/
+/* Board distance */
+
+/*
+ * Distance between positions: one per square holding something different,
+ * plus terms for the side to move and each castling right that differs.
+ * The GiST signature of a board has a bit for the content of every square,
+ * the side to move and the presence or absence of each castling right, so
+ * a leaf signature describes the board exactly for this distance and an
+ * inner one gives a lower bound by counting the query features it lacks.
+ */
+#define CHESS_BOARD_DIST_TURN    1.0
+#define CHESS_BOARD_DIST_CASTLE  0.5
+
+#define CHESS_SQUARE_STATES  (CHESS_NPIECES + 1)
+#define CHESS_BOARDSIG_TURN  (SCL_BOARD_SQUARES * CHESS_SQUARE_STATES)
+#define CHESS_BOARDSIG_CASTLE (CHESS_BOARDSIG_TURN + 2)
+#define CHESS_BOARDSIG_LEN   ((CHESS_BOARDSIG_CASTLE + 8 + 7) / 8)
+
+/* Bit numbers of the features of a board, in the order described above */
+static void
+chessboard_features(const char *board, int *features)
+{
+  for (int i = 0; i < SCL_BOARD_SQUARES; i++)
+  {
+    int piece = chess_piece_index(board[i]);
+
+    features[i] = i * CHESS_SQUARE_STATES +
+      (piece < 0 ? CHESS_NPIECES : piece);
+  }
+  features[SCL_BOARD_SQUARES] = CHESS_BOARDSIG_TURN +
+    (SCL_boardWhitesTurn((char *) board) ? 0 : 1);
+  for (int k = 0; k < 4; k++)
+    features[SCL_BOARD_SQUARES + 1 + k] = CHESS_BOARDSIG_CASTLE + 2 * k +
+      ((board[SCL_BOARD_ENPASSANT_CASTLE_BYTE] >> (4 + k)) & 1);
+}
+
+#define CHESS_BOARD_FEATURES (SCL_BOARD_SQUARES + 5)
+
+static float8
+chessboard_feature_weight(int feature)
+{
+  if (feature < SCL_BOARD_SQUARES)
+    return 1.0;
+  if (feature == SCL_BOARD_SQUARES)
+    return CHESS_BOARD_DIST_TURN;
+  return CHESS_BOARD_DIST_CASTLE;
+}
+
+PG_FUNCTION_INFO_V1(chessboard_distance);
+Datum
+chessboard_distance(PG_FUNCTION_ARGS)
+{
+  SCL_Board *a = PG_GETARG_ChessBoard_P(0);
+  SCL_Board *b = PG_GETARG_ChessBoard_P(1);
+  int fa[CHESS_BOARD_FEATURES];
+  int fb[CHESS_BOARD_FEATURES];
+  float8 dist = 0;
+
+  chessboard_features(*a, fa);
+  chessboard_features(*b, fb);
+  for (int i = 0; i < CHESS_BOARD_FEATURES; i++)
+    if (fa[i] != fb[i])
+      dist += chessboard_feature_weight(i);
+  PG_RETURN_FLOAT8(dist);
+}
+
+PG_FUNCTION_INFO_V1(chessboard_gist_compress);
+Datum
+chessboard_gist_compress(PG_FUNCTION_ARGS)
+{
+  GISTENTRY *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+  int features[CHESS_BOARD_FEATURES];
+  bytea *sig;
+
+  if (!entry->leafkey)
+    PG_RETURN_POINTER(entry);
+
+  chessboard_features(*DatumGetChessBoardP(entry->key), features);
+  sig = chess_sig_new(CHESS_BOARDSIG_LEN);
+  for (int i = 0; i < CHESS_BOARD_FEATURES; i++)
+    CHESS_SIG_SET(sig, features[i]);
+  PG_RETURN_POINTER(chess_sig_entry(entry, sig));
+}
+
+/* Exact on leaves, a lower bound on inner pages: no recheck needed */
+PG_FUNCTION_INFO_V1(chessboard_gist_distance);
+Datum
+chessboard_gist_distance(PG_FUNCTION_ARGS)
+{
+  GISTENTRY *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+  SCL_Board *query = PG_GETARG_ChessBoard_P(1);
+  bool *recheck = (bool *) PG_GETARG_POINTER(4);
+  bytea *sig = (bytea *) DatumGetPointer(entry->key);
+  int features[CHESS_BOARD_FEATURES];
+  float8 dist = 0;
+
+  chessboard_features(*query, features);
+  for (int i = 0; i < CHESS_BOARD_FEATURES; i++)
+    if (!CHESS_SIG_TEST(sig, features[i]))
+      dist += chessboard_feature_weight(i);
+
+  *recheck = false;
+  PG_RETURN_FLOAT8(dist);
+}
+
+/*
+ * A block range is summarised by a Bloom filter of the hashes of all the
+ * positions its games reach. SCL_boardHash32 only depends on the board
+ * bytes so equal positions always set the same bits; it is remixed since
+ * its own output is poorly spread.
+ */
+#define CHESS_BLOOM_NHASHES       4
+#define CHESS_BLOOM_DEFAULT_BITS  16384
+#define CHESS_BLOOM_MIN_BITS      1024
+#define CHESS_BLOOM_MAX_BITS      32768
+
+#define CHESS_BLOOM_STRATEGY_POSITION 1
+
+typedef struct
+{
+  int32     vl_len_;        /* opclass options header */
+  int       bloomBits;
+} ChessBloomOptions;
+
+typedef struct
+{
+  int32     vl_len_;
+  uint32    nbits;
+  uint8     bits[FLEXIBLE_ARRAY_MEMBER];
+} ChessBloom;
+
+static ChessBloom *
+chess_bloom_init(uint32 nbits)
+{
+  Size len = offsetof(ChessBloom, bits) + nbits / 8;
+  ChessBloom *filter = palloc0(len);
+
+  SET_VARSIZE(filter, len);
+  filter->nbits = nbits;
+  return filter;
+}
+
+/* Double hashing as in lib/bloomfilter.c */
+static void
+chess_bloom_positions(ChessBloom *filter, uint32 hash, uint32 *bits)
+{
+  uint32 h1 = hash_bytes_uint32(hash);
+  uint32 h2 = hash_bytes_uint32(h1 ^ hash) | 1;
+
+  for (int i = 0; i < CHESS_BLOOM_NHASHES; i++)
+    bits[i] = (h1 + i * h2) % filter->nbits;
+}
+
+static bool
+chess_bloom_add(ChessBloom *filter, uint32 hash)
+{
+  uint32 bits[CHESS_BLOOM_NHASHES];
+  bool changed = false;
+
+  chess_bloom_positions(filter, hash, bits);
+  for (int i = 0; i < CHESS_BLOOM_NHASHES; i++)
+  {
+    uint8 mask = 1 << (bits[i] % 8);
+
+    if (!(filter->bits[bits[i] / 8] & mask))
+    {
+      filter->bits[bits[i] / 8] |= mask;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+static bool
+chess_bloom_contains(ChessBloom *filter, uint32 hash)
+{
+  uint32 bits[CHESS_BLOOM_NHASHES];
+
+  chess_bloom_positions(filter, hash, bits);
+  for (int i = 0; i < CHESS_BLOOM_NHASHES; i++)
+    if (!(filter->bits[bits[i] / 8] & (1 << (bits[i] % 8))))
+      return false;
+  return true;
+}
+
+PG_FUNCTION_INFO_V1(chessgame_brin_bloom_opcinfo);
+Datum
+chessgame_brin_bloom_opcinfo(PG_FUNCTION_ARGS)
+{
+  BrinOpcInfo *result = palloc0(MAXALIGN(SizeofBrinOpcInfo(1)));
+
+  result->oi_nstored = 1;
+  result->oi_regular_nulls = true;
+  result->oi_opaque = NULL;
+  result->oi_typcache[0] = lookup_type_cache(BYTEAOID, 0);
+  PG_RETURN_POINTER(result);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_brin_bloom_add_value);
+Datum
+chessgame_brin_bloom_add_value(PG_FUNCTION_ARGS)
+{
+  BrinValues *column = (BrinValues *) PG_GETARG_POINTER(1);
+  SCL_Record *c = PG_GETARG_ChessGame_P(2);
+  int length = SCL_recordLength(*c);
+  ChessBloom *filter;
+  SCL_Board board;
+  bool updated = false;
+
+  if (column->bv_allnulls)
+  {
+    int nbits = CHESS_BLOOM_DEFAULT_BITS;
+
+    if (PG_HAS_OPCLASS_OPTIONS())
+      nbits = ((ChessBloomOptions *) PG_GET_OPCLASS_OPTIONS())->bloomBits;
+    filter = chess_bloom_init(TYPEALIGN(8, nbits));
+    column->bv_values[0] = PointerGetDatum(filter);
+    column->bv_allnulls = false;
+    updated = true;
+  }
+  else
+    filter = (ChessBloom *) PG_DETOAST_DATUM(column->bv_values[0]);
+
+  SCL_boardInit(board);
+  updated |= chess_bloom_add(filter, SCL_boardHash32(board));
+  for (int i = 0; i < length; i++)
+  {
+    uint8_t s0, s1;
+    char p;
+
+    SCL_recordGetMove(*c, i, &s0, &s1, &p);
+    SCL_boardMakeMove(board, s0, s1, p);
+    updated |= chess_bloom_add(filter, SCL_boardHash32(board));
+  }
+  column->bv_values[0] = PointerGetDatum(filter);
+  pfree(c);
+  PG_RETURN_BOOL(updated);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_brin_bloom_consistent);
+Datum
+chessgame_brin_bloom_consistent(PG_FUNCTION_ARGS)
+{
+  BrinValues *column = (BrinValues *) PG_GETARG_POINTER(1);
+  ScanKey key = (ScanKey) PG_GETARG_POINTER(2);
+  ChessBloom *filter = (ChessBloom *) PG_DETOAST_DATUM(column->bv_values[0]);
+  SCL_Board *position;
+
+  switch (key->sk_strategy)
+  {
+    case CHESS_BLOOM_STRATEGY_POSITION:
+      position = DatumGetChessBoardP(key->sk_argument);
+      PG_RETURN_BOOL(chess_bloom_contains(filter,
+        SCL_boardHash32(*position)));
+    default:
+      elog(ERROR, "unrecognized strategy number: %d", key->sk_strategy);
+  }
+  PG_RETURN_BOOL(false);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_brin_bloom_union);
+Datum
+chessgame_brin_bloom_union(PG_FUNCTION_ARGS)
+{
+  BrinValues *col_a = (BrinValues *) PG_GETARG_POINTER(1);
+  BrinValues *col_b = (BrinValues *) PG_GETARG_POINTER(2);
+  ChessBloom *filter_a = (ChessBloom *) PG_DETOAST_DATUM(col_a->bv_values[0]);
+  ChessBloom *filter_b = (ChessBloom *) PG_DETOAST_DATUM(col_b->bv_values[0]);
+
+  if (filter_a->nbits != filter_b->nbits)
+    elog(ERROR, "chessgame bloom filters of different sizes");
+  for (uint32 i = 0; i < filter_a->nbits / 8; i++)
+    filter_a->bits[i] |= filter_b->bits[i];
+  col_a->bv_values[0] = PointerGetDatum(filter_a);
+  PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(chessgame_brin_bloom_options);
+Datum
+chessgame_brin_bloom_options(PG_FUNCTION_ARGS)
+{
+  local_relopts *relopts = (local_relopts *) PG_GETARG_POINTER(0);
+
+  init_local_reloptions(relopts, sizeof(ChessBloomOptions));
+  add_local_int_reloption(relopts, "bloom_bits",
+    "number of bits of the Bloom filter of each block range",
+    CHESS_BLOOM_DEFAULT_BITS, CHESS_BLOOM_MIN_BITS, CHESS_BLOOM_MAX_BITS,
+    offsetof(ChessBloomOptions, bloomBits));
+  PG_RETURN_VOID();
+}
+
+/*****************************************************************************/
+/* Planner statistics */
+
+/*
+ * Besides the standard scalar statistics ANALYZE keeps the most common
+ * opening prefixes (as item keys, up to CHESS_STATS_PREFIX_PLIES) and the
+ * most common positions (as SCL_boardHash32) of the sampled games, each
+ * with the fraction of games having them. As for MCELEM the numbers array
+ * carries one extra entry: the highest frequency a value missing from the
+ * list can have.
+ */
+#define STATISTIC_KIND_CHESS_PREFIX   10001
+#define STATISTIC_KIND_CHESS_POSITION 10002
+
+#define CHESS_STATS_PREFIX_PLIES 16
+
+/* Selectivity of each further ply of a prefix beyond what stats know */
+#define CHESS_PREFIX_PLY_SEL 0.3
+
+typedef struct
+{
+  AnalyzeAttrComputeStatsFunc std_compute_stats;
+  void     *std_extra_data;
+  FmgrInfo  flinfo;         /* to expand dictionary-compressed games */
+} ChessAnalyzeExtraData;
+
+typedef struct
+{
+  uint16    nkeys;
+  uint16    keys[CHESS_STATS_PREFIX_PLIES];
+} ChessPrefixStatKey;
+
+typedef struct
+{
+  ChessPrefixStatKey key;
+  int       count;
+} ChessPrefixStatEntry;
+
+typedef struct
+{
+  uint32    hash;
+  int       count;
+  int       delta;
+  int       lastRow;
+} ChessPositionStatEntry;
+
+/*
+ * Lossy counting (Manku and Motwani) as in ts_typanalyze: a sample of long
+ * games has far more positions than we could keep, so every bucket_width
+ * positions the entries that cannot be frequent any more are dropped.
+ */
+static void
+chess_position_stats_prune(HTAB *positions, int bucket)
+{
+  HASH_SEQ_STATUS status;
+  ChessPositionStatEntry *e;
+
+  hash_seq_init(&status, positions);
+  while ((e = hash_seq_search(&status)) != NULL)
+  {
+    if (e->count + e->delta <= bucket)
+      hash_search(positions, &e->hash, HASH_REMOVE, NULL);
+  }
+}
+
+static int
+chess_prefix_stat_cmp(const void *a, const void *b)
+{
+  int ca = (*(ChessPrefixStatEntry * const *) a)->count;
+  int cb = (*(ChessPrefixStatEntry * const *) b)->count;
+
+  return cb - ca;
+}
+
+static int
+chess_position_stat_cmp(const void *a, const void *b)
+{
+  int ca = (*(ChessPositionStatEntry * const *) a)->count;
+  int cb = (*(ChessPositionStatEntry * const *) b)->count;
+
+  return cb - ca;
+}
+
+/*
+ * Sorts the counted entries and keeps the first max of those seen in more
+ * than one sampled game. Returns the number kept and sets *cutoff.
+ */
+static int
+chess_stats_top(void **entries, int n, int max, int nonnull,
+  int (*cmp) (const void *, const void *), int (*count) (void *),
+  float4 *cutoff)
+{
+  int kept = 0;
+
+  qsort(entries, n, sizeof(void *), cmp);
+  while (kept < n && kept < max && count(entries[kept]) > 1)
+    kept++;
+  *cutoff = (float4) (kept < n ? Max(count(entries[kept]), 1) : 1) / nonnull;
+  return kept;
+}
+
+static int
+chess_prefix_stat_count(void *e)
+{
+  return ((ChessPrefixStatEntry *) e)->count;
+}
+
+static int
+chess_position_stat_count(void *e)
+{
+  return ((ChessPositionStatEntry *) e)->count;
+}
+
+static void
+chess_stats_store(VacAttrStats *stats, int kind, Datum *values, int nvalues,
+  float4 *numbers, Oid typid, int16 typlen, bool typbyval)
+{
+  int slot = 0;
+
+  while (slot < STATISTIC_NUM_SLOTS && stats->stakind[slot] != 0)
+    slot++;
+  if (slot == STATISTIC_NUM_SLOTS)
+    return;
+
+  stats->stakind[slot] = kind;
+  stats->staop[slot] = InvalidOid;
+  stats->stacoll[slot] = InvalidOid;
+  stats->stanumbers[slot] = numbers;
+  stats->numnumbers[slot] = nvalues + 1;
+  stats->stavalues[slot] = values;
+  stats->numvalues[slot] = nvalues;
+  stats->statypid[slot] = typid;
+  stats->statyplen[slot] = typlen;
+  stats->statypbyval[slot] = typbyval;
+  stats->statypalign[slot] = TYPALIGN_INT;
+}
+
+static void
+chessgame_compute_stats(VacAttrStats *stats, AnalyzeAttrFetchFunc fetchfunc,
+  int samplerows, double totalrows)
+{
+  ChessAnalyzeExtraData *extra = (ChessAnalyzeExtraData *) stats->extra_data;
+  int max = stats->attr->attstattarget * 10;
+  int bucketWidth = (max + 10) * 1000 / 7;
+  int bucket = 1;
+  int64 npositions = 0;
+  int nonnull = 0;
+  HTAB *prefixes;
+  HTAB *positions;
+  HASHCTL ctl;
+  HASH_SEQ_STATUS status;
+  void **entries;
+  void *entry;
+  int n;
+  MemoryContext oldcxt;
+  Datum *values;
+  float4 *numbers;
+  float4 cutoff;
+  LOCAL_FCINFO(fcinfo, 0);
+
+  /* Let the standard code compute MCVs, histogram and correlation */
+  stats->extra_data = extra->std_extra_data;
+  extra->std_compute_stats(stats, fetchfunc, samplerows, totalrows);
+  stats->extra_data = extra;
+
+  InitFunctionCallInfoData(*fcinfo, &extra->flinfo, 0, InvalidOid, NULL, NULL);
+
+  ctl.keysize = sizeof(ChessPrefixStatKey);
+  ctl.entrysize = sizeof(ChessPrefixStatEntry);
+  ctl.hcxt = CurrentMemoryContext;
+  prefixes = hash_create("chessgame prefix stats", 1024, &ctl,
+    HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+  ctl.keysize = sizeof(uint32);
+  ctl.entrysize = sizeof(ChessPositionStatEntry);
+  positions = hash_create("chessgame position stats", 16384, &ctl,
+    HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+  for (int row = 0; row < samplerows; row++)
+  {
+    SCL_Record *c;
+    ChessPrefixStatKey key;
+    SCL_Board board;
+    bool isnull;
+    bool found;
+    Datum value;
+    int length;
+
+    vacuum_delay_point();
+
+    value = fetchfunc(stats, row, &isnull);
+    if (isnull)
+      continue;
+    nonnull++;
+
+    c = chessgame_expand(fcinfo, value);
+    length = SCL_recordLength(*c);
+
+    memset(&key, 0, sizeof(key));
+    for (int i = 0; i < length && i < CHESS_STATS_PREFIX_PLIES; i++)
+    {
+      ChessPrefixStatEntry *e;
+
+      key.keys[key.nkeys++] = chessgame_item_key(*c + i * 2);
+      e = hash_search(prefixes, &key, HASH_ENTER, &found);
+      e->count = found ? e->count + 1 : 1;
+    }
+
+    SCL_boardInit(board);
+    for (int i = 0; i <= length; i++)
+    {
+      uint32 hash;
+      ChessPositionStatEntry *e;
+
+      if (i > 0)
+      {
+        uint8_t s0, s1;
+        char p;
+
+        SCL_recordGetMove(*c, i - 1, &s0, &s1, &p);
+        SCL_boardMakeMove(board, s0, s1, p);
+      }
+      hash = SCL_boardHash32(board);
+      e = hash_search(positions, &hash, HASH_ENTER, &found);
+      if (!found)
+      {
+        e->count = 0;
+        e->delta = bucket - 1;
+        e->lastRow = -1;
+      }
+      /* Count games, not occurrences: positions may repeat in a game */
+      if (e->lastRow != row)
+      {
+        e->count++;
+        e->lastRow = row;
+        npositions++;
+      }
+    }
+    pfree(c);
+
+    /* Prune between games so a game never counts a position twice */
+    if (npositions >= (int64) bucketWidth * bucket)
+    {
+      chess_position_stats_prune(positions, bucket);
+      bucket = npositions / bucketWidth + 1;
+    }
+  }
+
+  if (nonnull == 0)
+    return;
+
+  /* Most common prefixes */
+  entries = palloc(sizeof(void *) * Max(hash_get_num_entries(prefixes), 1));
+  n = 0;
+  hash_seq_init(&status, prefixes);
+  while ((entry = hash_seq_search(&status)) != NULL)
+    entries[n++] = entry;
+  n = chess_stats_top(entries, n, max, nonnull, chess_prefix_stat_cmp,
+    chess_prefix_stat_count, &cutoff);
+
+  oldcxt = MemoryContextSwitchTo(stats->anl_context);
+  values = palloc(sizeof(Datum) * Max(n, 1));
+  numbers = palloc(sizeof(float4) * (n + 1));
+  for (int i = 0; i < n; i++)
+  {
+    ChessPrefixStatEntry *e = entries[i];
+
+    values[i] = chess_keys_datum((char *) e->key.keys, e->key.nkeys);
+    numbers[i] = (float4) e->count / nonnull;
+  }
+  numbers[n] = cutoff;
+  MemoryContextSwitchTo(oldcxt);
+  chess_stats_store(stats, STATISTIC_KIND_CHESS_PREFIX, values, n, numbers,
+    BYTEAOID, -1, false);
+  pfree(entries);
+
+  /* Most common positions */
+  entries = palloc(sizeof(void *) * Max(hash_get_num_entries(positions), 1));
+  n = 0;
+  hash_seq_init(&status, positions);
+  while ((entry = hash_seq_search(&status)) != NULL)
+    entries[n++] = entry;
+  n = chess_stats_top(entries, n, max, nonnull, chess_position_stat_cmp,
+    chess_position_stat_count, &cutoff);
+
+  oldcxt = MemoryContextSwitchTo(stats->anl_context);
+  values = palloc(sizeof(Datum) * Max(n, 1));
+  numbers = palloc(sizeof(float4) * (n + 1));
+  for (int i = 0; i < n; i++)
+  {
+    ChessPositionStatEntry *e = entries[i];
+
+    values[i] = Int32GetDatum((int32) e->hash);
+    numbers[i] = (float4) e->count / nonnull;
+  }
+  numbers[n] = cutoff;
+  MemoryContextSwitchTo(oldcxt);
+  chess_stats_store(stats, STATISTIC_KIND_CHESS_POSITION, values, n, numbers,
+    INT4OID, sizeof(int32), true);
+  pfree(entries);
+
+  hash_destroy(prefixes);
+  hash_destroy(positions);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_typanalyze);
+Datum
+chessgame_typanalyze(PG_FUNCTION_ARGS)
+{
+  VacAttrStats *stats = (VacAttrStats *) PG_GETARG_POINTER(0);
+  ChessAnalyzeExtraData *extra;
+
+  if (!std_typanalyze(stats))
+    PG_RETURN_BOOL(false);
+
+  extra = palloc(sizeof(ChessAnalyzeExtraData));
+  extra->std_compute_stats = stats->compute_stats;
+  extra->std_extra_data = stats->extra_data;
+  fmgr_info_copy(&extra->flinfo, fcinfo->flinfo, CurrentMemoryContext);
+  stats->compute_stats = chessgame_compute_stats;
+  stats->extra_data = extra;
+  PG_RETURN_BOOL(true);
+}
+
+/*
+ * Common part of the restriction estimators: finds "column op constant"
+ * with statistics of the given kind and hands the slot to est.
+ */
+typedef Selectivity (*ChessSlotEstimator) (FunctionCallInfo fcinfo,
+  AttStatsSlot *sslot, Datum constval);
+
+static Selectivity
+chess_restriction_sel(FunctionCallInfo fcinfo, int kind, ChessSlotEstimator est)
+{
+  PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+  List *args = (List *) PG_GETARG_POINTER(2);
+  int varRelid = PG_GETARG_INT32(3);
+  VariableStatData vardata;
+  Node *other;
+  bool varonleft;
+  Selectivity selec = DEFAULT_MATCH_SEL;
+
+  if (!get_restriction_variable(root, args, varRelid,
+      &vardata, &other, &varonleft))
+    return selec;
+
+  if (varonleft && IsA(other, Const))
+  {
+    Const *c = (Const *) other;
+    AttStatsSlot sslot;
+
+    if (c->constisnull)
+      selec = 0.0;
+    else if (HeapTupleIsValid(vardata.statsTuple) &&
+      get_attstatsslot(&sslot, vardata.statsTuple, kind, InvalidOid,
+        ATTSTATSSLOT_VALUES | ATTSTATSSLOT_NUMBERS))
+    {
+      Form_pg_statistic stats =
+        (Form_pg_statistic) GETSTRUCT(vardata.statsTuple);
+
+      if (sslot.nnumbers == sslot.nvalues + 1)
+        selec = est(fcinfo, &sslot, c->constvalue) * (1.0 - stats->stanullfrac);
+      free_attstatsslot(&sslot);
+    }
+  }
+  ReleaseVariableStats(vardata);
+  CLAMP_PROBABILITY(selec);
+  return selec;
+}
+
+static Selectivity
+chess_prefix_estimate(FunctionCallInfo fcinfo, AttStatsSlot *sslot,
+  Datum constval)
+{
+  bytea *query = chessgame_to_keys(chessgame_expand(fcinfo, constval));
+  int n = VARSIZE(query) - VARHDRSZ;
+  int nquery = n / sizeof(uint16);
+  float4 cutoff = sslot->numbers[sslot->nvalues];
+  Selectivity ancestor = 1.0;
+  int ancestorLength = 0;
+
+  for (int i = 0; i < sslot->nvalues; i++)
+  {
+    bytea *value = DatumGetByteaPP(sslot->values[i]);
+    int nvalue = VARSIZE_ANY_EXHDR(value) / sizeof(uint16);
+
+    if (nvalue > nquery || nvalue <= ancestorLength ||
+      chess_keys_cmp(VARDATA_ANY(value), VARDATA(query), nvalue) != 0)
+      continue;
+    if (nvalue == nquery)
+      return sslot->numbers[i];
+    ancestor = sslot->numbers[i];
+    ancestorLength = nvalue;
+  }
+
+  if (nquery == 0)
+    return 1.0;
+  ancestor *= pow(CHESS_PREFIX_PLY_SEL, nquery - ancestorLength);
+  if (nquery <= CHESS_STATS_PREFIX_PLIES)
+    ancestor = Min(ancestor, cutoff / 2);
+  return ancestor;
+}
+
+static Selectivity
+chess_position_estimate(FunctionCallInfo fcinfo, AttStatsSlot *sslot,
+  Datum constval)
+{
+  int32 hash = (int32) SCL_boardHash32(*DatumGetChessBoardP(constval));
+
+  for (int i = 0; i < sslot->nvalues; i++)
+    if (DatumGetInt32(sslot->values[i]) == hash)
+      return sslot->numbers[i];
+  return sslot->numbers[sslot->nvalues] / 2;
+}
+
+PG_FUNCTION_INFO_V1(chessgame_prefix_sel);
+Datum
+chessgame_prefix_sel(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_FLOAT8(chess_restriction_sel(fcinfo, STATISTIC_KIND_CHESS_PREFIX,
+    chess_prefix_estimate));
+}
+
+PG_FUNCTION_INFO_V1(chessgame_position_sel);
+Datum
+chessgame_position_sel(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_FLOAT8(chess_restriction_sel(fcinfo, STATISTIC_KIND_CHESS_POSITION,
+    chess_position_estimate));
+}
+
+/* Largest key of a move, h8 to h7 (h8 to h8 is no move) */
+#define CHESS_ITEM_KEY_MAX ((63 << 6) | 62)
+
+/*
+ * Turns the record into the smallest one sorting after every game it is a
+ * prefix of, by bumping the key of its last move; keys with equal squares
+ * are skipped as no move has those. A last move with the largest key is
+ * dropped and the shorter record bumped instead. Returns the new length,
+ * 0 when no record sorts after all those games.
+ */
+static int
+chessgame_record_successor(SCL_Record r, int length)
+{
+  while (length > 0)
+  {
+    uint8_t *item = r + (length - 1) * 2;
+    uint16 key = chessgame_item_key(item);
+    uint8_t from, to;
+
+    if (key < CHESS_ITEM_KEY_MAX)
+    {
+      do
+      {
+        key++;
+        from = ((key >> 6) % 8) * 8 + (key >> 6) / 8;
+        to = ((key & 0x3f) % 8) * 8 + (key & 0x3f) / 8;
+      } while (from == to);
+      item[0] = (item[0] & 0xc0) | from;
+      item[1] = (item[1] & 0xc0) | to;
+      return length;
+    }
+
+    item[0] = item[1] = 0;
+    length--;
+    if (length > 0)
+      item[-2] = (item[-2] & 0x3f) | SCL_RECORD_END;
+  }
+  return 0;
+}
+
+/*
+ * Turns "game ^@ prefix" into "game >= prefix AND game < successor" for
+ * btree indexes, as like_support does for text.
+ */
+PG_FUNCTION_INFO_V1(chessgame_starts_with_support);
+Datum
+chessgame_starts_with_support(PG_FUNCTION_ARGS)
+{
+  Node *rawreq = (Node *) PG_GETARG_POINTER(0);
+  SupportRequestIndexCondition *req;
+  List *args;
+  Node *leftop;
+  Const *prefix;
+  Oid type;
+  Oid geop;
+  Oid ltop;
+  SCL_Record *r;
+  int length;
+  Expr *lower;
+  Expr *upper;
+
+  if (!IsA(rawreq, SupportRequestIndexCondition))
+    PG_RETURN_POINTER(NULL);
+  req = (SupportRequestIndexCondition *) rawreq;
+
+  if (is_opclause(req->node))
+    args = ((OpExpr *) req->node)->args;
+  else if (is_funcclause(req->node))
+    args = ((FuncExpr *) req->node)->args;
+  else
+    PG_RETURN_POINTER(NULL);
+  if (list_length(args) != 2 || req->indexarg != 0 ||
+    !IsA(lsecond(args), Const) || ((Const *) lsecond(args))->constisnull)
+    PG_RETURN_POINTER(NULL);
+
+  leftop = linitial(args);
+  prefix = (Const *) lsecond(args);
+  type = exprType(leftop);
+  geop = get_opfamily_member(req->opfamily, type, type,
+    BTGreaterEqualStrategyNumber);
+  ltop = get_opfamily_member(req->opfamily, type, type, BTLessStrategyNumber);
+  if (!OidIsValid(geop) || !OidIsValid(ltop))
+    PG_RETURN_POINTER(NULL);
+
+  lower = make_opclause(geop, BOOLOID, false, (Expr *) leftop,
+    (Expr *) prefix, InvalidOid, InvalidOid);
+
+  r = chessgame_expand(fcinfo, prefix->constvalue);
+  length = SCL_recordLength(*r);
+  if (length == 0)
+  {
+    req->lossy = false;
+    PG_RETURN_POINTER(list_make1(lower));
+  }
+
+  /* games starting with the last possible moves have no upper bound */
+  req->lossy = true;
+  if (chessgame_record_successor(*r, length) == 0)
+    PG_RETURN_POINTER(list_make1(lower));
+  upper = make_opclause(ltop, BOOLOID, false, (Expr *) leftop,
+    (Expr *) makeConst(type, -1, prefix->constcollid, -1,
+      chessgame_flatten(fcinfo, r), false, false),
+    InvalidOid, InvalidOid);
+
+  PG_RETURN_POINTER(list_make2(lower, upper));
+}
+
+/*****************************************************************************/
+/* Next-move skip scan */
+
+/*
+ * Distinct next moves after a prefix, read from a btree on chessgame. In
+ * the btree order the games continuing the prefix with a given move form
+ * one range, so the scan reads the first entry after the prefix, counts
+ * the range of its next move and restarts at the successor of that range.
+ *
+ * With exact every entry of a range is read and its heap row checked for
+ * visibility, so the call is linear in the games continuing the prefix.
+ * Without it a range is estimated from where its bounds fall in the btree,
+ * a few descents per move whatever the number of games: exactly when both
+ * bounds are on one leaf page, from the index's reltuples otherwise, dead
+ * entries not yet vacuumed included.
+ */
+typedef struct
+{
+  Oid         type;
+  RegProcedure geProc;
+  RegProcedure gtProc;
+  RegProcedure ltProc;
+  IndexScanDesc scan;
+  TupleTableSlot *slot;
+  bool        exact;
+} ChessSkipScan;
+
+static bool
+chess_skip_next(ChessSkipScan *ss)
+{
+  CHECK_FOR_INTERRUPTS();
+  if (ss->exact)
+    return index_getnext_slot(ss->scan, ForwardScanDirection, ss->slot);
+  return index_getnext_tid(ss->scan, ForwardScanDirection) != NULL;
+}
+
+/* Restarts the scan on lower <op> game < upper, upper being optional */
+static void
+chess_skip_rescan(ChessSkipScan *ss, StrategyNumber strategy, Datum lower,
+  Datum upper, bool hasUpper)
+{
+  ScanKeyData keys[2];
+
+  ScanKeyInit(&keys[0], 1, strategy,
+    strategy == BTGreaterStrategyNumber ? ss->gtProc : ss->geProc, lower);
+  if (hasUpper)
+    ScanKeyInit(&keys[1], 1, BTLessStrategyNumber, ss->ltProc, upper);
+  index_rescan(ss->scan, keys, hasUpper ? 2 : 1, NULL, 0);
+}
+
+/*
+ * Position of the first entry >= value among all entries of the index, as
+ * a fraction. The leaf offset is refined upwards by the downlink followed
+ * on each level, as if the subtrees were equally full. Also returns the
+ * leaf page and offset reached.
+ */
+static double
+chess_skip_locate(ChessSkipScan *ss, Datum value, BlockNumber *leaf,
+  OffsetNumber *offset)
+{
+  Relation index = ss->scan->indexRelation;
+  bool isnull = false;
+  IndexTuple itup = index_form_tuple(RelationGetDescr(index), &value, &isnull);
+  BTScanInsert key = _bt_mkscankey(index, itup);
+  BTStack stack;
+  Buffer buf;
+  Page page;
+  OffsetNumber first, low, high;
+  double position = 0.0;
+
+  /* any entry equal to the value, whatever its heap TID */
+  key->scantid = NULL;
+#if PG_VERSION_NUM >= 170000
+  stack = _bt_search(index, ss->scan->heapRelation, key, &buf, BT_READ);
+#elif PG_VERSION_NUM >= 160000
+  stack = _bt_search(index, ss->scan->heapRelation, key, &buf, BT_READ, NULL);
+#else
+  stack = _bt_search(index, key, &buf, BT_READ, NULL);
+#endif
+  *leaf = InvalidBlockNumber;
+  *offset = InvalidOffsetNumber;
+  if (BufferIsValid(buf))
+  {
+    page = BufferGetPage(buf);
+    first = low = P_FIRSTDATAKEY(BTPageGetOpaque(page));
+    high = PageGetMaxOffsetNumber(page) + 1;
+    while (low < high)
+    {
+      OffsetNumber mid = low + (high - low) / 2;
+
+      if (_bt_compare(index, key, page, mid) > 0)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    if (PageGetMaxOffsetNumber(page) >= first)
+      position = (double) (low - first) /
+        (PageGetMaxOffsetNumber(page) - first + 1);
+    *leaf = BufferGetBlockNumber(buf);
+    *offset = low;
+    _bt_relbuf(index, buf);
+  }
+
+  for (BTStack s = stack; s != NULL; s = s->bts_parent)
+  {
+    int n;
+    int i;
+
+    buf = ReadBuffer(index, s->bts_blkno);
+    LockBuffer(buf, BUFFER_LOCK_SHARE);
+    page = BufferGetPage(buf);
+    first = P_FIRSTDATAKEY(BTPageGetOpaque(page));
+    n = Max(PageGetMaxOffsetNumber(page) - first + 1, 1);
+    /* the page may have split since the descent */
+    i = Min(Max(s->bts_offset - first, 0), n - 1);
+    position = (i + position) / n;
+    UnlockReleaseBuffer(buf);
+  }
+
+  _bt_freestack(stack);
+  pfree(key);
+  pfree(itup);
+  return position;
+}
+
+/* Entries between two offsets of a leaf page, posting lists expanded */
+static int64
+chess_skip_leaf_count(Relation index, BlockNumber leaf, OffsetNumber low,
+  OffsetNumber high)
+{
+  Buffer buf = ReadBuffer(index, leaf);
+  Page page;
+  int64 count = 0;
+
+  LockBuffer(buf, BUFFER_LOCK_SHARE);
+  page = BufferGetPage(buf);
+  high = Min(high, PageGetMaxOffsetNumber(page) + 1);
+  for (OffsetNumber off = low; off < high; off = OffsetNumberNext(off))
+  {
+    IndexTuple itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, off));
+
+    count += BTreeTupleIsPosting(itup) ? BTreeTupleGetNPosting(itup) : 1;
+  }
+  UnlockReleaseBuffer(buf);
+  return count;
+}
+
+/* Number of games in lower <= game < upper, upper being optional */
+static int64
+chess_skip_count(ChessSkipScan *ss, Datum lower, Datum upper, bool hasUpper)
+{
+  Relation index = ss->scan->indexRelation;
+  BlockNumber lowerLeaf, upperLeaf;
+  OffsetNumber lowerOffset, upperOffset;
+  double from, to = 1.0;
+  int64 count = 0;
+
+  /* reltuples is unknown until the index was built or vacuumed */
+  if (ss->exact || index->rd_rel->reltuples < 0)
+  {
+    chess_skip_rescan(ss, BTGreaterEqualStrategyNumber, lower, upper,
+      hasUpper);
+    while (chess_skip_next(ss))
+      count++;
+    return count;
+  }
+
+  CHECK_FOR_INTERRUPTS();
+  from = chess_skip_locate(ss, lower, &lowerLeaf, &lowerOffset);
+  if (hasUpper)
+  {
+    to = chess_skip_locate(ss, upper, &upperLeaf, &upperOffset);
+    if (lowerLeaf == upperLeaf && BlockNumberIsValid(lowerLeaf))
+      return chess_skip_leaf_count(index, lowerLeaf, lowerOffset, upperOffset);
+  }
+  /* the range is known not to be empty */
+  return Max((int64) rint((to - from) * index->rd_rel->reltuples), 1);
+}
+
+static RegProcedure
+chess_skip_proc(Relation index, Oid type, StrategyNumber strategy)
+{
+  Oid opno = get_opfamily_member(index->rd_opfamily[0], type, type, strategy);
+
+  if (!OidIsValid(opno))
+    elog(ERROR, "missing operator %d for chessgame in opfamily %u",
+      strategy, index->rd_opfamily[0]);
+  return get_opcode(opno);
+}
+
+PG_FUNCTION_INFO_V1(next_moves);
+Datum
+next_moves(PG_FUNCTION_ARGS)
+{
+  Oid indexoid = PG_GETARG_OID(0);
+  SCL_Record *prefix = PG_GETARG_ChessGame_P(1);
+  ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+  int plies = SCL_recordLength(*prefix);
+  ChessSkipScan ss;
+  Relation index;
+  Relation heap;
+  AclResult aclresult;
+  SCL_Board board;
+  SCL_Record *next;
+  Datum lower;
+  Datum upper = (Datum) 0;
+  bool hasUpper = false;
+  StrategyNumber strategy = BTGreaterStrategyNumber;
+
+  InitMaterializedSRF(fcinfo, 0);
+
+  ss.type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+  ss.exact = PG_GETARG_BOOL(2);
+  index = index_open(indexoid, AccessShareLock);
+  if (index->rd_rel->relam != BTREE_AM_OID ||
+      TupleDescAttr(RelationGetDescr(index), 0)->atttypid != ss.type)
+    ereport(ERROR,
+      (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+       errmsg("\"%s\" is not a btree index on chessgame",
+         RelationGetRelationName(index))));
+
+  heap = table_open(index->rd_index->indrelid, AccessShareLock);
+  aclresult = pg_class_aclcheck(RelationGetRelid(heap), GetUserId(),
+    ACL_SELECT);
+  if (aclresult != ACLCHECK_OK)
+    aclcheck_error(aclresult, OBJECT_TABLE, RelationGetRelationName(heap));
+
+  ss.geProc = chess_skip_proc(index, ss.type, BTGreaterEqualStrategyNumber);
+  ss.gtProc = chess_skip_proc(index, ss.type, BTGreaterStrategyNumber);
+  ss.ltProc = chess_skip_proc(index, ss.type, BTLessStrategyNumber);
+  ss.scan = index_beginscan(heap, index, GetActiveSnapshot(), 2, 0);
+  ss.scan->xs_want_itup = true;
+  ss.slot = ss.exact ? table_slot_create(heap, NULL) : NULL;
+
+  SCL_boardInit(board);
+  SCL_recordApply(*prefix, board, plies);
+
+  /*
+   * Games continuing the prefix sort after it and before its successor, if
+   * it has one: the empty prefix and a prefix of h8-h7 moves have none.
+   */
+  lower = chessgame_flatten(fcinfo, prefix);
+  next = palloc(sizeof(SCL_Record));
+  memcpy(*next, *prefix, sizeof(SCL_Record));
+  if (chessgame_record_successor(*next, plies) > 0)
+  {
+    upper = chessgame_flatten(fcinfo, next);
+    hasUpper = true;
+  }
+
+  while (plies < SCL_RECORD_MAX_LENGTH)
+  {
+    SCL_Record *game;
+    bool isnull;
+    bool last;
+    uint8_t from, to;
+    char promotion;
+    char move[8];
+    int64 count;
+    Datum values[2];
+    bool nulls[2] = {false, false};
+
+    chess_skip_rescan(&ss, strategy, lower, upper, hasUpper);
+    if (!chess_skip_next(&ss))
+      break;
+
+    game = chessgame_expand(fcinfo, index_getattr(ss.scan->xs_itup, 1,
+      ss.scan->xs_itupdesc, &isnull));
+    SCL_recordGetMove(*game, plies, &from, &to, &promotion);
+    pfree(game);
+
+    /* count the range of the prefix followed by this move */
+    memcpy(*next, *prefix, sizeof(SCL_Record));
+    chess_record_append(*next, plies, from, to, promotion);
+    lower = chessgame_flatten(fcinfo, next);
+    last = chessgame_record_successor(*next, plies + 1) == 0;
+    count = chess_skip_count(&ss, lower,
+      last ? (Datum) 0 : chessgame_flatten(fcinfo, next), !last);
+
+    values[0] = PointerGetDatum(cstring_to_text(
+      SCL_moveToString(board, from, to, promotion, move)));
+    values[1] = Int64GetDatum(count);
+    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+
+    /* and skip to the first game with another next move */
+    if (last)
+      break;
+    lower = chessgame_flatten(fcinfo, next);
+    strategy = BTGreaterEqualStrategyNumber;
+  }
+
+  index_endscan(ss.scan);
+  if (ss.slot != NULL)
+    ExecDropSingleTupleTableSlot(ss.slot);
+  table_close(heap, AccessShareLock);
+  index_close(index, AccessShareLock);
+  pfree(next);
+  pfree(prefix);
+  return (Datum) 0;
+}
+
+/*****************************************************************************/
+/* Search */
+
+/*
+ * SCL_boardEvaluateDynamic and SCL_getAIMove keep no state between calls
+ * and cannot be interrupted, so evaluate() and best_move() run their own
+ * alpha-beta search over the library's move generation and static
+ * evaluation. The transposition table and history heuristic live in
+ * fn_extra and stay warm for the whole statement.
+ */
+#define CHESS_SEARCH_MAX_DEPTH  12
+#define CHESS_SEARCH_QDEPTH     4
+#define CHESS_SEARCH_MAX_MOVES  256
+#define CHESS_SEARCH_MAX_PLY    (CHESS_SEARCH_MAX_DEPTH + CHESS_SEARCH_QDEPTH + 1)
+
+#define CHESS_MATE      SCL_EVALUATION_MAX_SCORE
+#define CHESS_MATE_BOUND (CHESS_MATE - CHESS_SEARCH_MAX_PLY)
+#define CHESS_INFINITY  (CHESS_MATE + 1)
+
+#define CHESS_NO_SQUARE 0xff
+
+#define CHESS_TT_EXACT  0
+#define CHESS_TT_LOWER  1
+#define CHESS_TT_UPPER  2
+
+typedef struct
+{
+  uint64    key;
+  int16     score;
+  int8      depth;
+  uint8     bound;
+  uint8     from;
+  uint8     to;
+} ChessTTEntry;
+
+typedef struct
+{
+  uint8     from;
+  uint8     to;
+  int32     order;
+} ChessMove;
+
+typedef struct
+{
+  ChessTTEntry *table;      /* NULL when using the shared table */
+  uint64    mask;
+  int32     history[SCL_BOARD_SQUARES][SCL_BOARD_SQUARES];
+  uint64    nodes;
+  uint64    ttHits;
+  uint64    ttMisses;
+  uint8     rootFrom;
+  uint8     rootTo;
+} ChessSearch;
+
+/*
+ * Shared transposition table. Entries are written without locks: the check
+ * word holds key ^ data, so a torn write (check and data from different
+ * stores) fails the key comparison and simply reads as a miss.
+ */
+typedef struct
+{
+  pg_atomic_uint64 check;
+  pg_atomic_uint64 data;
+} ChessSharedTTEntry;
+
+typedef struct
+{
+  uint64    mask;
+  ChessSharedTTEntry entries[FLEXIBLE_ARRAY_MEMBER];
+} ChessSharedTT;
+
+static ChessSharedTT *chessSharedTT = NULL;
+
+static uint64
+chess_tt_entries(int kilobytes, Size entrySize)
+{
+  uint64 entries = 1024;
+
+  while (entries * 2 * entrySize <= (uint64) kilobytes * 1024)
+    entries *= 2;
+  return entries;
+}
+
+static Size
+chess_shared_tt_size(void)
+{
+  if (sharedTTSize == 0)
+    return 0;
+  return add_size(offsetof(ChessSharedTT, entries),
+    mul_size(chess_tt_entries(sharedTTSize, sizeof(ChessSharedTTEntry)),
+      sizeof(ChessSharedTTEntry)));
+}
+
+static void
+chessgame_shmem_request(void)
+{
+  if (prev_shmem_request_hook)
+    prev_shmem_request_hook();
+  RequestAddinShmemSpace(add_size(chess_shared_tt_size(), sizeof(ChessStats)));
+  if (explorerSize > 0)
+  {
+    RequestAddinShmemSpace(chess_explorer_size());
+    RequestNamedLWLockTranche("chessgame explorer", 1);
+  }
+}
+
+static void
+chessgame_shmem_startup(void)
+{
+  bool found;
+
+  if (prev_shmem_startup_hook)
+    prev_shmem_startup_hook();
+
+  LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+  chessStats = ShmemInitStruct("chessgame stats", sizeof(ChessStats), &found);
+  if (!found)
+    chess_stats_init(chessStats);
+
+  if (sharedTTSize > 0)
+    chessSharedTT = ShmemInitStruct("chessgame transposition table",
+      chess_shared_tt_size(), &found);
+  if (chessSharedTT != NULL && !found)
+  {
+    uint64 entries = chess_tt_entries(sharedTTSize, sizeof(ChessSharedTTEntry));
+
+    chessSharedTT->mask = entries - 1;
+    for (uint64 i = 0; i < entries; i++)
+    {
+      pg_atomic_init_u64(&chessSharedTT->entries[i].check, 0);
+      pg_atomic_init_u64(&chessSharedTT->entries[i].data, 0);
+    }
+  }
+
+  if (explorerSize > 0)
+    chess_explorer_shmem_init();
+  LWLockRelease(AddinShmemInitLock);
+}
+
+static uint64 chessZobrist[CHESS_NPIECES][SCL_BOARD_SQUARES];
+static uint64 chessZobristCastle[256];
+static uint64 chessZobristBlack;
+static bool chessZobristReady = false;
+
+static uint64
+chess_splitmix64(uint64 *state)
+{
+  uint64 z = (*state += UINT64CONST(0x9e3779b97f4a7c15));
+
+  z = (z ^ (z >> 30)) * UINT64CONST(0xbf58476d1ce4e5b9);
+  z = (z ^ (z >> 27)) * UINT64CONST(0x94d049bb133111eb);
+  return z ^ (z >> 31);
+}
+
+/* SCL_boardHash32 collides far too often to key a transposition table */
+static uint64
+chess_zobrist(SCL_Board board)
+{
+  uint64 h;
+
+  if (!chessZobristReady)
+  {
+    uint64 state = 0;
+
+    for (int p = 0; p < CHESS_NPIECES; p++)
+      for (int i = 0; i < SCL_BOARD_SQUARES; i++)
+        chessZobrist[p][i] = chess_splitmix64(&state);
+    for (int i = 0; i < 256; i++)
+      chessZobristCastle[i] = chess_splitmix64(&state);
+    chessZobristBlack = chess_splitmix64(&state);
+    chessZobristReady = true;
+  }
+
+  h = SCL_boardWhitesTurn(board) ? 0 : chessZobristBlack;
+  h ^= chessZobristCastle[(uint8) board[SCL_BOARD_ENPASSANT_CASTLE_BYTE]];
+  for (int i = 0; i < SCL_BOARD_SQUARES; i++)
+    if (board[i] != '.')
+      h ^= chessZobrist[chess_piece_index(board[i])][i];
+  return h;
+}
+
+/* Mate scores are stored relative to the node, not the root */
+static int16
+chess_score_to_tt(int score, int ply)
+{
+  if (score > CHESS_MATE_BOUND)
+    return score + ply;
+  if (score < -CHESS_MATE_BOUND)
+    return score - ply;
+  return score;
+}
+
+static int
+chess_score_from_tt(int16 score, int ply)
+{
+  if (score > CHESS_MATE_BOUND)
+    return score - ply;
+  if (score < -CHESS_MATE_BOUND)
+    return score + ply;
+  return score;
+}
+
+/* Shared entries pack score, depth, bound and move into one word */
+static uint64
+chess_tt_pack(ChessTTEntry *e)
+{
+  return (uint64) (uint16) e->score |
+    ((uint64) (uint8) e->depth << 16) |
+    ((uint64) e->bound << 24) |
+    ((uint64) e->from << 32) |
+    ((uint64) e->to << 40);
+}
+
+static void
+chess_tt_unpack(uint64 data, ChessTTEntry *e)
+{
+  e->score = (int16) (data & 0xffff);
+  e->depth = (int8) ((data >> 16) & 0xff);
+  e->bound = (data >> 24) & 0xff;
+  e->from = (data >> 32) & 0xff;
+  e->to = (data >> 40) & 0xff;
+}
+
+static bool
+chess_tt_probe(ChessSearch *s, uint64 key, ChessTTEntry *result)
+{
+  if (s->table == NULL)
+  {
+    ChessSharedTTEntry *e = &chessSharedTT->entries[key & chessSharedTT->mask];
+    uint64 data = pg_atomic_read_u64(&e->data);
+
+    if ((pg_atomic_read_u64(&e->check) ^ data) != key)
+      return false;
+    result->key = key;
+    chess_tt_unpack(data, result);
+    return true;
+  }
+
+  if (s->table[key & s->mask].key != key)
+    return false;
+  *result = s->table[key & s->mask];
+  return true;
+}
+
+static void
+chess_tt_store(ChessSearch *s, uint64 key, int depth, int score, int ply,
+  uint8 bound, uint8 from, uint8 to)
+{
+  ChessTTEntry entry;
+
+  /* Keep deeper results of the same position */
+  if (chess_tt_probe(s, key, &entry) && entry.depth > depth)
+    return;
+
+  entry.key = key;
+  entry.depth = depth;
+  entry.score = chess_score_to_tt(score, ply);
+  entry.bound = bound;
+  entry.from = from;
+  entry.to = to;
+
+  if (s->table == NULL)
+  {
+    ChessSharedTTEntry *e = &chessSharedTT->entries[key & chessSharedTT->mask];
+    uint64 data = chess_tt_pack(&entry);
+
+    pg_atomic_write_u64(&e->data, data);
+    pg_atomic_write_u64(&e->check, key ^ data);
+  }
+  else
+    s->table[key & s->mask] = entry;
+}
+
+/* Static evaluation from the side to move's point of view */
+static int
+chess_search_static(SCL_Board board, int ply)
+{
+  int score = SCL_boardEvaluateStatic(board);
+
+  if (!SCL_boardWhitesTurn(board))
+    score = -score;
+  if (score <= -SCL_EVALUATION_MAX_SCORE)
+    return -(CHESS_MATE - ply);
+  return score;
+}
+
+static int
+chess_search_moves(ChessSearch *s, SCL_Board board, ChessMove *moves,
+  bool capturesOnly, uint8 ttFrom, uint8 ttTo)
+{
+  bool white = SCL_boardWhitesTurn(board);
+  int n = 0;
+
+  for (uint8 i = 0; i < SCL_BOARD_SQUARES; i++)
+  {
+    SCL_SquareSet set;
+
+    if (board[i] == '.' || SCL_pieceIsWhite(board[i]) != white)
+      continue;
+    SCL_boardGetMoves(board, i, set);
+
+    SCL_SQUARE_SET_ITERATE_BEGIN(set)
+
+      bool capture = board[iteratedSquare] != '.';
+
+      if (capture || !capturesOnly)
+      {
+        ChessMove *m = &moves[n++];
+
+        m->from = i;
+        m->to = iteratedSquare;
+        if (i == ttFrom && iteratedSquare == ttTo)
+          m->order = PG_INT32_MAX;
+        else if (capture)
+          m->order = (1 << 24) +
+            SCL_pieceValuePositive(board[iteratedSquare]) * 16 -
+            SCL_pieceValuePositive(board[i]) / 16;
+        else
+          m->order = s->history[i][iteratedSquare];
+      }
+
+    SCL_SQUARE_SET_ITERATE_END
+  }
+  return n;
+}
+
+/* Moves the best ordered of the remaining moves to position i */
+static void
+chess_search_pick(ChessMove *moves, int i, int n)
+{
+  int best = i;
+
+  for (int j = i + 1; j < n; j++)
+    if (moves[j].order > moves[best].order)
+      best = j;
+  if (best != i)
+  {
+    ChessMove tmp = moves[i];
+
+    moves[i] = moves[best];
+    moves[best] = tmp;
+  }
+}
+
+static int
+chess_search_quiesce(ChessSearch *s, SCL_Board board, int qdepth, int ply,
+  int alpha, int beta)
+{
+  ChessMove moves[CHESS_SEARCH_MAX_MOVES];
+  int standPat;
+  int n;
+
+  CHECK_FOR_INTERRUPTS();
+  s->nodes++;
+
+  standPat = chess_search_static(board, ply);
+  if (standPat >= beta || qdepth == 0 || standPat < -CHESS_MATE_BOUND)
+    return standPat;
+  if (standPat > alpha)
+    alpha = standPat;
+
+  n = chess_search_moves(s, board, moves, true, CHESS_NO_SQUARE,
+    CHESS_NO_SQUARE);
+  for (int i = 0; i < n; i++)
+  {
+    SCL_MoveUndo undo;
+    int score;
+
+    chess_search_pick(moves, i, n);
+    undo = SCL_boardMakeMove(board, moves[i].from, moves[i].to, 'q');
+    score = -chess_search_quiesce(s, board, qdepth - 1, ply + 1, -beta, -alpha);
+    SCL_boardUndoMove(board, undo);
+
+    if (score > alpha)
+      alpha = score;
+    if (alpha >= beta)
+      break;
+  }
+  return alpha;
+}
+
+static int
+chess_search_negamax(ChessSearch *s, SCL_Board board, int depth, int ply,
+  int alpha, int beta)
+{
+  ChessMove moves[CHESS_SEARCH_MAX_MOVES];
+  ChessTTEntry e;
+  uint64 key;
+  uint8 ttFrom = CHESS_NO_SQUARE,
+        ttTo = CHESS_NO_SQUARE;
+  uint8 bestFrom = CHESS_NO_SQUARE,
+        bestTo = CHESS_NO_SQUARE;
+  int origAlpha = alpha;
+  int best = -CHESS_INFINITY;
+  int n;
+
+  if (depth <= 0)
+    return chess_search_quiesce(s, board, CHESS_SEARCH_QDEPTH, ply,
+      alpha, beta);
+
+  CHECK_FOR_INTERRUPTS();
+  s->nodes++;
+
+  key = chess_zobrist(board);
+  if (chess_tt_probe(s, key, &e))
+  {
+    s->ttHits++;
+    ttFrom = e.from;
+    ttTo = e.to;
+    if (e.depth >= depth && ply > 0)
+    {
+      int score = chess_score_from_tt(e.score, ply);
+
+      if (e.bound == CHESS_TT_EXACT ||
+        (e.bound == CHESS_TT_LOWER && score >= beta) ||
+        (e.bound == CHESS_TT_UPPER && score <= alpha))
+        return score;
+    }
+  }
+  else
+    s->ttMisses++;
+
+  n = chess_search_moves(s, board, moves, false, ttFrom, ttTo);
+  if (n == 0)
+    return SCL_boardCheck(board, SCL_boardWhitesTurn(board)) ?
+      -(CHESS_MATE - ply) : 0;
+
+  for (int i = 0; i < n; i++)
+  {
+    SCL_MoveUndo undo;
+    bool quiet;
+    int score;
+
+    chess_search_pick(moves, i, n);
+    quiet = board[moves[i].to] == '.';
+    undo = SCL_boardMakeMove(board, moves[i].from, moves[i].to, 'q');
+    score = -chess_search_negamax(s, board, depth - 1, ply + 1, -beta, -alpha);
+    SCL_boardUndoMove(board, undo);
+
+    if (score > best)
+    {
+      best = score;
+      bestFrom = moves[i].from;
+      bestTo = moves[i].to;
+    }
+    if (score > alpha)
+      alpha = score;
+    if (alpha >= beta)
+    {
+      if (quiet)
+        s->history[moves[i].from][moves[i].to] += depth * depth;
+      break;
+    }
+  }
+
+  if (ply == 0)
+  {
+    s->rootFrom = bestFrom;
+    s->rootTo = bestTo;
+  }
+  chess_tt_store(s, key, depth, best, ply,
+    best <= origAlpha ? CHESS_TT_UPPER :
+    best >= beta ? CHESS_TT_LOWER : CHESS_TT_EXACT,
+    bestFrom, bestTo);
+  return best;
+}
+
+/*
+ * Iterative deepening search of the position, returns the score from
+ * white's point of view like SCL_boardEvaluateDynamic. *from is
+ * CHESS_NO_SQUARE when there is no legal move.
+ */
+static int
+chess_search_root(ChessSearch *s, SCL_Board position, int depth,
+  uint8 *from, uint8 *to)
+{
+  SCL_Board board;
+  int score = 0;
+
+  SCL_boardCopy(position, board);
+  s->rootFrom = s->rootTo = CHESS_NO_SQUARE;
+  s->nodes = s->ttHits = s->ttMisses = 0;
+
+  /* Older cutoffs still help ordering but should not dominate */
+  for (int i = 0; i < SCL_BOARD_SQUARES; i++)
+    for (int j = 0; j < SCL_BOARD_SQUARES; j++)
+      s->history[i][j] /= 2;
+
+  if (depth == 0)
+    score = chess_search_quiesce(s, board, CHESS_SEARCH_QDEPTH, 0,
+      -CHESS_INFINITY, CHESS_INFINITY);
+  for (int d = 1; d <= depth; d++)
+    score = chess_search_negamax(s, board, d, 0,
+      -CHESS_INFINITY, CHESS_INFINITY);
+
+  chess_stats_count(CHESS_STAT_NODES_SEARCHED, s->nodes);
+  chess_stats_count(CHESS_STAT_TT_HITS, s->ttHits);
+  chess_stats_count(CHESS_STAT_TT_MISSES, s->ttMisses);
+
+  *from = s->rootFrom;
+  *to = s->rootTo;
+  return SCL_boardWhitesTurn(board) ? score : -score;
+}
+
+static ChessSearch *
+chess_search_create(MemoryContext cxt)
+{
+  ChessSearch *s = MemoryContextAllocZero(cxt, sizeof(ChessSearch));
+  uint64 entries;
+
+  if (chessSharedTT != NULL)
+    return s;
+
+  entries = chess_tt_entries(searchTTSize, sizeof(ChessTTEntry));
+  s->table = MemoryContextAllocHuge(cxt, entries * sizeof(ChessTTEntry));
+  memset(s->table, 0, entries * sizeof(ChessTTEntry));
+  s->mask = entries - 1;
+  return s;
+}
+
+/* The search state of the calling expression, created on first use */
+static ChessSearch *
+chess_search_get(FunctionCallInfo fcinfo)
+{
+  if (fcinfo->flinfo->fn_extra == NULL)
+    fcinfo->flinfo->fn_extra = chess_search_create(fcinfo->flinfo->fn_mcxt);
+  return (ChessSearch *) fcinfo->flinfo->fn_extra;
+}
+
+static void
+chess_search_check_depth(int depth)
+{
+  if (depth < 0 || depth > CHESS_SEARCH_MAX_DEPTH)
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+      errmsg("search depth must be between 0 and %d", CHESS_SEARCH_MAX_DEPTH)));
+}
+
+PG_FUNCTION_INFO_V1(evaluate);
+Datum
+evaluate(PG_FUNCTION_ARGS)
+{
+  SCL_Board *b = PG_GETARG_ChessBoard_P(0);
+  int depth = PG_GETARG_INT32(1);
+  uint8 from, to;
+  instr_time start;
+  int score;
+
+  chess_search_check_depth(depth);
+  chess_stats_start(&start);
+  score = chess_search_root(chess_search_get(fcinfo), *b, depth, &from, &to);
+  chess_stats_end(CHESS_FN_EVALUATE, &start);
+  PG_RETURN_INT32(score);
+}
+
+PG_FUNCTION_INFO_V1(best_move);
+Datum
+best_move(PG_FUNCTION_ARGS)
+{
+  SCL_Board *b = PG_GETARG_ChessBoard_P(0);
+  int depth = PG_GETARG_INT32(1);
+  char move[8];
+  uint8 from, to;
+  instr_time start;
+
+  chess_search_check_depth(depth);
+  chess_stats_start(&start);
+  chess_search_root(chess_search_get(fcinfo), *b, Max(depth, 1), &from, &to);
+  chess_stats_end(CHESS_FN_BEST_MOVE, &start);
+  if (from == CHESS_NO_SQUARE)
+    PG_RETURN_NULL();
+  PG_RETURN_TEXT_P(cstring_to_text(SCL_moveToString(*b, from, to, 'q', move)));
+}
+
+typedef void (*ChessAnalyseCallback) (void *arg, int ply, int eval,
+  const char *move);
+
+/*
+ * Evaluates every position of the game, start included. The game is
+ * replayed once and consecutive positions share the search state, so most
+ * of each search is already in the transposition table. move is NULL for
+ * positions without legal moves.
+ */
+static void
+chess_search_game(ChessSearch *s, SCL_Record *c, int depth,
+  ChessAnalyseCallback callback, void *arg)
+{
+  int length = SCL_recordLength(*c);
+  SCL_Board board;
+
+  SCL_boardInit(board);
+  for (int ply = 0; ply <= length; ply++)
+  {
+    char move[8];
+    uint8 from, to;
+    int eval;
+
+    if (ply > 0)
+    {
+      uint8_t s0, s1;
+      char p;
+
+      SCL_recordGetMove(*c, ply - 1, &s0, &s1, &p);
+      SCL_boardMakeMove(board, s0, s1, p);
+    }
+
+    eval = chess_search_root(s, board, Max(depth, 1), &from, &to);
+    callback(arg, ply, eval, from == CHESS_NO_SQUARE ? NULL :
+      SCL_moveToString(board, from, to, 'q', move));
+  }
+}
+
+static void
+analyse_game_row(void *arg, int ply, int eval, const char *move)
+{
+  ReturnSetInfo *rsinfo = (ReturnSetInfo *) arg;
+  Datum values[3];
+  bool nulls[3] = {false, false, false};
+
+  values[0] = Int32GetDatum(ply);
+  values[1] = Int32GetDatum(eval);
+  if (move == NULL)
+    nulls[2] = true;
+  else
+    values[2] = PointerGetDatum(cstring_to_text(move));
+  tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+}
+
+PG_FUNCTION_INFO_V1(analyse_game);
+Datum
+analyse_game(PG_FUNCTION_ARGS)
+{
+  SCL_Record *c = PG_GETARG_ChessGame_P(0);
+  int depth = PG_GETARG_INT32(1);
+  instr_time start;
+
+  chess_search_check_depth(depth);
+  chess_stats_start(&start);
+  InitMaterializedSRF(fcinfo, 0);
+  chess_search_game(chess_search_get(fcinfo), c, depth, analyse_game_row,
+    fcinfo->resultinfo);
+  chess_stats_end(CHESS_FN_ANALYSE_GAME, &start);
+  pfree(c);
+  return (Datum) 0;
+}
+
+/*****************************************************************************/
+/* Background analysis workers */
+
+/*
+ * Workers claim batches of chessgame_analysis_queue rows with SKIP LOCKED,
+ * analyse them with a search state kept for the worker's lifetime and
+ * store the results in chessgame_analysis. Claiming a batch and storing
+ * its results is one transaction, each job runs in a subtransaction of
+ * its own: a job that fails is moved to chessgame_analysis_failed with its
+ * error instead of rolling back the claim and being retried forever.
+ */
+PGDLLEXPORT void chessgame_analysis_main(Datum main_arg);
+
+typedef struct
+{
+  int       n;
+  Datum     plies[SCL_RECORD_MAX_LENGTH + 1];
+  Datum     evals[SCL_RECORD_MAX_LENGTH + 1];
+  Datum     moves[SCL_RECORD_MAX_LENGTH + 1];
+  bool      moveNulls[SCL_RECORD_MAX_LENGTH + 1];
+} ChessAnalysisRows;
+
+static SPIPlanPtr analysisClaimPlan = NULL;
+static SPIPlanPtr analysisStorePlan = NULL;
+static SPIPlanPtr analysisFailPlan = NULL;
+
+static void
+chess_analysis_row(void *arg, int ply, int eval, const char *move)
+{
+  ChessAnalysisRows *rows = (ChessAnalysisRows *) arg;
+
+  rows->plies[rows->n] = Int32GetDatum(ply);
+  rows->evals[rows->n] = Int32GetDatum(eval);
+  rows->moveNulls[rows->n] = move == NULL;
+  rows->moves[rows->n] = move == NULL ? (Datum) 0 :
+    PointerGetDatum(cstring_to_text(move));
+  rows->n++;
+}
+
+static void
+chess_analysis_prepare(void)
+{
+  Oid namespace = chessgame_namespace(NULL);
+  const char *schema = quote_identifier(get_namespace_name(namespace));
+  Oid claimTypes[1] = {INT4OID};
+  Oid storeTypes[5] = {INT8OID, INT4OID, INT4ARRAYOID, INT4ARRAYOID,
+                       TEXTARRAYOID};
+  Oid failTypes[5] = {INT8OID, INT4OID, InvalidOid, TIMESTAMPTZOID, TEXTOID};
+
+  failTypes[2] = GetSysCacheOid2(TYPENAMENSP, Anum_pg_type_oid,
+    CStringGetDatum("chessgame"), ObjectIdGetDatum(namespace));
+
+  analysisClaimPlan = SPI_prepare(psprintf(
+    "DELETE FROM %s.chessgame_analysis_queue"
+    " WHERE id IN (SELECT id FROM %s.chessgame_analysis_queue"
+    "   ORDER BY id LIMIT $1 FOR UPDATE SKIP LOCKED)"
+    " RETURNING game_id, depth, game, enqueued", schema, schema), 1,
+    claimTypes);
+  if (analysisClaimPlan == NULL)
+    elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+  SPI_keepplan(analysisClaimPlan);
+
+  analysisStorePlan = SPI_prepare(psprintf(
+    "INSERT INTO %s.chessgame_analysis (game_id, depth, ply, eval, best_move)"
+    " SELECT $1, $2, r.ply, r.eval, r.best_move"
+    " FROM unnest($3, $4, $5) AS r(ply, eval, best_move)"
+    " ON CONFLICT (game_id, ply) DO UPDATE SET depth = excluded.depth,"
+    "   eval = excluded.eval, best_move = excluded.best_move,"
+    "   analysed_at = now()", schema), 5, storeTypes);
+  if (analysisStorePlan == NULL)
+    elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+  SPI_keepplan(analysisStorePlan);
+
+  analysisFailPlan = SPI_prepare(psprintf(
+    "INSERT INTO %s.chessgame_analysis_failed"
+    " (game_id, depth, game, enqueued, error) VALUES ($1, $2, $3, $4, $5)",
+    schema), 5, failTypes);
+  if (analysisFailPlan == NULL)
+    elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+  SPI_keepplan(analysisFailPlan);
+}
+
+/* Analyses one claimed job and stores its results */
+static void
+chess_analysis_job(ChessSearch *s, ChessAnalysisRows *rows, Datum *job)
+{
+  SCL_Record *c;
+  int depth = DatumGetInt32(job[1]);
+  int dims[1];
+  int lbs[1] = {1};
+  Datum storeArgs[5];
+
+  c = chessgame_expand(NULL, job[2]);
+  rows->n = 0;
+  chess_search_check_depth(depth);
+  chess_search_game(s, c, depth, chess_analysis_row, rows);
+  pfree(c);
+
+  dims[0] = rows->n;
+  storeArgs[0] = job[0];
+  storeArgs[1] = job[1];
+  storeArgs[2] = PointerGetDatum(construct_array(rows->plies, rows->n,
+    INT4OID, sizeof(int32), true, TYPALIGN_INT));
+  storeArgs[3] = PointerGetDatum(construct_array(rows->evals, rows->n,
+    INT4OID, sizeof(int32), true, TYPALIGN_INT));
+  storeArgs[4] = PointerGetDatum(construct_md_array(rows->moves,
+    rows->moveNulls, 1, dims, lbs, TEXTOID, -1, false, TYPALIGN_INT));
+  if (SPI_execute_plan(analysisStorePlan, storeArgs, NULL, false, 0) !=
+    SPI_OK_INSERT)
+    elog(ERROR, "could not store chessgame analysis");
+}
+
+/* Analyses one batch of queued games, returns the number of games */
+static int
+chess_analysis_batch(ChessSearch *s)
+{
+  ChessAnalysisRows *rows = palloc(sizeof(ChessAnalysisRows));
+  SPITupleTable *jobs;
+  uint64 njobs = 0;
+  Datum claimArgs[1];
+
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  PushActiveSnapshot(GetTransactionSnapshot());
+
+  if (!OidIsValid(get_extension_oid("chessgame", true)))
+  {
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+    pfree(rows);
+    return 0;
+  }
+
+  SPI_connect();
+  if (analysisClaimPlan == NULL)
+    chess_analysis_prepare();
+
+  pgstat_report_activity(STATE_RUNNING, "chessgame analysis");
+  claimArgs[0] = Int32GetDatum(analysisBatchSize);
+  if (SPI_execute_plan(analysisClaimPlan, claimArgs, NULL, false, 0) !=
+    SPI_OK_DELETE_RETURNING)
+    elog(ERROR, "could not claim chessgame analysis jobs");
+  jobs = SPI_tuptable;
+  njobs = SPI_processed;
+
+  for (uint64 i = 0; i < njobs; i++)
+  {
+    MemoryContext oldcxt = CurrentMemoryContext;
+    ResourceOwner oldowner = CurrentResourceOwner;
+    Datum job[5];
+    bool isnull;
+
+    for (int j = 0; j < 4; j++)
+      job[j] = SPI_getbinval(jobs->vals[i], jobs->tupdesc, j + 1, &isnull);
+
+    BeginInternalSubTransaction(NULL);
+    MemoryContextSwitchTo(oldcxt);
+    PG_TRY();
+    {
+      chess_analysis_job(s, rows, job);
+      ReleaseCurrentSubTransaction();
+      MemoryContextSwitchTo(oldcxt);
+      CurrentResourceOwner = oldowner;
+    }
+    PG_CATCH();
+    {
+      ErrorData *edata;
+
+      MemoryContextSwitchTo(oldcxt);
+      edata = CopyErrorData();
+      FlushErrorState();
+      RollbackAndReleaseCurrentSubTransaction();
+      MemoryContextSwitchTo(oldcxt);
+      CurrentResourceOwner = oldowner;
+
+      ereport(WARNING,
+        (errmsg("chessgame analysis of game %lld failed: %s",
+           (long long) DatumGetInt64(job[0]), edata->message)));
+      job[4] = CStringGetTextDatum(edata->message);
+      if (SPI_execute_plan(analysisFailPlan, job, NULL, false, 0) !=
+        SPI_OK_INSERT)
+        elog(ERROR, "could not record failed chessgame analysis");
+      FreeErrorData(edata);
+    }
+    PG_END_TRY();
+  }
+
+  SPI_finish();
+  PopActiveSnapshot();
+  CommitTransactionCommand();
+  pgstat_report_stat(false);
+  pgstat_report_activity(STATE_IDLE, NULL);
+  pfree(rows);
+  return (int) njobs;
+}
+
+void
+chessgame_analysis_main(Datum main_arg)
+{
+  ChessSearch *s;
+
+  pqsignal(SIGHUP, SignalHandlerForConfigReload);
+  pqsignal(SIGTERM, die);
+  BackgroundWorkerUnblockSignals();
+
+  BackgroundWorkerInitializeConnection(analysisDatabase, NULL, 0);
+  s = chess_search_create(TopMemoryContext);
+
+  for (;;)
+  {
+    CHECK_FOR_INTERRUPTS();
+    if (ConfigReloadPending)
+    {
+      ConfigReloadPending = false;
+      ProcessConfigFile(PGC_SIGHUP);
+    }
+
+    /* A full batch suggests more work is waiting */
+    if (chess_analysis_batch(s) == analysisBatchSize)
+      continue;
+
+    (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+      analysisNaptime, PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+  }
+}
+
+/*****************************************************************************/
+/* Opening explorer */
+
+/*
+ * A tree of the first chessgame.explorer_depth plies of every game of
+ * chessgame.explorer_table, kept in shared memory by a background worker.
+ * Each node counts the games, and their results, that reached it through
+ * the move leading to it. Children are a linked list of siblings, so a
+ * lookup costs the depth times the branching of the nodes on the way.
+ *
+ * The worker adds rows in key order and remembers the highest key seen, so
+ * a refresh only reads new rows. Updated or deleted rows are only
+ * reflected after explorer_rebuild(), and so are rows committed after a
+ * refresh read a higher key: a transaction that took its key from a
+ * sequence before another one but committed after it is skipped. Changing
+ * the table, its columns or the depth rebuilds the tree. Readers take the
+ * lock shared, the worker takes it exclusive for each game it adds.
+ */
+PGDLLEXPORT void chessgame_explorer_main(Datum main_arg);
+
+#define CHESS_EXPLORER_BATCH 10000
+#define CHESS_EXPLORER_NONE  0      /* node 0 is the root, never a child */
+
+typedef struct
+{
+  uint16    move;       /* the two record bytes of the move, flags cleared */
+  uint32    child;
+  uint32    sibling;
+  uint32    games;
+  uint32    white;
+  uint32    draws;
+  uint32    black;
+} ChessExplorerNode;
+
+typedef struct
+{
+  LWLock   *lock;
+  Latch    *latch;      /* of the worker, to wake it up for a rebuild */
+  bool      rebuild;
+  bool      full;       /* some moves did not fit */
+  int32     depth;
+  Oid       relid;      /* table and columns the tree was built from */
+  char      keyColumn[NAMEDATALEN];
+  char      gameColumn[NAMEDATALEN];
+  char      resultColumn[NAMEDATALEN];
+  int64     lastKey;
+  uint32    capacity;
+  uint32    nnodes;
+  ChessExplorerNode nodes[FLEXIBLE_ARRAY_MEMBER];
+} ChessExplorer;
+
+static ChessExplorer *chessExplorer = NULL;
+
+static uint32
+chess_explorer_capacity(void)
+{
+  return Max((uint64) explorerSize * 1024 / sizeof(ChessExplorerNode), 1);
+}
+
+static Size
+chess_explorer_size(void)
+{
+  return add_size(offsetof(ChessExplorer, nodes),
+    mul_size(chess_explorer_capacity(), sizeof(ChessExplorerNode)));
+}
+
+/* Empties the tree, the caller holds the lock or is alone */
+static void
+chess_explorer_clear(ChessExplorer *e)
+{
+  e->rebuild = false;
+  e->full = false;
+  e->depth = explorerDepth;
+  e->relid = InvalidOid;
+  e->keyColumn[0] = e->gameColumn[0] = e->resultColumn[0] = '\0';
+  e->lastKey = PG_INT64_MIN;
+  e->nnodes = 1;
+  memset(&e->nodes[0], 0, sizeof(ChessExplorerNode));
+}
+
+static void
+chess_explorer_shmem_init(void)
+{
+  bool found;
+
+  chessExplorer = ShmemInitStruct("chessgame explorer", chess_explorer_size(),
+    &found);
+  if (!found)
+  {
+    chessExplorer->lock = &(GetNamedLWLockTranche("chessgame explorer"))->lock;
+    chessExplorer->latch = NULL;
+    chessExplorer->capacity = chess_explorer_capacity();
+    chess_explorer_clear(chessExplorer);
+  }
+}
+
+static ChessExplorer *
+chess_explorer_get(void)
+{
+  if (chessExplorer == NULL)
+    ereport(ERROR,
+      (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+       errmsg("chessgame opening explorer is not enabled"),
+       errhint("Add chessgame to shared_preload_libraries and set chessgame.explorer_size.")));
+  return chessExplorer;
+}
+
+static uint16
+chess_explorer_move(SCL_Record r, int ply)
+{
+  return (uint16) ((r[ply * 2] & 0x3f) | (r[ply * 2 + 1] << 8));
+}
+
+static void
+chess_explorer_count(ChessExplorerNode *node, char result)
+{
+  node->games++;
+  if (result == 'w')
+    node->white++;
+  else if (result == 'd')
+    node->draws++;
+  else if (result == 'b')
+    node->black++;
+}
+
+/* Adds the opening of one game, result being 'w', 'd', 'b' or 0 */
+static void
+chess_explorer_add(ChessExplorer *e, SCL_Record r, char result)
+{
+  int plies = Min(SCL_recordLength(r), e->depth);
+  uint32 node = 0;
+
+  chess_explorer_count(&e->nodes[0], result);
+  for (int ply = 0; ply < plies; ply++)
+  {
+    uint16 move = chess_explorer_move(r, ply);
+    uint32 child = e->nodes[node].child;
+
+    while (child != CHESS_EXPLORER_NONE && e->nodes[child].move != move)
+      child = e->nodes[child].sibling;
+
+    if (child == CHESS_EXPLORER_NONE)
+    {
+      if (e->nnodes >= e->capacity)
+      {
+        e->full = true;
+        return;
+      }
+      child = e->nnodes++;
+      memset(&e->nodes[child], 0, sizeof(ChessExplorerNode));
+      e->nodes[child].move = move;
+      e->nodes[child].sibling = e->nodes[node].child;
+      e->nodes[node].child = child;
+    }
+    chess_explorer_count(&e->nodes[child], result);
+    node = child;
+  }
+}
+
+static char
+chess_explorer_result(const char *result)
+{
+  if (strcmp(result, "1-0") == 0)
+    return 'w';
+  if (strcmp(result, "0-1") == 0)
+    return 'b';
+  if (strcmp(result, "1/2-1/2") == 0)
+    return 'd';
+  return 0;
+}
+
+/* Adds the next batch of new rows, returns the number of rows read */
+static int
+chess_explorer_refresh(ChessExplorer *e)
+{
+  Oid relid;
+  Oid argTypes[1] = {INT8OID};
+  Datum args[1];
+  const char *query;
+  uint64 nrows;
+
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  PushActiveSnapshot(GetTransactionSnapshot());
+
+  if (!OidIsValid(get_extension_oid("chessgame", true)))
+  {
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+    return 0;
+  }
+
+  SPI_connect();
+  pgstat_report_activity(STATE_RUNNING, "chessgame explorer refresh");
+
+  relid = DatumGetObjectId(DirectFunctionCall1(regclassin,
+    CStringGetDatum(explorerTable)));
+
+  LWLockAcquire(e->lock, LW_EXCLUSIVE);
+  if (e->rebuild || e->depth != explorerDepth || e->relid != relid ||
+      strncmp(e->keyColumn, explorerKeyColumn, NAMEDATALEN) != 0 ||
+      strncmp(e->gameColumn, explorerGameColumn, NAMEDATALEN) != 0 ||
+      strncmp(e->resultColumn, explorerResultColumn, NAMEDATALEN) != 0)
+  {
+    chess_explorer_clear(e);
+    e->relid = relid;
+    strlcpy(e->keyColumn, explorerKeyColumn, NAMEDATALEN);
+    strlcpy(e->gameColumn, explorerGameColumn, NAMEDATALEN);
+    strlcpy(e->resultColumn, explorerResultColumn, NAMEDATALEN);
+  }
+  args[0] = Int64GetDatum(e->lastKey);
+  LWLockRelease(e->lock);
+
+  query = psprintf(
+    "SELECT %s::int8, %s, %s::text FROM %s"
+    " WHERE %s > $1 ORDER BY %s LIMIT %d",
+    quote_identifier(explorerKeyColumn),
+    quote_identifier(explorerGameColumn),
+    explorerResultColumn[0] == '\0' ? "NULL" :
+      quote_identifier(explorerResultColumn),
+    quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+      get_rel_name(relid)),
+    quote_identifier(explorerKeyColumn),
+    quote_identifier(explorerKeyColumn),
+    CHESS_EXPLORER_BATCH);
+  if (SPI_execute_with_args(query, 1, argTypes, args, NULL, true, 0) !=
+    SPI_OK_SELECT)
+    elog(ERROR, "could not read %s", explorerTable);
+  nrows = SPI_processed;
+
+  for (uint64 i = 0; i < nrows; i++)
+  {
+    HeapTuple tuple = SPI_tuptable->vals[i];
+    TupleDesc desc = SPI_tuptable->tupdesc;
+    bool isnull;
+    int64 key = DatumGetInt64(SPI_getbinval(tuple, desc, 1, &isnull));
+    Datum game = SPI_getbinval(tuple, desc, 2, &isnull);
+    SCL_Record *r = isnull ? NULL : chessgame_expand(NULL, game);
+    char *result = SPI_getvalue(tuple, desc, 3);
+
+    LWLockAcquire(e->lock, LW_EXCLUSIVE);
+    if (r != NULL && !e->rebuild)
+      chess_explorer_add(e, *r, result == NULL ? 0 :
+        chess_explorer_result(result));
+    e->lastKey = key;
+    LWLockRelease(e->lock);
+    if (r != NULL)
+      pfree(r);
+  }
+
+  SPI_finish();
+  PopActiveSnapshot();
+  CommitTransactionCommand();
+  pgstat_report_stat(false);
+  pgstat_report_activity(STATE_IDLE, NULL);
+  return (int) nrows;
+}
+
+void
+chessgame_explorer_main(Datum main_arg)
+{
+  ChessExplorer *e = chessExplorer;
+
+  pqsignal(SIGHUP, SignalHandlerForConfigReload);
+  pqsignal(SIGTERM, die);
+  BackgroundWorkerUnblockSignals();
+
+  BackgroundWorkerInitializeConnection(explorerDatabase, NULL, 0);
+
+  LWLockAcquire(e->lock, LW_EXCLUSIVE);
+  e->latch = MyLatch;
+  LWLockRelease(e->lock);
+
+  for (;;)
+  {
+    CHECK_FOR_INTERRUPTS();
+    if (ConfigReloadPending)
+    {
+      ConfigReloadPending = false;
+      ProcessConfigFile(PGC_SIGHUP);
+    }
+
+    /* A full batch suggests more rows are waiting */
+    if (explorerTable[0] != '\0' &&
+        chess_explorer_refresh(e) == CHESS_EXPLORER_BATCH)
+      continue;
+
+    (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+      explorerNaptime, PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+  }
+}
+
+/* Next moves from the position reached by the game, with their counts */
+PG_FUNCTION_INFO_V1(explore);
+Datum
+explore(PG_FUNCTION_ARGS)
+{
+  SCL_Record *r = PG_GETARG_ChessGame_P(0);
+  ChessExplorer *e = chess_explorer_get();
+  ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+  int length = SCL_recordLength(*r);
+  ChessExplorerNode *children = NULL;
+  int nchildren = 0;
+  SCL_Board board;
+  uint32 node = 0;
+  bool found = true;
+
+  InitMaterializedSRF(fcinfo, 0);
+
+  LWLockAcquire(e->lock, LW_SHARED);
+  for (int ply = 0; ply < length && found; ply++)
+  {
+    uint16 move = chess_explorer_move(*r, ply);
+
+    node = e->nodes[node].child;
+    while (node != CHESS_EXPLORER_NONE && e->nodes[node].move != move)
+      node = e->nodes[node].sibling;
+    found = node != CHESS_EXPLORER_NONE;
+  }
+  if (found)
+  {
+    for (uint32 c = e->nodes[node].child; c != CHESS_EXPLORER_NONE;
+         c = e->nodes[c].sibling)
+      nchildren++;
+    children = palloc(sizeof(ChessExplorerNode) * Max(nchildren, 1));
+    nchildren = 0;
+    for (uint32 c = e->nodes[node].child; c != CHESS_EXPLORER_NONE;
+         c = e->nodes[c].sibling)
+      children[nchildren++] = e->nodes[c];
+  }
+  LWLockRelease(e->lock);
+
+  SCL_boardInit(board);
+  SCL_recordApply(*r, board, length);
+  for (int i = 0; i < nchildren; i++)
+  {
+    Datum values[5];
+    bool nulls[5] = {false, false, false, false, false};
+    char move[8];
+    uint8 from = children[i].move & 0x3f;
+    uint8 to = (children[i].move >> 8) & 0x3f;
+    char prom = "qrbn"[(children[i].move >> 14) & 0x03];
+
+    values[0] = PointerGetDatum(cstring_to_text(
+      SCL_moveToString(board, from, to, prom, move)));
+    values[1] = Int64GetDatum(children[i].games);
+    values[2] = Int64GetDatum(children[i].white);
+    values[3] = Int64GetDatum(children[i].draws);
+    values[4] = Int64GetDatum(children[i].black);
+    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+  }
+  pfree(r);
+  return (Datum) 0;
+}
+
+/* Asks the worker to build the tree again from the whole table */
+PG_FUNCTION_INFO_V1(explorer_rebuild);
+Datum
+explorer_rebuild(PG_FUNCTION_ARGS)
+{
+  ChessExplorer *e = chess_explorer_get();
+
+  LWLockAcquire(e->lock, LW_EXCLUSIVE);
+  e->rebuild = true;
+  if (e->latch != NULL)
+    SetLatch(e->latch);
+  LWLockRelease(e->lock);
+  PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(explorer_status);
+Datum
+explorer_status(PG_FUNCTION_ARGS)
+{
+  ChessExplorer *e = chess_explorer_get();
+  TupleDesc tupdesc;
+  Datum values[5];
+  bool nulls[5] = {false, false, false, false, false};
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "return type must be a row type");
+
+  LWLockAcquire(e->lock, LW_SHARED);
+  values[0] = Int64GetDatum(e->nodes[0].games);
+  values[1] = Int64GetDatum(e->nnodes);
+  values[2] = Int64GetDatum(e->capacity);
+  values[3] = BoolGetDatum(e->full);
+  values[4] = Int64GetDatum(e->lastKey);
+  nulls[4] = e->lastKey == PG_INT64_MIN;
+  LWLockRelease(e->lock);
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*****************************************************************************/
+/* Approximate position aggregates */
+
+/*
+ * approx_distinct_positions() is a HyperLogLog sketch of the Zobrist hashes
+ * of the positions seen, and top_positions() a Space-Saving summary of
+ * them: k counters, each new position replacing the smallest one, whose
+ * count it inherits as its error. Both states are internal, with combine,
+ * serialize and deserialize functions so that they run in parallel.
+ * A game contributes every position it reaches, start included, a board
+ * just itself.
+ */
+#define CHESS_HLL_BITS      14
+#define CHESS_HLL_REGISTERS (1 << CHESS_HLL_BITS)
+#define CHESS_TOP_MAX_K     10000
+
+typedef struct
+{
+  uint8     registers[CHESS_HLL_REGISTERS];
+} ChessHLL;
+
+typedef struct
+{
+  uint64    hash;
+  int64     count;
+  int64     error;
+  int32     slot;       /* in ChessTopState.table */
+  SCL_Board board;
+} ChessTopEntry;
+
+/*
+ * The entries form a min-heap on count, so the counter to replace is the
+ * root. table is an open addressing index of the entries by hash, holding
+ * heap positions plus one.
+ */
+typedef struct
+{
+  int       k;
+  int       n;
+  uint32    mask;
+  int32    *table;
+  ChessTopEntry *heap;
+} ChessTopState;
+
+typedef void (*ChessPositionCallback) (void *arg, SCL_Board board);
+
+/* Calls back with every position of the game, start included */
+static void
+chess_game_positions(SCL_Record *r, ChessPositionCallback callback, void *arg)
+{
+  int length = SCL_recordLength(*r);
+  SCL_Board board;
+
+  SCL_boardInit(board);
+  callback(arg, board);
+  for (int i = 0; i < length; i++)
+  {
+    uint8_t s0, s1;
+    char p;
+
+    SCL_recordGetMove(*r, i, &s0, &s1, &p);
+    SCL_boardMakeMove(board, s0, s1, p);
+    callback(arg, board);
+  }
+  chess_stats_count(CHESS_STAT_PLIES_APPLIED, length);
+}
+
+static MemoryContext
+chess_agg_context(FunctionCallInfo fcinfo)
+{
+  MemoryContext aggcontext;
+
+  if (!AggCheckCallContext(fcinfo, &aggcontext))
+    elog(ERROR, "chessgame aggregate function called in non-aggregate context");
+  return aggcontext;
+}
+
+static void
+chess_hll_add(void *arg, SCL_Board board)
+{
+  ChessHLL *hll = (ChessHLL *) arg;
+  uint64 hash = chess_zobrist(board);
+  uint32 index = hash >> (64 - CHESS_HLL_BITS);
+  uint64 rest = hash << CHESS_HLL_BITS;
+  uint8 rank = rest == 0 ? 64 - CHESS_HLL_BITS + 1 :
+    64 - pg_leftmost_one_pos64(rest);
+
+  if (rank > hll->registers[index])
+    hll->registers[index] = rank;
+}
+
+static ChessHLL *
+chess_hll_state(FunctionCallInfo fcinfo)
+{
+  if (PG_ARGISNULL(0))
+    return MemoryContextAllocZero(chess_agg_context(fcinfo), sizeof(ChessHLL));
+  return (ChessHLL *) PG_GETARG_POINTER(0);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_hll_trans);
+Datum
+chessgame_hll_trans(PG_FUNCTION_ARGS)
+{
+  ChessHLL *hll = chess_hll_state(fcinfo);
+
+  if (!PG_ARGISNULL(1))
+  {
+    SCL_Record *r = PG_GETARG_ChessGame_P(1);
+
+    chess_game_positions(r, chess_hll_add, hll);
+    pfree(r);
+  }
+  PG_RETURN_POINTER(hll);
+}
+
+PG_FUNCTION_INFO_V1(chessboard_hll_trans);
+Datum
+chessboard_hll_trans(PG_FUNCTION_ARGS)
+{
+  ChessHLL *hll = chess_hll_state(fcinfo);
+
+  if (!PG_ARGISNULL(1))
+    chess_hll_add(hll, *PG_GETARG_ChessBoard_P(1));
+  PG_RETURN_POINTER(hll);
+}
+
+PG_FUNCTION_INFO_V1(chess_hll_combine);
+Datum
+chess_hll_combine(PG_FUNCTION_ARGS)
+{
+  ChessHLL *a;
+  ChessHLL *b;
+
+  if (PG_ARGISNULL(1))
+    PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+  b = (ChessHLL *) PG_GETARG_POINTER(1);
+  if (PG_ARGISNULL(0))
+  {
+    a = MemoryContextAlloc(chess_agg_context(fcinfo), sizeof(ChessHLL));
+    memcpy(a, b, sizeof(ChessHLL));
+    PG_RETURN_POINTER(a);
+  }
+  a = (ChessHLL *) PG_GETARG_POINTER(0);
+  for (int i = 0; i < CHESS_HLL_REGISTERS; i++)
+    a->registers[i] = Max(a->registers[i], b->registers[i]);
+  PG_RETURN_POINTER(a);
+}
+
+PG_FUNCTION_INFO_V1(chess_hll_serialize);
+Datum
+chess_hll_serialize(PG_FUNCTION_ARGS)
+{
+  ChessHLL *hll = (ChessHLL *) PG_GETARG_POINTER(0);
+  bytea *result = palloc(VARHDRSZ + sizeof(ChessHLL));
+
+  SET_VARSIZE(result, VARHDRSZ + sizeof(ChessHLL));
+  memcpy(VARDATA(result), hll, sizeof(ChessHLL));
+  PG_RETURN_BYTEA_P(result);
+}
+
+PG_FUNCTION_INFO_V1(chess_hll_deserialize);
+Datum
+chess_hll_deserialize(PG_FUNCTION_ARGS)
+{
+  bytea *data = PG_GETARG_BYTEA_PP(0);
+  ChessHLL *hll;
+
+  if (VARSIZE_ANY_EXHDR(data) != sizeof(ChessHLL))
+    elog(ERROR, "invalid chessgame HyperLogLog state");
+  hll = MemoryContextAlloc(chess_agg_context(fcinfo), sizeof(ChessHLL));
+  memcpy(hll, VARDATA_ANY(data), sizeof(ChessHLL));
+  PG_RETURN_POINTER(hll);
+}
+
+/* Raw estimate, with linear counting while registers are still empty */
+PG_FUNCTION_INFO_V1(chess_hll_final);
+Datum
+chess_hll_final(PG_FUNCTION_ARGS)
+{
+  ChessHLL *hll;
+  double m = CHESS_HLL_REGISTERS;
+  double sum = 0;
+  int zeros = 0;
+  double estimate;
+
+  if (PG_ARGISNULL(0))
+    PG_RETURN_INT64(0);
+  hll = (ChessHLL *) PG_GETARG_POINTER(0);
+
+  for (int i = 0; i < CHESS_HLL_REGISTERS; i++)
+  {
+    sum += ldexp(1.0, -hll->registers[i]);
+    if (hll->registers[i] == 0)
+      zeros++;
+  }
+  estimate = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+  if (estimate <= 2.5 * m && zeros > 0)
+    estimate = m * log(m / zeros);
+  PG_RETURN_INT64((int64) rint(estimate));
+}
+
+static ChessTopState *
+chess_top_create(MemoryContext cxt, int k)
+{
+  ChessTopState *top = MemoryContextAlloc(cxt, sizeof(ChessTopState));
+  uint32 size = pg_nextpower2_32(k * 2);
+
+  top->k = k;
+  top->n = 0;
+  top->mask = size - 1;
+  top->table = MemoryContextAllocZero(cxt, sizeof(int32) * size);
+  top->heap = MemoryContextAlloc(cxt, sizeof(ChessTopEntry) * k);
+  return top;
+}
+
+/* Slot of the hash, or of the empty slot where it would go */
+static uint32
+chess_top_slot(ChessTopState *top, uint64 hash)
+{
+  uint32 slot = (uint32) hash & top->mask;
+
+  while (top->table[slot] != 0 && top->heap[top->table[slot] - 1].hash != hash)
+    slot = (slot + 1) & top->mask;
+  return slot;
+}
+
+/* Backward shift deletion keeps the probe sequences unbroken */
+static void
+chess_top_unindex(ChessTopState *top, uint32 slot)
+{
+  uint32 next = (slot + 1) & top->mask;
+
+  while (top->table[next] != 0)
+  {
+    ChessTopEntry *e = &top->heap[top->table[next] - 1];
+    uint32 home = (uint32) e->hash & top->mask;
+
+    if (((next - home) & top->mask) >= ((next - slot) & top->mask))
+    {
+      top->table[slot] = top->table[next];
+      e->slot = slot;
+      slot = next;
+    }
+    next = (next + 1) & top->mask;
+  }
+  top->table[slot] = 0;
+}
+
+static void
+chess_top_swap(ChessTopState *top, int a, int b)
+{
+  ChessTopEntry tmp = top->heap[a];
+
+  top->heap[a] = top->heap[b];
+  top->heap[b] = tmp;
+  top->table[top->heap[a].slot] = a + 1;
+  top->table[top->heap[b].slot] = b + 1;
+}
+
+static void
+chess_top_sift_up(ChessTopState *top, int i)
+{
+  while (i > 0 && top->heap[(i - 1) / 2].count > top->heap[i].count)
+  {
+    chess_top_swap(top, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void
+chess_top_sift_down(ChessTopState *top, int i)
+{
+  for (;;)
+  {
+    int smallest = i;
+    int l = 2 * i + 1;
+    int r = l + 1;
+
+    if (l < top->n && top->heap[l].count < top->heap[smallest].count)
+      smallest = l;
+    if (r < top->n && top->heap[r].count < top->heap[smallest].count)
+      smallest = r;
+    if (smallest == i)
+      return;
+    chess_top_swap(top, i, smallest);
+    i = smallest;
+  }
+}
+
+static void
+chess_top_add_counted(ChessTopState *top, uint64 hash, const char *board,
+  int64 count, int64 error)
+{
+  uint32 slot = chess_top_slot(top, hash);
+  ChessTopEntry *e;
+
+  if (top->table[slot] != 0)
+  {
+    int i = top->table[slot] - 1;
+
+    top->heap[i].count += count;
+    top->heap[i].error += error;
+    chess_top_sift_down(top, i);
+    return;
+  }
+
+  if (top->n < top->k)
+  {
+    e = &top->heap[top->n];
+    e->count = count;
+    e->error = error;
+    top->table[slot] = ++top->n;
+  }
+  else
+  {
+    /* the new position takes over the smallest counter */
+    e = &top->heap[0];
+    chess_top_unindex(top, e->slot);
+    e->error = e->count + error;
+    e->count += count;
+    slot = chess_top_slot(top, hash);
+    top->table[slot] = 1;
+  }
+  e->hash = hash;
+  e->slot = slot;
+  memcpy(e->board, board, sizeof(SCL_Board));
+  if (e == &top->heap[0] && top->n == top->k)
+    chess_top_sift_down(top, 0);
+  else
+    chess_top_sift_up(top, top->n - 1);
+}
+
+static void
+chess_top_add(void *arg, SCL_Board board)
+{
+  chess_top_add_counted((ChessTopState *) arg, chess_zobrist(board), board,
+    1, 0);
+}
+
+static ChessTopState *
+chess_top_state(FunctionCallInfo fcinfo)
+{
+  int k;
+
+  if (!PG_ARGISNULL(0))
+    return (ChessTopState *) PG_GETARG_POINTER(0);
+
+  k = PG_ARGISNULL(2) ? 0 : PG_GETARG_INT32(2);
+  if (k < 1 || k > CHESS_TOP_MAX_K)
+    ereport(ERROR,
+      (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+       errmsg("number of positions must be between 1 and %d",
+         CHESS_TOP_MAX_K)));
+  return chess_top_create(chess_agg_context(fcinfo), k);
+}
+
+PG_FUNCTION_INFO_V1(chessgame_top_trans);
+Datum
+chessgame_top_trans(PG_FUNCTION_ARGS)
+{
+  ChessTopState *top = chess_top_state(fcinfo);
+
+  if (!PG_ARGISNULL(1))
+  {
+    SCL_Record *r = PG_GETARG_ChessGame_P(1);
+
+    chess_game_positions(r, chess_top_add, top);
+    pfree(r);
+  }
+  PG_RETURN_POINTER(top);
+}
+
+PG_FUNCTION_INFO_V1(chessboard_top_trans);
+Datum
+chessboard_top_trans(PG_FUNCTION_ARGS)
+{
+  ChessTopState *top = chess_top_state(fcinfo);
+
+  if (!PG_ARGISNULL(1))
+    chess_top_add(top, *PG_GETARG_ChessBoard_P(1));
+  PG_RETURN_POINTER(top);
+}
+
+static int
+chess_top_entry_cmp(const void *a, const void *b)
+{
+  int64 x = ((const ChessTopEntry *) a)->count;
+  int64 y = ((const ChessTopEntry *) b)->count;
+
+  return x > y ? -1 : x < y ? 1 : 0;
+}
+
+/*
+ * Merges two summaries as in Agarwal et al., "Mergeable Summaries": a
+ * position missing from a full summary may have been counted up to its
+ * smallest counter, which is added to both its count and its error. The
+ * k largest of the merged counters are kept.
+ */
+PG_FUNCTION_INFO_V1(chess_top_combine);
+Datum
+chess_top_combine(PG_FUNCTION_ARGS)
+{
+  MemoryContext aggcontext = chess_agg_context(fcinfo);
+  ChessTopState *a;
+  ChessTopState *b;
+  ChessTopState *result;
+  ChessTopEntry *merged;
+  int64 minA, minB;
+  int n = 0;
+
+  if (PG_ARGISNULL(1))
+    PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+  b = (ChessTopState *) PG_GETARG_POINTER(1);
+  if (PG_ARGISNULL(0))
+    a = chess_top_create(aggcontext, b->k);
+  else
+    a = (ChessTopState *) PG_GETARG_POINTER(0);
+
+  minA = a->n == a->k ? a->heap[0].count : 0;
+  minB = b->n == b->k ? b->heap[0].count : 0;
+  merged = palloc(sizeof(ChessTopEntry) * (a->n + b->n));
+
+  for (int i = 0; i < a->n; i++)
+  {
+    uint32 slot = chess_top_slot(b, a->heap[i].hash);
+
+    merged[n] = a->heap[i];
+    if (b->table[slot] != 0)
+    {
+      merged[n].count += b->heap[b->table[slot] - 1].count;
+      merged[n].error += b->heap[b->table[slot] - 1].error;
+    }
+    else
+    {
+      merged[n].count += minB;
+      merged[n].error += minB;
+    }
+    n++;
+  }
+  for (int i = 0; i < b->n; i++)
+  {
+    if (a->table[chess_top_slot(a, b->heap[i].hash)] != 0)
+      continue;
+    merged[n] = b->heap[i];
+    merged[n].count += minA;
+    merged[n].error += minA;
+    n++;
+  }
+
+  qsort(merged, n, sizeof(ChessTopEntry), chess_top_entry_cmp);
+  result = chess_top_create(aggcontext, Max(a->k, b->k));
+  for (int i = 0; i < Min(n, result->k); i++)
+    chess_top_add_counted(result, merged[i].hash, merged[i].board,
+      merged[i].count, merged[i].error);
+  pfree(merged);
+  PG_RETURN_POINTER(result);
+}
+
+PG_FUNCTION_INFO_V1(chess_top_serialize);
+Datum
+chess_top_serialize(PG_FUNCTION_ARGS)
+{
+  ChessTopState *top = (ChessTopState *) PG_GETARG_POINTER(0);
+  StringInfoData buf;
+
+  pq_begintypsend(&buf);
+  pq_sendint32(&buf, top->k);
+  pq_sendint32(&buf, top->n);
+  for (int i = 0; i < top->n; i++)
+  {
+    pq_sendint64(&buf, top->heap[i].hash);
+    pq_sendint64(&buf, top->heap[i].count);
+    pq_sendint64(&buf, top->heap[i].error);
+    pq_sendbytes(&buf, top->heap[i].board, sizeof(SCL_Board));
+  }
+  PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+PG_FUNCTION_INFO_V1(chess_top_deserialize);
+Datum
+chess_top_deserialize(PG_FUNCTION_ARGS)
+{
+  bytea *data = PG_GETARG_BYTEA_PP(0);
+  StringInfoData buf;
+  ChessTopState *top;
+  int k;
+  int n;
+
+  initStringInfo(&buf);
+  appendBinaryStringInfo(&buf, VARDATA_ANY(data), VARSIZE_ANY_EXHDR(data));
+  k = pq_getmsgint(&buf, 4);
+  n = pq_getmsgint(&buf, 4);
+  if (k < 1 || k > CHESS_TOP_MAX_K || n < 0 || n > k)
+    elog(ERROR, "invalid chessgame top positions state");
+
+  top = chess_top_create(chess_agg_context(fcinfo), k);
+  for (int i = 0; i < n; i++)
+  {
+    uint64 hash = pq_getmsgint64(&buf);
+    int64 count = pq_getmsgint64(&buf);
+    int64 error = pq_getmsgint64(&buf);
+    const char *board = pq_getmsgbytes(&buf, sizeof(SCL_Board));
+
+    chess_top_add_counted(top, hash, board, count, error);
+  }
+  pq_getmsgend(&buf);
+  pfree(buf.data);
+  PG_RETURN_POINTER(top);
+}
+
+/* The counters as position_count rows, most frequent first */
+PG_FUNCTION_INFO_V1(chess_top_final);
+Datum
+chess_top_final(PG_FUNCTION_ARGS)
+{
+  ChessTopState *top;
+  ChessTopEntry *entries;
+  Oid elemtype = get_element_type(get_fn_expr_rettype(fcinfo->flinfo));
+  TupleDesc tupdesc;
+  Datum *elems;
+  int16 typlen;
+  bool typbyval;
+  char typalign;
+
+  if (PG_ARGISNULL(0))
+    PG_RETURN_NULL();
+  top = (ChessTopState *) PG_GETARG_POINTER(0);
+
+  entries = palloc(sizeof(ChessTopEntry) * Max(top->n, 1));
+  memcpy(entries, top->heap, sizeof(ChessTopEntry) * top->n);
+  qsort(entries, top->n, sizeof(ChessTopEntry), chess_top_entry_cmp);
+
+  tupdesc = lookup_rowtype_tupdesc(elemtype, -1);
+  elems = palloc(sizeof(Datum) * Max(top->n, 1));
+  for (int i = 0; i < top->n; i++)
+  {
+    Datum values[3];
+    bool nulls[3] = {false, false, false};
+    SCL_Board *board = palloc(sizeof(SCL_Board));
+
+    memcpy(*board, entries[i].board, sizeof(SCL_Board));
+    values[0] = ChessBoardPGetDatum(board);
+    values[1] = Int64GetDatum(entries[i].count);
+    values[2] = Int64GetDatum(entries[i].error);
+    elems[i] = HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls));
+  }
+  ReleaseTupleDesc(tupdesc);
+
+  get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+  PG_RETURN_ARRAYTYPE_P(construct_array(elems, top->n, elemtype, typlen,
+    typbyval, typalign));
+}
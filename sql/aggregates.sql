@@ -0,0 +1,17 @@
+CREATE TABLE many AS
+  SELECT i AS id,
+    CASE WHEN i % 2 = 0 THEN from_uci('e2e4 e7e5')
+      ELSE from_uci('d2d4 d7d5') END AS g
+  FROM generate_series(1, 2000) i;
+
+-- Partial summaries of parallel workers are merged by chess_top_combine
+SET max_parallel_workers_per_gather = 2;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SELECT p.count, p.error
+  FROM (SELECT top_positions(g, 10) AS top FROM many) s, unnest(s.top) p
+  LIMIT 1;
+SELECT count(*) AS positions, sum(p.count) AS total, max(p.error) AS max_error
+  FROM (SELECT top_positions(g, 10) AS top FROM many) s, unnest(s.top) p;
+RESET ALL;
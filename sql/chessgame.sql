@@ -0,0 +1,24 @@
+CREATE EXTENSION chessgame;
+
+-- PGN input is stored move by move and written back with coordinates
+SELECT '1. e4 e5 2. Nf3 Nc6'::chessgame AS game;
+SELECT '1. e4 e5 2. Nf3 Nc6'::chessgame = from_uci('e2e4 e7e5 g1f3 b8c6') AS same;
+SELECT '1. e4 e5 2. Nf3 Nc6'::chessgame::text::chessgame
+  = '1. e4 e5 2. Nf3 Nc6'::chessgame AS round_trip;
+
+-- Coordinate moves in and out
+SELECT to_uci(from_uci('e2e4 e7e5 g1f3 b8c6')) AS moves;
+SET chessgame.output_format = uci;
+SELECT 'd2d4 d7d5 c2c4'::chessgame AS game;
+SELECT 'd2d4 d7d5 c2c4'::chessgame::text::chessgame
+  = from_uci('d2d4 d7d5 c2c4') AS round_trip;
+RESET chessgame.output_format;
+
+-- Moves in SAN or coordinates appended to a game
+SELECT to_uci(from_uci('e2e4') + 'e5' + 'Nf3' + 'b8c6') AS moves;
+
+-- Moves of the wrong side and promotion suffixes on moves that do not promote
+SELECT from_uci('e2e4 e2e4');
+SELECT from_uci('e2e4q');
+SELECT from_uci('e2e4') + 'e5=Q';
+SELECT from_uci('e2e4') + 'e7e5q';
@@ -0,0 +1,39 @@
+CREATE TABLE games (id integer, g chessgame);
+INSERT INTO games VALUES
+  (1, from_uci('h2h4 h7h5 a2a3 h8h7')),
+  (2, from_uci('h2h4 h7h5 a2a3 h8h7 a3a4')),
+  (3, from_uci('h2h4 h7h5 a2a3 h8h7 b2b3')),
+  (4, from_uci('h2h4 h7h5 a2a3 g8f6')),
+  (5, from_uci('h2h4 h7h5 a2a4'));
+CREATE INDEX games_g_idx ON games (g);
+CREATE INDEX games_g_ngram_idx ON games USING gin (g chessgame_ngram_ops);
+SET enable_seqscan = off;
+
+-- h8-h7 is the largest move: the range of a prefix ending with it stops
+-- at the successor of the shorter prefix
+SELECT array_agg(id ORDER BY id) AS ids FROM games
+  WHERE g ^@ from_uci('h2h4 h7h5 a2a3 h8h7');
+SELECT array_agg(id ORDER BY id) AS ids FROM games
+  WHERE g ^@ from_uci('h2h4 h7h5 a2a3');
+
+-- Next moves, estimated from the index and exact
+SELECT * FROM next_moves('games_g_idx', from_uci('h2h4 h7h5 a2a3'));
+SELECT * FROM next_moves('games_g_idx', from_uci('h2h4 h7h5 a2a3'), true);
+
+-- Move sequences may start mid-game and with black
+SELECT from_uci('e2e4 e7e5 g1f3 b8c6 f1b5') @@ 'g1f3 b8c6 f1b5' AS white,
+  from_uci('d2d4 d7d5 c2c4') @@ 'd7d5 c2c4' AS black,
+  from_uci('d2d4 d7d5 c2c4') @@ 'c2c4 d7d5' AS reversed;
+SELECT array_agg(id ORDER BY id) AS ids FROM games WHERE g @@ 'h7h5 a2a3 h8h7';
+SELECT array_agg(id ORDER BY id) AS ids FROM games WHERE g @@ 'a2a3 h8h7 b2b3';
+RESET enable_seqscan;
+
+-- The cached set of boards follows a PL/pgSQL variable
+CREATE FUNCTION any_board(game chessgame, boards chessboard[])
+  RETURNS boolean LANGUAGE plpgsql AS $$
+BEGIN
+  RETURN hasAnyBoard(game, boards);
+END
+$$;
+SELECT any_board(from_uci('e2e4 e7e5'), ARRAY[getBoard(from_uci('e2e4'), 1)]) AS reached,
+  any_board(from_uci('e2e4 e7e5'), ARRAY[getBoard(from_uci('d2d4'), 1)]) AS missed;